@@ -24,6 +24,39 @@ This program implements the sphere sampling algorithm discussed in accompanying
 documentation. We use gene pair coexpression score as input.
 */
 
+// Define this to sample balls of a fixed number of nearest genes instead of
+// spheres of a fixed radius. One null distribution then serves all of them.
+//#define NEAREST_GENE_BALLS
+
+// Define this to take sphere centers from a scrambled Sobol sequence instead
+// of independent uniform draws, covering the box evenly with fewer spheres.
+//#define SOBOL_CENTERS
+
+// Define this to take sphere centers by Poisson-disk dart throwing instead,
+// one sphere radius apart
+//#define POISSON_DISK_CENTERS
+
+// Define this to stop sampling spheres once most genes are in enough of them.
+// sampleCount is then only a cap on the number of spheres (the target
+// is coveredGeneFraction in SphereTest.h).
+//#define COVERAGE_STOPPING
+
+// Define this to run the test on every coordinate model of the genes (Loci and
+// the LociModels table), with null tables shared by all models
+//#define COORDINATE_MODELS
+
+// Define this to run several replicates of the test at once and combine their
+// fields into consensus fields
+//#define REPLICATES
+
+// Define this to test windows of consecutive genes along each chromosome
+// instead of spheres, as a linear-genome baseline
+//#define LINEAR_WINDOWS
+
+// Define this to screen spheres by z-score before the Monte Carlo test, so that
+// only spheres near the significance boundary get a Monte Carlo p-value
+//#define Z_SCORE_SCREENING
+
 // Settings
 namespace {
 
@@ -32,7 +65,11 @@ const char *statisticDescription =
 	"Average pairwise coexpression score of the group.";
 
 // Table name in the DB, where the resulting clusters will be persisted.
+#ifdef LINEAR_WINDOWS
+const char *tableName = "CoexWindowFields";
+#else
 const char *tableName = "CoexFields";
+#endif
 
 // Radius of the sampling sphere
 const double sphereRadius = 15.0;
@@ -40,6 +77,21 @@ const double sphereRadius = 15.0;
 // Threshold to disregard mostly empty spheres
 const int minimumGeneCount = 50;
 
+#ifdef LINEAR_WINDOWS
+// Windows run from minimumGeneCount to maximumWindowGeneCount consecutive
+// genes in steps of windowSizeStep, one starting every windowStride genes
+const int maximumWindowGeneCount = 200;
+const int windowSizeStep = 10;
+const int windowStride = 1;
+#endif
+
+#ifdef NEAREST_GENE_BALLS
+// Genes in each ball, centered on a random gene. Balls wider than
+// maximumBallRadius lie in mostly empty space and are disregarded.
+const int ballGeneCount = 100;
+const double maximumBallRadius = 2.0 * sphereRadius;
+#endif
+
 // Minimum/maximum x,y,z dimension of the gene box. This box is where random
 // spheres are picked from.
 const double boxMinimum = 0.0;
@@ -62,11 +114,29 @@ const double pAdjThreshold = 0.01;
 // sharing one or a few genes.
 const double overlapThreshold = 0.05;
 
+#ifdef REPLICATES
+// Independent replicates of the whole test, and the fraction of them in
+// which two genes must share a field to be linked in the consensus
+const int replicateCount = 10;
+const double consensusThreshold = 0.5;
+#endif
+
+#ifdef Z_SCORE_SCREENING
+// With z-score screening, sphere p-values come from the analytic mean and
+// variance of the statistic over random sets. Only spheres whose z-score is
+// within this margin of the significance boundary get a Monte Carlo p-value.
+const double zScoreMargin = 2.0;
+#endif
+
 } // namespace
 
 #include "utils/PackedCoex.h"
 
+#include "utils/CoordinateModels.h"
+#include "utils/GenePool.h"
+#include "utils/GeneSet.h"
 #include "utils/RandomGeneSampler.h"
+#include "utils/Replicates.h"
 #include "utils/SaveClustersToDB.h"
 #include "utils/SphereGeneSampler.h"
 #include "utils/SphereTest.h"
@@ -89,15 +159,11 @@ const double overlapThreshold = 0.05;
 
 namespace {
 
-// Define your Gene structure here. It is required that Gene at least contains:
-//		* QString name
-//		* Vec3D position
-//		* p-value helper functions. See below. These basically define what
-//			consists an "extreme" outcome.
+// Define your Gene structure here. Gene holds the hot data the statistic
+// reads; names and positions are kept separately by GenePool. It is also
+// required that Gene contains p-value helper functions. See below. These
+// basically define what consists an "extreme" outcome.
 struct Gene {
-	QString name;
-	Vec3D position;
-
 	// Index to square table of coexpression scores. This is both column and row index of the gene.
 	// We use this to avoid searching gene pair coexpressions by name, thus improving performance.
 	int coexIndex = 0;
@@ -110,12 +176,13 @@ struct Gene {
 	}
 
 	// Implement this to calculate p-value. Single- and Double-tailed tests may
-	// be implemented this way.
-	static double calculatePValue(int randomMoreExtremeOccurrences,
+	// be implemented this way. Occurrences may be fractional when they are
+	// estimated rather than counted.
+	static double calculatePValue(double randomMoreExtremeOccurrences,
 								  int totalRandomSamples) {
 		// Calculate 1-tailed p-value
 		double pValue =
-			(double)randomMoreExtremeOccurrences / (double)totalRandomSamples;
+			randomMoreExtremeOccurrences / (double)totalRandomSamples;
 
 		// Use this to convert to 2-tailed test
 		// pValue = 2.0 * std::min(pValue, 1.0 - pValue);
@@ -124,8 +191,8 @@ struct Gene {
 	}
 
 	// Define this to control when a sphere-sample is acceptable
-	static bool acceptSample(const QVector<const Gene *> &genes) {
-		return genes.size() >= minimumGeneCount;
+	static bool acceptSample(const Gene *, const GeneIndex *, int count) {
+		return count >= minimumGeneCount;
 	}
 
 	// One to rule them all
@@ -135,33 +202,34 @@ struct Gene {
 PackedCoex Gene::packedCoex;
 
 // Load set of genes from DB
-QVector<Gene> loadGenes(QSqlDatabase &db, const QString &whereClause = "") {
+GenePool<Gene> loadGenes(QSqlDatabase &db, const QString &whereClause = "") {
 	// Load packed coexpressions
 	const QString coexFilename = QStringLiteral("Results/CoexPacked.bin");
 	Gene::packedCoex.load(coexFilename);
 	printf("Loaded packed coexpressions from file: %s\n",
 		coexFilename.toUtf8().data());
 
-	QVector<Gene> result;
+	GenePool<Gene> result;
 
 	const QString sql = QString("SELECT Gene, x, y, z FROM Loci");
 	QSqlQuery query(sql, db);
 	while (query.next()) {
-		Gene gene;
-		gene.name = query.value(0).toString();
-		gene.position.x = query.value(1).toDouble();
-		gene.position.y = query.value(2).toDouble();
-		gene.position.z = query.value(3).toDouble();
+		const QString name = query.value(0).toString();
+		Vec3D position;
+		position.x = query.value(1).toDouble();
+		position.y = query.value(2).toDouble();
+		position.z = query.value(3).toDouble();
 		
-		if (!Gene::packedCoex.geneToIndex.contains(gene.name)) {
+		if (!Gene::packedCoex.geneToIndex.contains(name)) {
 			// Ignore genes where we don't know their coexpressions
 			continue;
 		}
 
 		// Assign index to square table and we are done.
-		gene.coexIndex = Gene::packedCoex.geneToIndex[gene.name];
+		Gene gene;
+		gene.coexIndex = Gene::packedCoex.geneToIndex[name];
 
-		result.push_back(gene);
+		result.add(name, position, gene);
 	}
 
 	if (query.lastError().type() != QSqlError::NoError)
@@ -173,32 +241,74 @@ QVector<Gene> loadGenes(QSqlDatabase &db, const QString &whereClause = "") {
 }
 
 // This implements the sphere test statistic for our particular test.
-double sphereTestStatistic(const QVector<const Gene *> &genes) {
-	if (genes.isEmpty())
+double sphereTestStatistic(const Gene *genes, const GeneIndex *ids,
+						   int count) {
+	if (count == 0)
 		throw(QString("Empty gene list provided!"));
 
-	if (genes.size() == 1) return 0.0;
+	if (count == 1) return 0.0;
 
-	double result = 0.0;
-	int pairCount = 0;
+	const PackedCoex &packedCoex = Gene::packedCoex;
 
-	for (int i = 0; i < genes.size(); i++) {
-		for (int j = 0; j < genes.size(); j++) {
+	// Scores are small integers, so we can sum them exactly and scale once.
+	qint64 result = 0;
+	for (int i = 0; i < count; i++) {
+		const unsigned char *row = packedCoex.row(genes[ids[i]].coexIndex);
+		for (int j = 0; j < count; j++) {
 			if (i == j) continue;
+			result += row[genes[ids[j]].coexIndex];
+		}
+	}
+	const int pairCount = count * (count - 1);
+
+	// divide by 10 to return to coex score space.
+	return (double)result * 0.1 / (double)pairCount;
+}
+
+// Incremental version of sphereTestStatistic(), for building the null tables
+// one gene at a time. Adding a gene adds its scores with all genes already in
+// the set, both ways round, like the full statistic does.
+struct NullAccumulator {
+	QVector<int> coexIndices;
+	qint64 pairSum = 0;
 
-			const Gene &gene1 = *genes[i];
-			const Gene &gene2 = *genes[j];
+	void clear() {
+		coexIndices.resize(0); // keeps the capacity
+		pairSum = 0;
+	}
 
-			double coexScore =
-				(double)Gene::packedCoex.lookup(gene1.coexIndex, gene2.coexIndex);
-			coexScore *= 0.1; // divide by 10 to return to coex score space.
-			result += coexScore;
-			pairCount++;
+	void add(const Gene *genes, GeneIndex id) {
+		const PackedCoex &packedCoex = Gene::packedCoex;
+		const int coexIndex = genes[id].coexIndex;
+		const unsigned char *row = packedCoex.row(coexIndex);
+		for (const int other : coexIndices) {
+			pairSum += row[other];
+			pairSum += packedCoex.row(other)[coexIndex];
+		}
+		coexIndices.push_back(coexIndex);
+	}
+
+	// Reverse of add(), for sliding windows
+	void remove(const Gene *genes, GeneIndex id) {
+		const PackedCoex &packedCoex = Gene::packedCoex;
+		const int coexIndex = genes[id].coexIndex;
+		coexIndices.erase(
+			std::find(coexIndices.begin(), coexIndices.end(), coexIndex));
+		const unsigned char *row = packedCoex.row(coexIndex);
+		for (const int other : coexIndices) {
+			pairSum -= row[other];
+			pairSum -= packedCoex.row(other)[coexIndex];
 		}
 	}
-	result /= (double)pairCount;
-	return result;
-}
+
+	double statistic() const {
+		const int count = coexIndices.size();
+		if (count <= 1)
+			return 0.0;
+		const int pairCount = count * (count - 1);
+		return (double)pairSum * 0.1 / (double)pairCount;
+	}
+};
 
 // This function performs the sphere test. An almost identical copy of this
 // function exists in all similar sphere-test programs. This is a compromise
@@ -208,7 +318,7 @@ void extractCoexFields(QSqlDatabase &db) {
 	printf("Description of measured statistic:\n\t%s\n", statisticDescription);
 
 	// Load genes
-	const QVector<Gene> genes = loadGenes(db);
+	const GenePool<Gene> genes = loadGenes(db);
 	printf("%d genes\n", genes.size());
 
 	QElapsedTimer timer;
@@ -216,29 +326,77 @@ void extractCoexFields(QSqlDatabase &db) {
 
 	// Generate a number of sphere samples
 
+#ifdef LINEAR_WINDOWS
+	printf("Generating windows of %d to %d consecutive genes... ",
+		   minimumGeneCount, maximumWindowGeneCount);
+	const Sampler::WindowGeneSampler windowSampler =
+		Sampler::WindowGeneSampler::fromLoci(db, genes);
+	WorkUnits workUnits = createWindowWorkUnits(
+		genes, windowSampler, minimumGeneCount, maximumWindowGeneCount,
+		windowSizeStep, windowStride);
+	printf("Done (%d windows).\n", workUnits.size());
+#elif defined(NEAREST_GENE_BALLS)
+	printf("Generating %d balls of %d nearest genes... ", sampleCount,
+		   ballGeneCount);
+	WorkUnits workUnits = createNearestGeneWorkUnits(
+		ballGeneCount, maximumBallRadius, genes, sampleCount, true);
+	printf("Done.\n");
+#else
 	printf("Generating %d sphere samples... ", sampleCount);
 	int averageGenesInASphere = 0;
-	QVector<WorkUnit<Gene>> workUnits =
-		createWorkUnits(sphereRadius, genes, sampleCount,
-						&averageGenesInASphere);
-	printf("Done.\n");
+	WorkUnits workUnits = createSphereWorkUnits(
+		sphereRadius, genes, sampleCount, &averageGenesInASphere);
+	printf("Done (%d spheres).\n", workUnits.size());
 	printf("Average genes in a sphere: %d\n", averageGenesInASphere);
-
-	// Then, for each of the samples, draw the same number of random samples of
-	// the same gene count. Calculate the same metric and calculate a p-value.
-	printf("Calculating p-values for %d sphere samples using %d random samples "
-		   "for each... ",
-		   sampleCount, sampleCount);
-#pragma omp parallel for
-	for (int i = 0; i < workUnits.size(); i++) {
-		WorkUnit<Gene> &workUnit = workUnits[i];
-		workUnit.calculatePValue(sampleCount);
-	}
+#endif
+	const SphereCoverage coverage = sphereCoverage(genes.size(), workUnits);
+	coverage.print();
+	coverage.printHistogram();
+
+#ifdef LINEAR_WINDOWS
+	calculateWindowStatistics<NullAccumulator>(genes, workUnits);
+#else
+	calculateStatisticsInSpheres(genes, workUnits);
+#endif
+
+#ifdef Z_SCORE_SCREENING
+	printf("Calculating null moments of the statistic... ");
+	const PairwiseNullMoments moments =
+		pairwiseNullMoments(genes.size(), [&](GeneIndex a, GeneIndex b) {
+			const int i = genes.genes[a].coexIndex;
+			const int j = genes.genes[b].coexIndex;
+			// Average of both directions, in coex score space
+			return 0.05 * ((double)Gene::packedCoex.lookup(i, j) +
+						   (double)Gene::packedCoex.lookup(j, i));
+		});
+	printf("Done (mean %f).\n", moments.mean);
+	const QVector<int> monteCarloUnits = screenByZScore<Gene>(
+		workUnits, moments, sampleCount, pAdjThreshold, zScoreMargin);
+	printf("%d of %d spheres within %.01f of the significance boundary in "
+		   "z-score\n",
+		   monteCarloUnits.size(), workUnits.size(), zScoreMargin);
+	const QVector<int> *selection = &monteCarloUnits;
+#else
+	const QVector<int> *selection = nullptr;
+#endif
+
+	// Then, for each of the samples, compare against random samples of the
+	// same gene count and calculate a p-value. Random samples are shared
+	// between spheres of the same gene count.
+	printf("Calculating statistic on %d random samples for all needed gene "
+		   "set sizes... ",
+		   sampleCount);
+	const NullTables nullTables = buildNestedNullTables<NullAccumulator>(
+		genes, workUnits, sampleCount, selection);
+	printf("Done (%d gene set sizes).\n", nullTables.geneCounts.size());
+
+	printf("Calculating p-values... ");
+	calculatePValues<Gene>(workUnits, nullTables, selection);
 	printf("Done.\n");
 
 	// Adjust p-values
 	printf("Adjusting p-values using Benjamini-Hochberg method... ");
-	benjamini(workUnits);
+	const QVector<int> order = benjamini(workUnits);
 	printf("Done.\n");
 
 	// Write p-values to file for later reference
@@ -250,36 +408,33 @@ void extractCoexFields(QSqlDatabase &db) {
 		if (!file.open(QIODevice::WriteOnly | QIODevice::Text))
 			throw QString("Failed to open file %1 for writing\n").arg(filename);
 		QTextStream out(&file);
-		for (const WorkUnit<Gene> &workUnit : workUnits) {
-			out << workUnit.pValue << '\t' << workUnit.adjustedPValue << '\n';
+		for (const int i : order) {
+			out << workUnits[i].pValue << '\t' << workUnits[i].adjustedPValue
+				<< '\n';
 		}
 		file.close();
 	}
 
 	// Filter by adjusted p-value
-	QVector<WorkUnit<Gene>> tmp;
-	std::copy_if(workUnits.begin(), workUnits.end(), std::back_inserter(tmp),
-				 [&](const WorkUnit<Gene> &x) {
-					 return x.adjustedPValue <= pAdjThreshold;
-				 });
-	workUnits = tmp;
-	printf("%d significant p-values (below %.05f)\n", workUnits.size(),
+	const QVector<int> significant =
+		filterByAdjustedPValue(workUnits, order, pAdjThreshold);
+	printf("%d significant p-values (below %.05f)\n", significant.size(),
 		   pAdjThreshold);
 
 	// Get the significant genes
-	QSet<QString> significantGenes;
-	for (const WorkUnit<Gene> &workUnit : workUnits) {
-		for (const Gene *gene : workUnit.genesInSphere) {
-			significantGenes.insert(gene->name);
-		}
+	GeneSet significantGenes(genes.size());
+	for (const int i : significant) {
+		significantGenes.insert(workUnits.genesBegin(workUnits[i]),
+								workUnits.genesEnd(workUnits[i]));
 	}
-	printf("%d significant genes.\n", significantGenes.size());
-
-	if (!workUnits.isEmpty()) {
-		printf("Here is the best sphere sample: (p-value: %f)\n",
-			   workUnits.front().pValue);
-		for (const Gene *gene : workUnits.front().genesInSphere) {
-			printf("%s ", gene->name.toUtf8().data());
+	printf("%d significant genes.\n", significantGenes.count());
+
+	if (!significant.isEmpty()) {
+		const WorkUnit &best = workUnits[significant.front()];
+		printf("Here is the best sphere sample: (p-value: %f)\n", best.pValue);
+		for (const GeneIndex *gene = workUnits.genesBegin(best);
+			 gene != workUnits.genesEnd(best); gene++) {
+			printf("%s ", genes.names[*gene].toUtf8().data());
 		}
 		printf("\n");
 	} else {
@@ -292,8 +447,9 @@ void extractCoexFields(QSqlDatabase &db) {
 		   "to consider clusters as distinct ... ",
 		   overlapThreshold * 100.0);
 	double maximumOverlapRatio = 0.0;
-	QVector<QSet<QString>> clusters =
-		clusterByGeneOverlap(workUnits, overlapThreshold, &maximumOverlapRatio);
+	QVector<GeneSet> clusters =
+		clusterByGeneOverlap(workUnits, significant, genes.size(),
+							 overlapThreshold, &maximumOverlapRatio);
 	printf("Done.\n");
 	printf("Stopping clustering with %d clusters, %.02f%% maximum gene "
 		   "overlap.\n",
@@ -303,26 +459,26 @@ void extractCoexFields(QSqlDatabase &db) {
 	// number of clusters because this is a random sampling, but mostly we get
 	// the same. Ordering the clusters by size.
 	std::sort(clusters.begin(), clusters.end(),
-			  [](const QSet<QString> &a, const QSet<QString> &b) {
-				  return a.size() < b.size();
+			  [](const GeneSet &a, const GeneSet &b) {
+				  return a.count() < b.count();
 			  });
 
 	// Cleanup duplicate genes - let the smaller cluster retain all its genes
-	QSet<QString> genesUsed;
-	for (QSet<QString> &cluster : clusters) {
+	GeneSet genesUsed(genes.size());
+	for (GeneSet &cluster : clusters) {
 		cluster.subtract(genesUsed);
 		genesUsed.unite(cluster);
 	}
 
 	// Report clusters
 	for (int i = 0; i < clusters.size(); i++) {
-		printf("\tCluster %d: %d genes\n", i + 1, clusters[i].size());
+		printf("\tCluster %d: %d genes\n", i + 1, clusters[i].count());
 	}
 
 	// Write clusters to database for further evaluation
 	if (!clusters.isEmpty()) {
 		printf("Writing clusters to database ... ");
-		db::writeClusters(clusters, db, tableName);
+		db::writeClusters(clusters, genes.names, db, tableName);
 		printf("Done.\n");
 	} else {
 		printf("No clusters found - not creating a table\n");
@@ -332,6 +488,22 @@ void extractCoexFields(QSqlDatabase &db) {
 	printf("\nElapsed time: %.02f minutes.\n", timer.elapsed() / 60000.0);
 }
 
+#ifdef COORDINATE_MODELS
+// Runs the sphere test on every coordinate model (see CoordinateModels.h)
+void extractCoexFieldsAcrossModels(QSqlDatabase &db) {
+	const GenePool<Gene> genes = loadGenes(db);
+	CoordinateModels::extractFields<NullAccumulator>(db, genes);
+}
+#endif
+
+#ifdef REPLICATES
+// Runs replicates of the sphere test with consensus fields (see Replicates.h)
+void extractCoexFieldsWithReplicates(QSqlDatabase &db) {
+	const GenePool<Gene> genes = loadGenes(db);
+	Replicates::extractFields<NullAccumulator>(db, genes);
+}
+#endif
+
 } // end anonymous namespace
 
 int main(int argc, char *argv[]) {
@@ -349,7 +521,13 @@ int main(int argc, char *argv[]) {
 	}
 
 	try {
+#ifdef COORDINATE_MODELS
+		extractCoexFieldsAcrossModels(db);
+#elif defined(REPLICATES)
+		extractCoexFieldsWithReplicates(db);
+#else
 		extractCoexFields(db);
+#endif
 	} catch (QString errorMessage) {
 		printf("ERROR: %s\n", errorMessage.toUtf8().data());
 		return 0;
@@ -29,6 +29,8 @@ averageDistanceInLocalGroup. The scores are then inserted to "CommunityScores"
 database table.
 */
 
+#include "utils/PrincipalComponents.h"
+
 #include <QMap>
 #include <QSqlDatabase>
 #include <QSqlQuery>
@@ -37,6 +39,24 @@ database table.
 
 #define HISTONE_COUNT 9
 
+// Define this to replace the histone marks by their leading principal
+// components before any distance is computed
+//#define PCA_HISTONES
+
+#ifdef PCA_HISTONES
+// Histone space keeps the fewest principal components which explain this
+// fraction of the variance
+const double explainedVarianceFraction = 0.95;
+#endif
+
+// Histone columns the distance reads. Principal component projection may
+// lower this.
+#ifdef PCA_HISTONES
+int histoneDimension = HISTONE_COUNT;
+#else
+const int histoneDimension = HISTONE_COUNT;
+#endif
+
 struct Gene {
 	QString name;
 	int chromosome = 1;
@@ -53,7 +73,7 @@ struct Gene {
 
 	double distance(const Gene &other) const {
 		double accum = 0.0;
-		for (int i = 0; i < HISTONE_COUNT; i++) {
+		for (int i = 0; i < histoneDimension; i++) {
 			const double d = other.histones[i] - histones[i];
 			accum += d * d;
 		}
@@ -187,6 +207,19 @@ void calculateScoresAndUpdateDatabase(QSqlDatabase &db) {
 	// Load genes
 	QMap<int, QVector<Gene>> chromosomes = loadGenes(db);
 
+#ifdef PCA_HISTONES
+	// One projection for all chromosomes, so scores stay comparable
+	QVector<Gene *> allGenes;
+	for (const int c : chromosomes.keys()) {
+		for (Gene &gene : chromosomes[c]) {
+			allGenes.push_back(&gene);
+		}
+	}
+	histoneDimension = reduceToPrincipalComponents(
+		allGenes, HISTONE_COUNT, explainedVarianceFraction,
+		[](Gene *gene) { return gene->histones; });
+#endif
+
 	// process all chromosomes
 	for (const int c : chromosomes.keys()) {
 		QVector<Gene> &genes = chromosomes[c];
@@ -27,6 +27,36 @@ documentation. We use number of species having each gene as input.
 // Define / undefine this to switch between taxon and species count tests
 #define TAXON_TEST
 
+// Define this to take sphere centers from a scrambled Sobol sequence instead
+// of independent uniform draws, covering the box evenly with fewer spheres.
+//#define SOBOL_CENTERS
+
+// Define this to take sphere centers by Poisson-disk dart throwing instead,
+// one sphere radius apart
+//#define POISSON_DISK_CENTERS
+
+// Define this to stop sampling spheres once most genes are in enough of them.
+// sampleCount is then only a cap on the number of spheres (the target
+// is coveredGeneFraction in SphereTest.h).
+//#define COVERAGE_STOPPING
+
+// Define this for a scan test: spheres get family-wise p-values from the
+// maximum z-score over all spheres in label permutations, instead of null
+// tables and Benjamini-Hochberg.
+//#define SCAN_STATISTIC
+
+// Define this to run the test on every coordinate model of the genes (Loci and
+// the LociModels table), with null tables shared by all models
+//#define COORDINATE_MODELS
+
+// Define this to run several replicates of the test at once and combine their
+// fields into consensus fields
+//#define REPLICATES
+
+// Define this to test windows of consecutive genes along each chromosome
+// instead of spheres, as a linear-genome baseline
+//#define LINEAR_WINDOWS
+
 // Settings
 namespace {
 
@@ -40,8 +70,12 @@ namespace {
 #endif
 
 // Table name in the DB, where the resulting clusters will be persisted.
-#ifdef TAXON_TEST
+#if defined(TAXON_TEST) && defined(LINEAR_WINDOWS)
+const char *tableName = "TaxonWindowFields";
+#elif defined(TAXON_TEST)
 	const char *tableName = "TaxonFields";
+#elif defined(LINEAR_WINDOWS)
+const char *tableName = "ConservationWindowFields";
 #else
 const char *tableName = "ConservationFields";
 #endif
@@ -52,6 +86,14 @@ const double sphereRadius = 10.0;
 // Threshold to disregard mostly empty spheres
 const int minimumGeneCount = 20;
 
+#ifdef LINEAR_WINDOWS
+// Windows run from minimumGeneCount to maximumWindowGeneCount consecutive
+// genes in steps of windowSizeStep, one starting every windowStride genes
+const int maximumWindowGeneCount = 200;
+const int windowSizeStep = 10;
+const int windowStride = 1;
+#endif
+
 // Minimum/maximum x,y,z dimension of the gene box. This box is where random
 // spheres are picked from.
 const double boxMinimum = 0.0;
@@ -62,6 +104,11 @@ const double boxMaximum = 210.0;
 // sphere. So processing time is O(n^2) to this.
 const int sampleCount = 20000;
 
+#ifdef SCAN_STATISTIC
+// Label permutations for the null of the maximum z-score
+const int scanReplicateCount = 999;
+#endif
+
 // Filter sphere samples by adjusted p-value. I propose to run this program
 // twice: on first run p-values can be examined (they are written to text file).
 // Subsequently, you can set this to a sane value, so that only significant
@@ -74,11 +121,25 @@ const double pAdjThreshold = 0.05;
 // sharing one or a few genes.
 const double overlapThreshold = 0.05;
 
+#ifdef REPLICATES
+// Independent replicates of the whole test, and the fraction of them in
+// which two genes must share a field to be linked in the consensus
+const int replicateCount = 10;
+const double consensusThreshold = 0.5;
+#endif
+
 } // namespace
 
 #define HISTONE_COLUMN_COUNT 9
 
+// Room for this many distinct taxa. Taxon codes index fixed-size arrays.
+#define MAX_TAXON_COUNT 32
+
+#include "utils/CoordinateModels.h"
+#include "utils/GenePool.h"
+#include "utils/GeneSet.h"
 #include "utils/RandomGeneSampler.h"
+#include "utils/Replicates.h"
 #include "utils/SaveClustersToDB.h"
 #include "utils/SphereGeneSampler.h"
 #include "utils/SphereTest.h"
@@ -86,6 +147,7 @@ const double overlapThreshold = 0.05;
 
 #include <QElapsedTimer>
 #include <QFile>
+#include <QHash>
 #include <QSet>
 #include <QSqlDatabase>
 #include <QSqlError>
@@ -101,16 +163,15 @@ const double overlapThreshold = 0.05;
 
 namespace {
 
-// Define your Gene structure here. It is required that Gene at least contains:
-//		* QString name
-//		* Vec3D position
-//		* p-value helper functions. See below. These basically define what
-//			consists an "extreme" outcome.
+// Define your Gene structure here. Gene holds the hot data the statistic
+// reads; names and positions are kept separately by GenePool. It is also
+// required that Gene contains p-value helper functions. See below. These
+// basically define what consists an "extreme" outcome.
 struct Gene {
-	QString name;
-	Vec3D position;
 	int speciesCount;
-	QString taxon;
+
+	// Index into taxonNames
+	quint8 taxon;
 
 	// Implement this function to define what is considered more extreme
 	static bool randomIsMoreExtreme(double randomStatistic,
@@ -126,12 +187,13 @@ struct Gene {
 	}
 
 	// Implement this to calculate p-value. Single- and Double-tailed tests may
-	// be implemented this way.
-	static double calculatePValue(int randomMoreExtremeOccurrences,
+	// be implemented this way. Occurrences may be fractional when they are
+	// estimated rather than counted.
+	static double calculatePValue(double randomMoreExtremeOccurrences,
 								  int totalRandomSamples) {
 		// Calculate 1-tailed p-value
 		double pValue =
-			(double)randomMoreExtremeOccurrences / (double)totalRandomSamples;
+			randomMoreExtremeOccurrences / (double)totalRandomSamples;
 
 		// Use this to convert to 2-tailed test
 		// pValue = 2.0 * std::min(pValue, 1.0 - pValue);
@@ -140,27 +202,46 @@ struct Gene {
 	}
 
 	// Define this to control when a sphere-sample is acceptable
-	static bool acceptSample(const QVector<const Gene *> &genes) {
-		return genes.size() >= minimumGeneCount;
+	static bool acceptSample(const Gene *, const GeneIndex *, int count) {
+		return count >= minimumGeneCount;
 	}
 };
 
+#ifdef TAXON_TEST
+// Taxa are interned to small codes at load time. The statistic only indexes
+// arrays by them: log of the genome-wide frequency, and counts in the set.
+QVector<QString> taxonNames;
+double logTaxonFrequency[MAX_TAXON_COUNT];
+#endif
+
 // Load set of genes from DB
-QVector<Gene> loadGenes(QSqlDatabase &db, const QString &whereClause = "") {
-	QVector<Gene> result;
+GenePool<Gene> loadGenes(QSqlDatabase &db, const QString &whereClause = "") {
+	GenePool<Gene> result;
 
 	const QString sql = QString("SELECT l.Gene, x,y,z, SpeciesCount, Taxon FROM Loci l JOIN Conservation c ON l.Gene = c.Gene ORDER BY Chromosome, Start");
 	QSqlQuery query(sql, db);
+	QHash<QString, int> taxonCodes;
 	while (query.next()) {
+		const QString name = query.value(0).toString();
+		Vec3D position;
+		position.x = query.value(1).toDouble();
+		position.y = query.value(2).toDouble();
+		position.z = query.value(3).toDouble();
 		Gene gene;
-		gene.name = query.value(0).toString();
-		gene.position.x = query.value(1).toDouble();
-		gene.position.y = query.value(2).toDouble();
-		gene.position.z = query.value(3).toDouble();
 		gene.speciesCount = query.value(4).toInt();
-		gene.taxon = query.value(5).toString();
+		const QString taxon = query.value(5).toString();
+		if (!taxonCodes.contains(taxon)) {
+			if (taxonCodes.size() == MAX_TAXON_COUNT)
+				throw(QString("More than %1 taxa, increase MAX_TAXON_COUNT")
+						  .arg(MAX_TAXON_COUNT));
+			taxonCodes.insert(taxon, taxonCodes.size());
+#ifdef TAXON_TEST
+			taxonNames.push_back(taxon);
+#endif
+		}
+		gene.taxon = (quint8)taxonCodes.value(taxon);
 
-		result.push_back(gene);
+		result.add(name, position, gene);
 	}
 
 	if (query.lastError().type() != QSqlError::NoError)
@@ -172,49 +253,51 @@ QVector<Gene> loadGenes(QSqlDatabase &db, const QString &whereClause = "") {
 }
 
 #ifdef TAXON_TEST
-using TaxonFrequencyMap = QMap<QString, double>;
-TaxonFrequencyMap taxonFrequency;
+// For each taxon present in the group, its log enrichment over the genome-wide
+// frequency; return the largest in absolute value
+double bestLogEnrichment(const int *taxonCounts, int count) {
+	const double logCount = log((double)count);
+	double result = 0.0;
+	for (int t = 0; t < taxonNames.size(); t++) {
+		if (taxonCounts[t] == 0)
+			continue;
+		const double logEnrichment =
+			log((double)taxonCounts[t]) - logCount - logTaxonFrequency[t];
+		result = std::max(result, std::abs(logEnrichment));
+	}
+	return result;
+}
 #endif
 
 // This implements the sphere test statistic for our particular test.
-double sphereTestStatistic(const QVector<const Gene *> &genes) {
-	if (genes.isEmpty())
+double sphereTestStatistic(const Gene *genes, const GeneIndex *ids,
+						   int count) {
+	if (count == 0)
 		throw(QString("sphereTestStatistic(): Empty gene list provided!"));
-	if (genes.size() == 1)
+	if (count == 1)
 		return 0.0;
 
 
 #ifdef TAXON_TEST
-	// Compute frequencies in group
-	TaxonFrequencyMap taxonFrequencyInGroup;
-	for (const Gene *gene : genes) {
-		taxonFrequencyInGroup[gene->taxon] += 1.0;
-	}
-	for (const QString &taxon : taxonFrequencyInGroup.keys()) {
-		taxonFrequencyInGroup[taxon] /= (double)genes.size();
-	}
-
-	// For each taxon, calculate enrichment and keep the best
-	double bestLogEnrichment = 0.0;
-	for (const QString &taxon : taxonFrequencyInGroup.keys()) {
-		const double enrichment = taxonFrequencyInGroup[taxon] / taxonFrequency[taxon];
-		const double logEnrichment = log(enrichment);
-		bestLogEnrichment = std::max(bestLogEnrichment, std::abs(logEnrichment));
+	// Count genes per taxon in group
+	int taxonCounts[MAX_TAXON_COUNT] = {};
+	for (int i = 0; i < count; i++) {
+		taxonCounts[genes[ids[i]].taxon]++;
 	}
 
-	return bestLogEnrichment;
+	return bestLogEnrichment(taxonCounts, count);
 #else
 	// First, calculate average species count
 	double averageSpeciesCount = 0.0;
-	for (const Gene *gene : genes) {
-		averageSpeciesCount += (double)gene->speciesCount;
+	for (int i = 0; i < count; i++) {
+		averageSpeciesCount += (double)genes[ids[i]].speciesCount;
 	}
-	averageSpeciesCount /= (double)genes.size();
+	averageSpeciesCount /= (double)count;
 
 	// Then variance
 	double variance = 0.0;
-	for (const Gene *gene : genes) {
-		const double distanceFromAverage = (double)gene->speciesCount - averageSpeciesCount;
+	for (int i = 0; i < count; i++) {
+		const double distanceFromAverage = (double)genes[ids[i]].speciesCount - averageSpeciesCount;
 		variance += distanceFromAverage * distanceFromAverage;
 	}
 
@@ -222,6 +305,85 @@ double sphereTestStatistic(const QVector<const Gene *> &genes) {
 #endif // TAXON_TEST
 }
 
+// Incremental version of sphereTestStatistic(), for building the null tables
+// one gene at a time.
+struct NullAccumulator {
+	int count = 0;
+#ifdef TAXON_TEST
+	// Genes of the set per taxon
+	int taxonCounts[MAX_TAXON_COUNT] = {};
+#else
+	// Sums of species counts and of their squares. Species counts are
+	// integers, so these are exact and remove() undoes add() without drift.
+	qint64 speciesCountSum = 0;
+	qint64 speciesCountSquareSum = 0;
+#endif
+
+	void clear() {
+		count = 0;
+#ifdef TAXON_TEST
+		std::fill(taxonCounts, taxonCounts + MAX_TAXON_COUNT, 0);
+#else
+		speciesCountSum = 0;
+		speciesCountSquareSum = 0;
+#endif
+	}
+
+	void add(const Gene *genes, GeneIndex id) {
+		count++;
+#ifdef TAXON_TEST
+		taxonCounts[genes[id].taxon]++;
+#else
+		const qint64 x = genes[id].speciesCount;
+		speciesCountSum += x;
+		speciesCountSquareSum += x * x;
+#endif
+	}
+
+	// Reverse of add(), for sliding windows
+	void remove(const Gene *genes, GeneIndex id) {
+		count--;
+#ifdef TAXON_TEST
+		taxonCounts[genes[id].taxon]--;
+#else
+		const qint64 x = genes[id].speciesCount;
+		speciesCountSum -= x;
+		speciesCountSquareSum -= x * x;
+#endif
+	}
+
+	double statistic() const {
+		if (count <= 1)
+			return 0.0;
+
+#ifdef TAXON_TEST
+		return bestLogEnrichment(taxonCounts, count);
+#else
+		// Sum of squared deviations, count times over, exactly
+		const qint64 scaledVariance = count * speciesCountSquareSum -
+									  speciesCountSum * speciesCountSum;
+		return sqrt((double)scaledVariance / (double)count);
+#endif
+	}
+};
+
+#ifdef TAXON_TEST
+// Calculate general population taxon frequency
+void calculateTaxonFrequencies(const GenePool<Gene> &genes) {
+	QVector<int> taxonGeneCounts(taxonNames.size(), 0);
+	for (const Gene &gene : genes.genes) {
+		taxonGeneCounts[gene.taxon]++;
+	}
+	printf("Base taxon frequencies:\n");
+	for (int t = 0; t < taxonNames.size(); t++) {
+		const double frequency =
+			(double)taxonGeneCounts[t] / (double)genes.size();
+		logTaxonFrequency[t] = log(frequency);
+		printf("\t%s: %.02f\n", taxonNames[t].toUtf8().data(), frequency);
+	}
+}
+#endif // TAXON_TEST
+
 // This function performs the sphere test. An almost identical copy of this
 // function exists in all similar sphere-test programs. This is a compromise
 // between reusability and flexibility. Heavy parts of the procedure have been
@@ -230,50 +392,91 @@ void extractConservationFields(QSqlDatabase &db) {
 	printf("Description of measured statistic:\n\t%s\n", statisticDescription);
 
 	// Load genes
-	const QVector<Gene> genes = loadGenes(db);
+	const GenePool<Gene> genes = loadGenes(db);
 	printf("%d genes\n", genes.size());
 
 #ifdef TAXON_TEST
-	// Calculate general population taxon frequency
-	for (const Gene &gene : genes) {
-		taxonFrequency[gene.taxon] += 1.0;
-	}
-	printf("Base taxon frequencies:\n");
-	for (const QString &taxon : taxonFrequency.keys()) {
-		taxonFrequency[taxon] /= (double)genes.size();
-		printf("\t%s: %.02f\n", taxon.toUtf8().data(), taxonFrequency[taxon]);
-	}
-#endif // TAXON_TEST
+	calculateTaxonFrequencies(genes);
+#endif
 
 	QElapsedTimer timer;
 	timer.start();
 
 	// Generate a number of sphere samples
 
+#ifdef LINEAR_WINDOWS
+	printf("Generating windows of %d to %d consecutive genes... ",
+		   minimumGeneCount, maximumWindowGeneCount);
+	const Sampler::WindowGeneSampler windowSampler =
+		Sampler::WindowGeneSampler::fromLoci(db, genes);
+	WorkUnits workUnits = createWindowWorkUnits(
+		genes, windowSampler, minimumGeneCount, maximumWindowGeneCount,
+		windowSizeStep, windowStride);
+	printf("Done (%d windows).\n", workUnits.size());
+#else
 	printf("Generating %d sphere samples... ", sampleCount);
 	int averageGenesInASphere = 0;
-	QVector<WorkUnit<Gene>> workUnits =
-		createWorkUnits(sphereRadius, genes, sampleCount,
-						&averageGenesInASphere);
-	printf("Done.\n");
+	WorkUnits workUnits = createSphereWorkUnits(
+		sphereRadius, genes, sampleCount, &averageGenesInASphere);
+	printf("Done (%d spheres).\n", workUnits.size());
 	printf("Average genes in a sphere: %d\n", averageGenesInASphere);
+#endif
+	const SphereCoverage coverage = sphereCoverage(genes.size(), workUnits);
+	coverage.print();
+	coverage.printHistogram();
+
+#ifdef SCAN_STATISTIC
+	// Compare spheres of different sizes by z-score, then rank each against
+	// the most extreme z-score of every label permutation.
+	printf("Calculating statistic moments on %d random samples for all gene "
+		   "set sizes... ",
+		   sampleCount);
+	const GeneCountMoments moments = geneCountMoments<NullAccumulator>(
+		genes, largestGeneCount(workUnits), sampleCount);
+	printf("Done.\n");
 
-	// Then, for each of the samples, draw the same number of random samples of
-	// the same gene count. Calculate the same metric and calculate a p-value.
-	printf("Calculating p-values for %d sphere samples using %d random samples "
-		   "for each... ",
-		   sampleCount, sampleCount);
-#pragma omp parallel for
-	for (int i = 0; i < workUnits.size(); i++) {
-		WorkUnit<Gene> &workUnit = workUnits[i];
-		workUnit.calculatePValue(sampleCount);
-	}
+#ifdef LINEAR_WINDOWS
+	calculateWindowStatistics<NullAccumulator>(genes, workUnits);
+#else
+	calculateStatisticsInSpheres(genes, workUnits);
+#endif
+
+	printf("Calculating maximum z-score over %d spheres for %d label "
+		   "permutations... ",
+		   workUnits.size(), scanReplicateCount);
+	const QVector<double> nullMaxima =
+		scanNullMaxima<NullAccumulator>(genes, workUnits, moments,
+									   scanReplicateCount);
+	calculateScanPValues<Gene>(workUnits, moments, nullMaxima);
+	printf("Done.\n");
+
+	const QVector<int> order = familyWiseOrder(workUnits);
+#else
+	// Then, for each of the samples, compare against random samples of the
+	// same gene count and calculate a p-value. Random samples are shared
+	// between spheres of the same gene count.
+	printf("Calculating statistic on %d random samples for all possible gene "
+		   "set sizes... ",
+		   sampleCount);
+	const NullTables nullTables = buildNestedNullTables<NullAccumulator>(
+		genes, workUnits, sampleCount);
+	printf("Done (%d gene set sizes).\n", nullTables.geneCounts.size());
+
+#ifdef LINEAR_WINDOWS
+	calculateWindowStatistics<NullAccumulator>(genes, workUnits);
+#else
+	calculateStatisticsInSpheres(genes, workUnits);
+#endif
+
+	printf("Calculating p-value for each of %d spheres... ", workUnits.size());
+	calculatePValues<Gene>(workUnits, nullTables);
 	printf("Done.\n");
 
 	// Adjust p-values
 	printf("Adjusting p-values using Benjamini-Hochberg method... ");
-	benjamini(workUnits);
+	const QVector<int> order = benjamini(workUnits);
 	printf("Done.\n");
+#endif // SCAN_STATISTIC
 
 	// Write p-values to file for later reference
 	{
@@ -284,36 +487,33 @@ void extractConservationFields(QSqlDatabase &db) {
 		if (!file.open(QIODevice::WriteOnly | QIODevice::Text))
 			throw QString("Failed to open file %1 for writing\n").arg(filename);
 		QTextStream out(&file);
-		for (const WorkUnit<Gene> &workUnit : workUnits) {
-			out << workUnit.pValue << '\t' << workUnit.adjustedPValue << '\n';
+		for (const int i : order) {
+			out << workUnits[i].pValue << '\t' << workUnits[i].adjustedPValue
+				<< '\n';
 		}
 		file.close();
 	}
 
 	// Filter by adjusted p-value
-	QVector<WorkUnit<Gene>> tmp;
-	std::copy_if(workUnits.begin(), workUnits.end(), std::back_inserter(tmp),
-				 [&](const WorkUnit<Gene> &x) {
-					 return x.adjustedPValue <= pAdjThreshold;
-				 });
-	workUnits = tmp;
-	printf("%d significant p-values (below %.05f)\n", workUnits.size(),
+	const QVector<int> significant =
+		filterByAdjustedPValue(workUnits, order, pAdjThreshold);
+	printf("%d significant p-values (below %.05f)\n", significant.size(),
 		   pAdjThreshold);
 
 	// Get the significant genes
-	QSet<QString> significantGenes;
-	for (const WorkUnit<Gene> &workUnit : workUnits) {
-		for (const Gene *gene : workUnit.genesInSphere) {
-			significantGenes.insert(gene->name);
-		}
+	GeneSet significantGenes(genes.size());
+	for (const int i : significant) {
+		significantGenes.insert(workUnits.genesBegin(workUnits[i]),
+								workUnits.genesEnd(workUnits[i]));
 	}
-	printf("%d significant genes.\n", significantGenes.size());
-
-	if (!workUnits.isEmpty()) {
-		printf("Here is the best sphere sample: (p-value: %f)\n",
-			   workUnits.front().pValue);
-		for (const Gene *gene : workUnits.front().genesInSphere) {
-			printf("%s ", gene->name.toUtf8().data());
+	printf("%d significant genes.\n", significantGenes.count());
+
+	if (!significant.isEmpty()) {
+		const WorkUnit &best = workUnits[significant.front()];
+		printf("Here is the best sphere sample: (p-value: %f)\n", best.pValue);
+		for (const GeneIndex *gene = workUnits.genesBegin(best);
+			 gene != workUnits.genesEnd(best); gene++) {
+			printf("%s ", genes.names[*gene].toUtf8().data());
 		}
 		printf("\n");
 	} else {
@@ -326,8 +526,9 @@ void extractConservationFields(QSqlDatabase &db) {
 		   "to consider clusters as distinct ... ",
 		   overlapThreshold * 100.0);
 	double maximumOverlapRatio = 0.0;
-	QVector<QSet<QString>> clusters =
-		clusterByGeneOverlap(workUnits, overlapThreshold, &maximumOverlapRatio);
+	QVector<GeneSet> clusters =
+		clusterByGeneOverlap(workUnits, significant, genes.size(),
+							 overlapThreshold, &maximumOverlapRatio);
 	printf("Done.\n");
 	printf("Stopping clustering with %d clusters, %.02f%% maximum gene "
 		   "overlap.\n",
@@ -337,26 +538,26 @@ void extractConservationFields(QSqlDatabase &db) {
 	// number of clusters because this is a random sampling, but mostly we get
 	// the same. Ordering the clusters by size.
 	std::sort(clusters.begin(), clusters.end(),
-			  [](const QSet<QString> &a, const QSet<QString> &b) {
-				  return a.size() < b.size();
+			  [](const GeneSet &a, const GeneSet &b) {
+				  return a.count() < b.count();
 			  });
 
 	// Cleanup duplicate genes - let the smaller cluster retain all its genes
-	QSet<QString> genesUsed;
-	for (QSet<QString> &cluster : clusters) {
+	GeneSet genesUsed(genes.size());
+	for (GeneSet &cluster : clusters) {
 		cluster.subtract(genesUsed);
 		genesUsed.unite(cluster);
 	}
 
 	// Report clusters
 	for (int i = 0; i < clusters.size(); i++) {
-		printf("\tCluster %d: %d genes\n", i + 1, clusters[i].size());
+		printf("\tCluster %d: %d genes\n", i + 1, clusters[i].count());
 	}
 
 	// Write clusters to database for further evaluation
 	if (!clusters.isEmpty()) {
 		printf("Writing clusters to database ... ");
-		db::writeClusters(clusters, db, tableName);
+		db::writeClusters(clusters, genes.names, db, tableName);
 		printf("Done.\n");
 	} else {
 		printf("No clusters found - not creating a table\n");
@@ -366,6 +567,28 @@ void extractConservationFields(QSqlDatabase &db) {
 	printf("\nElapsed time: %.02f minutes.\n", timer.elapsed() / 60000.0);
 }
 
+#ifdef COORDINATE_MODELS
+// Runs the sphere test on every coordinate model (see CoordinateModels.h)
+void extractConservationFieldsAcrossModels(QSqlDatabase &db) {
+	const GenePool<Gene> genes = loadGenes(db);
+#ifdef TAXON_TEST
+	calculateTaxonFrequencies(genes);
+#endif
+	CoordinateModels::extractFields<NullAccumulator>(db, genes);
+}
+#endif
+
+#ifdef REPLICATES
+// Runs replicates of the sphere test with consensus fields (see Replicates.h)
+void extractConservationFieldsWithReplicates(QSqlDatabase &db) {
+	const GenePool<Gene> genes = loadGenes(db);
+#ifdef TAXON_TEST
+	calculateTaxonFrequencies(genes);
+#endif
+	Replicates::extractFields<NullAccumulator>(db, genes);
+}
+#endif
+
 } // end anonymous namespace
 
 int main(int argc, char *argv[]) {
@@ -383,7 +606,13 @@ int main(int argc, char *argv[]) {
 	}
 
 	try {
+#ifdef COORDINATE_MODELS
+		extractConservationFieldsAcrossModels(db);
+#elif defined(REPLICATES)
+		extractConservationFieldsWithReplicates(db);
+#else
 		extractConservationFields(db);
+#endif
 	} catch (QString errorMessage) {
 		printf("ERROR: %s\n", errorMessage.toUtf8().data());
 		return 0;
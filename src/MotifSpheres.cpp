@@ -27,6 +27,43 @@ documentation. We use transcription factor motif presence / absence as input.
 // Define this to go from Jaccard distance to Jaccard index test
 //#define JACCARD_INDEX_TEST
 
+// Define this to get small p-values from generalized Pareto fits of the null
+// tails, rather than from very large null tables.
+//#define TAIL_FIT_P_VALUES
+
+// Define this to grow regions along a nearest-neighbour gene graph instead of
+// sampling spheres.
+//#define REGION_GROWING
+
+// Define this to sample balls of a fixed number of nearest genes instead of
+// spheres of a fixed radius. One null distribution then serves all of them.
+//#define NEAREST_GENE_BALLS
+
+// Define this to take sphere centers from a scrambled Sobol sequence instead
+// of independent uniform draws, covering the box evenly with fewer spheres.
+//#define SOBOL_CENTERS
+
+// Define this to take sphere centers by Poisson-disk dart throwing instead,
+// one sphere radius apart
+//#define POISSON_DISK_CENTERS
+
+// Define this to stop sampling spheres once most genes are in enough of them.
+// sampleCount is then only a cap on the number of spheres (the target
+// is coveredGeneFraction in SphereTest.h).
+//#define COVERAGE_STOPPING
+
+// Define this to run the test on every coordinate model of the genes (Loci and
+// the LociModels table), with null tables shared by all models
+//#define COORDINATE_MODELS
+
+// Define this to run several replicates of the test at once and combine their
+// fields into consensus fields
+//#define REPLICATES
+
+// Define this to test windows of consecutive genes along each chromosome
+// instead of spheres, as a linear-genome baseline
+//#define LINEAR_WINDOWS
+
 // Settings
 namespace {
 
@@ -36,21 +73,58 @@ const char *statisticDescription =
 	"Average Jaccard index of the group, in the binary space of 102 TF motif presence/absence.";
 
 // Table name in the DB, where the resulting clusters will be persisted.
+#ifdef LINEAR_WINDOWS
+const char *tableName = "JaccardIndexMotifWindowFields";
+#else
 const char *tableName = "JaccardIndexMotifFields";
+#endif
+
+// Table name in the DB for the per-motif enrichment of each field
+#ifdef LINEAR_WINDOWS
+const char *enrichmentTableName = "JaccardIndexMotifWindowFieldEnrichment";
+#else
+const char *enrichmentTableName = "JaccardIndexMotifFieldEnrichment";
+#endif
 #else
 const char *statisticDescription =
 	"Average Jaccard distance of the group, in the binary space of 102 TF motif presence/absence.";
 
 // Table name in the DB, where the resulting clusters will be persisted.
+#ifdef LINEAR_WINDOWS
+const char *tableName = "MotifWindowFields";
+#else
 const char *tableName = "MotifFields";
 #endif
 
+// Table name in the DB for the per-motif enrichment of each field
+#ifdef LINEAR_WINDOWS
+const char *enrichmentTableName = "MotifWindowFieldEnrichment";
+#else
+const char *enrichmentTableName = "MotifFieldEnrichment";
+#endif
+#endif
+
 // Radius of the sampling sphere
 const double sphereRadius = 15.0;
 
 // Threshold to disregard mostly empty spheres
 const int minimumGeneCount = 50;
 
+#ifdef LINEAR_WINDOWS
+// Windows run from minimumGeneCount to maximumWindowGeneCount consecutive
+// genes in steps of windowSizeStep, one starting every windowStride genes
+const int maximumWindowGeneCount = 200;
+const int windowSizeStep = 10;
+const int windowStride = 1;
+#endif
+
+#ifdef NEAREST_GENE_BALLS
+// Genes in each ball, centered on a random gene. Balls wider than
+// maximumBallRadius lie in mostly empty space and are disregarded.
+const int ballGeneCount = 100;
+const double maximumBallRadius = 2.0 * sphereRadius;
+#endif
+
 // Minimum/maximum x,y,z dimension of the gene box. This box is where random
 // spheres are picked from.
 const double boxMinimum = 0.0;
@@ -65,6 +139,14 @@ const int sampleCount = 10000;
 const int sampleCount = 50000;
 #endif
 
+// Random samples for each gene count. With tail fits the null tables can be
+// much smaller than the number of spheres.
+#ifdef TAIL_FIT_P_VALUES
+const int nullSampleCount = 5000;
+#else
+const int nullSampleCount = sampleCount;
+#endif
+
 // Filter sphere samples by adjusted p-value. I propose to run this program
 // twice: on first run p-values can be examined (they are written to text file).
 // Subsequently, you can set this to a sane value, so that only significant
@@ -81,9 +163,23 @@ const double pAdjThreshold = 0.05; // less strict for Jaccard distance
 // sharing one or a few genes.
 const double overlapThreshold = 0.05;
 
+#ifdef REPLICATES
+// Independent replicates of the whole test, and the fraction of them in
+// which two genes must share a field to be linked in the consensus
+const int replicateCount = 10;
+const double consensusThreshold = 0.5;
+#endif
+
 } // namespace
 
+#include "utils/AggregateOctree.h"
+#include "utils/CoordinateModels.h"
+#include "utils/GenePool.h"
+#include "utils/GeneSet.h"
+#include "utils/Hypergeometric.h"
 #include "utils/RandomGeneSampler.h"
+#include "utils/Replicates.h"
+#include "utils/RegionGrowing.h"
 #include "utils/SaveClustersToDB.h"
 #include "utils/SphereGeneSampler.h"
 #include "utils/SphereTest.h"
@@ -108,14 +204,11 @@ const double overlapThreshold = 0.05;
 
 namespace {
 
-// Define your Gene structure here. It is required that Gene at least contains:
-//		* QString name
-//		* Vec3D position
-//		* p-value helper functions. See below. These basically define what
-//			consists an "extreme" outcome.
+// Define your Gene structure here. Gene holds the hot data the statistic
+// reads; names and positions are kept separately by GenePool. It is also
+// required that Gene contains p-value helper functions. See below. These
+// basically define what consists an "extreme" outcome.
 struct Gene {
-	QString name;
-	Vec3D position;
 	std::bitset<TF_COUNT> tfMotifs;
 
 	double jaccardIndex(const Gene &other) const {
@@ -148,12 +241,13 @@ struct Gene {
 	}
 
 	// Implement this to calculate p-value. Single- and Double-tailed tests may
-	// be implemented this way.
-	static double calculatePValue(int randomMoreExtremeOccurrences,
+	// be implemented this way. Occurrences may be fractional when they are
+	// estimated rather than counted.
+	static double calculatePValue(double randomMoreExtremeOccurrences,
 								  int totalRandomSamples) {
 		// Calculate 1-tailed p-value
 		double pValue =
-			(double)randomMoreExtremeOccurrences / (double)totalRandomSamples;
+			randomMoreExtremeOccurrences / (double)totalRandomSamples;
 
 #ifndef JACCARD_INDEX_TEST
 		// Use this to convert to 2-tailed test
@@ -164,36 +258,43 @@ struct Gene {
 	}
 
 	// Define this to control when a sphere-sample is acceptable
-	static bool acceptSample(const QVector<const Gene *> &genes) {
-		return genes.size() >= minimumGeneCount;
+	static bool acceptSample(const Gene *, const GeneIndex *, int count) {
+		return count >= minimumGeneCount;
 	}
 };
 
 // Load set of genes from DB
-QVector<Gene> loadGenes(QSqlDatabase &db, const QString &whereClause = "") {
-	QVector<Gene> result;
+GenePool<Gene> loadGenes(QSqlDatabase &db, const QString &whereClause = "",
+						  QVector<QString> *motifNames = nullptr) {
+	GenePool<Gene> result;
 
 	const QString sql = QString("SELECT l.Gene, x, y, z, m.* FROM Loci l JOIN "
 								"TranscriptionFactorMotifs m ON l.Gene = m.Gene");
 	QSqlQuery query(sql, db);
 	while (query.next()) {
+		const QString name = query.value(0).toString();
+		Vec3D position;
+		position.x = query.value(1).toDouble();
+		position.y = query.value(2).toDouble();
+		position.z = query.value(3).toDouble();
 		Gene gene;
-		gene.name = query.value(0).toString();
-		gene.position.x = query.value(1).toDouble();
-		gene.position.y = query.value(2).toDouble();
-		gene.position.z = query.value(3).toDouble();
 
 		// Gene name is repeated in value 4
 		const QSqlRecord &record = query.record();
 		if (record.count() != TF_COUNT + 5) {
 			throw(QString("Record does not contain exactly 5 + TF_COUNT columns: %1 columns instead.").arg(record.count()));
 		}
+		if (motifNames != nullptr && motifNames->isEmpty()) {
+			for (int i = 5; i < record.count(); i++) {
+				motifNames->push_back(record.fieldName(i));
+			}
+		}
 		for (int i = 5; i < record.count(); i++) {
 			const bool motifFound = query.value(i).toInt() != 0 ? true : false;
 			gene.tfMotifs[i - 5] = motifFound;
 		}
 
-		result.push_back(gene);
+		result.add(name, position, gene);
 	}
 
 	if (query.lastError().type() != QSqlError::NoError)
@@ -205,19 +306,21 @@ QVector<Gene> loadGenes(QSqlDatabase &db, const QString &whereClause = "") {
 }
 
 // This implements the sphere test statistic for our particular test.
-double sphereTestStatistic(const QVector<const Gene *> &genes) {
-	if (genes.isEmpty())
+double sphereTestStatistic(const Gene *genes, const GeneIndex *ids,
+						   int count) {
+	if (count == 0)
 		throw(QString("Empty gene list provided!"));
 
 	double result = 0.0;
 	int pairCount = 0;
-	for (int i = 0; i < genes.size(); i++) {
-		for (int j = i + 1; j < genes.size(); j++) {
+	for (int i = 0; i < count; i++) {
+		const Gene &gene = genes[ids[i]];
+		for (int j = i + 1; j < count; j++) {
 
 #ifdef JACCARD_INDEX_TEST
-			result += genes[i]->jaccardIndex(*genes[j]);
+			result += gene.jaccardIndex(genes[ids[j]]);
 #else
-			result += genes[i]->jaccardDistance(*genes[j]);
+			result += gene.jaccardDistance(genes[ids[j]]);
 #endif
 			pairCount++;
 		}
@@ -226,6 +329,197 @@ double sphereTestStatistic(const QVector<const Gene *> &genes) {
 	return result;
 }
 
+// Incremental version of sphereTestStatistic(), for building the null tables
+// one gene at a time and, for Jaccard distances, for the sphere octree. Adding
+// a gene adds its pairs with all genes already in the set.
+struct NullAccumulator {
+#ifdef JACCARD_INDEX_TEST
+	QVector<GeneIndex> ids;
+#else
+	// How many genes of the set have each motif. The Jaccard distances of a new
+	// gene to all the set follow from these: for every motif, the genes that
+	// disagree with it.
+	int motifCounts[TF_COUNT] = {};
+	int count = 0;
+#endif
+	double pairSum = 0.0;
+
+	void clear() {
+#ifdef JACCARD_INDEX_TEST
+		ids.resize(0); // keeps the capacity
+#else
+		std::fill(motifCounts, motifCounts + TF_COUNT, 0);
+		count = 0;
+#endif
+		pairSum = 0.0;
+	}
+
+	void add(const Gene *genes, GeneIndex id) {
+		const Gene &gene = genes[id];
+#ifdef JACCARD_INDEX_TEST
+		for (const GeneIndex other : ids) {
+			pairSum += gene.jaccardIndex(genes[other]);
+		}
+		ids.push_back(id);
+#else
+		int distances = 0;
+		for (int m = 0; m < TF_COUNT; m++) {
+			distances += gene.tfMotifs[m] ? count - motifCounts[m]
+										  : motifCounts[m];
+			motifCounts[m] += gene.tfMotifs[m] ? 1 : 0;
+		}
+		pairSum += (double)distances;
+		count++;
+#endif
+	}
+
+	// Reverse of add(), for sliding windows
+	void remove(const Gene *genes, GeneIndex id) {
+		const Gene &gene = genes[id];
+#ifdef JACCARD_INDEX_TEST
+		ids.erase(std::find(ids.begin(), ids.end(), id));
+		for (const GeneIndex other : ids) {
+			pairSum -= gene.jaccardIndex(genes[other]);
+		}
+#else
+		count--;
+		int distances = 0;
+		for (int m = 0; m < TF_COUNT; m++) {
+			motifCounts[m] -= gene.tfMotifs[m] ? 1 : 0;
+			distances += gene.tfMotifs[m] ? count - motifCounts[m]
+										  : motifCounts[m];
+		}
+		pairSum -= (double)distances;
+#endif
+	}
+
+#ifndef JACCARD_INDEX_TEST
+	// Adds the pairs within the other set and those across the two
+	void merge(const NullAccumulator &other) {
+		double crossDistances = 0.0;
+		for (int m = 0; m < TF_COUNT; m++) {
+			crossDistances +=
+				motifCounts[m] * (other.count - other.motifCounts[m]) +
+				(count - motifCounts[m]) * other.motifCounts[m];
+			motifCounts[m] += other.motifCounts[m];
+		}
+		pairSum += other.pairSum + crossDistances;
+		count += other.count;
+	}
+#endif
+
+	double statistic() const {
+#ifdef JACCARD_INDEX_TEST
+		const int count = ids.size();
+#endif
+		const int pairCount = count * (count - 1) / 2;
+		return pairSum / (double)pairCount;
+	}
+};
+
+// Enrichment of one motif in one field
+struct MotifEnrichment {
+	int field;
+	int motif;
+	int genesWithMotif;
+	double foldEnrichment;
+	double pValue;
+	double adjustedPValue;
+};
+
+// Which motifs drive each field? For every field and motif, a hypergeometric
+// test of the motif's genes among the field's genes. Each motif has a bitset
+// of the genes carrying it, so the overlap counts are ANDs and popcounts.
+// P-values are adjusted with Benjamini-Hochberg over all tests together.
+QVector<MotifEnrichment> motifEnrichment(const GenePool<Gene> &genes,
+										 const QVector<GeneSet> &fields) {
+	QVector<GeneSet> motifGenes(TF_COUNT, GeneSet(genes.size()));
+	QVector<int> motifGeneCounts(TF_COUNT, 0);
+	for (int i = 0; i < genes.size(); i++) {
+		for (int m = 0; m < TF_COUNT; m++) {
+			if (genes.genes[i].tfMotifs[m]) {
+				motifGenes[m].insert((GeneIndex)i);
+				motifGeneCounts[m]++;
+			}
+		}
+	}
+
+	const Hypergeometric hypergeometric(genes.size());
+	QVector<MotifEnrichment> result;
+	for (int f = 0; f < fields.size(); f++) {
+		const int fieldSize = fields[f].count();
+		for (int m = 0; m < TF_COUNT; m++) {
+			MotifEnrichment enrichment;
+			enrichment.field = f;
+			enrichment.motif = m;
+			enrichment.genesWithMotif = fields[f].intersectionCount(motifGenes[m]);
+			const double expected = (double)fieldSize *
+									(double)motifGeneCounts[m] /
+									(double)genes.size();
+			enrichment.foldEnrichment =
+				expected > 0.0 ? enrichment.genesWithMotif / expected : 0.0;
+			enrichment.pValue = hypergeometric.upperTail(
+				enrichment.genesWithMotif, motifGeneCounts[m], fieldSize);
+			result.push_back(enrichment);
+		}
+	}
+
+	// Benjamini-Hochberg, from the largest p-value down
+	std::sort(result.begin(), result.end(),
+			  [](const MotifEnrichment &a, const MotifEnrichment &b) {
+				  return a.pValue < b.pValue;
+			  });
+	double smallest = 1.0;
+	for (int i = result.size() - 1; i >= 0; i--) {
+		smallest = std::min(smallest, result[i].pValue * (double)result.size() /
+										  (double)(i + 1));
+		result[i].adjustedPValue = smallest;
+	}
+	return result;
+}
+
+void writeMotifEnrichment(QSqlDatabase &db,
+						  const QVector<MotifEnrichment> &enrichments,
+						  const QVector<QString> &motifNames) {
+	const QString sqlDrop =
+		QString("DROP TABLE IF EXISTS %1").arg(enrichmentTableName);
+	QSqlQuery queryDrop(db);
+	if (!queryDrop.exec(sqlDrop))
+		throw QString("Failed to exec query: %1").arg(sqlDrop);
+
+	const QString sqlCreate =
+		QString("CREATE TABLE %1 (Field TEXT, Motif TEXT, GeneCount INTEGER, "
+				"FoldEnrichment REAL, PValue REAL, AdjustedPValue REAL)")
+			.arg(enrichmentTableName);
+	QSqlQuery queryCreate(db);
+	if (!queryCreate.exec(sqlCreate))
+		throw QString("Failed to exec query: %1").arg(sqlCreate);
+
+	const QString sqlInsert =
+		QString("INSERT INTO %1 (Field, Motif, GeneCount, FoldEnrichment, "
+				"PValue, AdjustedPValue) VALUES (:Field, :Motif, :GeneCount, "
+				":FoldEnrichment, :PValue, :AdjustedPValue)")
+			.arg(enrichmentTableName);
+	QSqlQuery queryInsert(db);
+	if (!queryInsert.prepare(sqlInsert))
+		throw QString("Failed to create query: %1").arg(sqlInsert);
+
+	db.transaction();
+	for (const MotifEnrichment &enrichment : enrichments) {
+		// Same field names as db::writeClusters
+		QString fieldName = 'A' + enrichment.field;
+		queryInsert.bindValue(":Field", fieldName);
+		queryInsert.bindValue(":Motif", motifNames[enrichment.motif]);
+		queryInsert.bindValue(":GeneCount", enrichment.genesWithMotif);
+		queryInsert.bindValue(":FoldEnrichment", enrichment.foldEnrichment);
+		queryInsert.bindValue(":PValue", enrichment.pValue);
+		queryInsert.bindValue(":AdjustedPValue", enrichment.adjustedPValue);
+		if (!queryInsert.exec())
+			throw QString("Failed to exec query: %1").arg(sqlInsert);
+	}
+	db.commit();
+}
+
 // This function performs the sphere test. An almost identical copy of this
 // function exists in all similar sphere-test programs. This is a compromise
 // between reusability and flexibility. Heavy parts of the procedure have been
@@ -234,7 +528,8 @@ void extractMotifFields(QSqlDatabase &db) {
 	printf("Description of measured statistic:\n\t%s\n", statisticDescription);
 
 	// Load genes
-	const QVector<Gene> genes = loadGenes(db);
+	QVector<QString> motifNames;
+	const GenePool<Gene> genes = loadGenes(db, "", &motifNames);
 	printf("%d genes\n", genes.size());
 
 	QElapsedTimer timer;
@@ -242,61 +537,92 @@ void extractMotifFields(QSqlDatabase &db) {
 
 	// Generate a number of sphere samples
 
+#if defined(LINEAR_WINDOWS)
+	printf("Generating windows of %d to %d consecutive genes... ",
+		   minimumGeneCount, maximumWindowGeneCount);
+	const Sampler::WindowGeneSampler windowSampler =
+		Sampler::WindowGeneSampler::fromLoci(db, genes);
+	WorkUnits workUnits = createWindowWorkUnits(
+		genes, windowSampler, minimumGeneCount, maximumWindowGeneCount,
+		windowSizeStep, windowStride);
+	printf("Done (%d windows).\n", workUnits.size());
+#elif defined(REGION_GROWING)
+	RegionGrowing::Options regionOptions;
+	regionOptions.minimumGeneCount = minimumGeneCount;
+	printf("Growing regions on a graph of %d nearest neighbours per gene... ",
+		   regionOptions.neighbourCount);
+	WorkUnits workUnits =
+		RegionGrowing::growRegions<NullAccumulator>(genes, regionOptions);
+	printf("Done (%d regions).\n", workUnits.size());
+#elif defined(NEAREST_GENE_BALLS)
+	printf("Generating %d balls of %d nearest genes... ", sampleCount,
+		   ballGeneCount);
+	WorkUnits workUnits = createNearestGeneWorkUnits(
+		ballGeneCount, maximumBallRadius, genes, sampleCount, true);
+	printf("Done.\n");
+#else
 	printf("Generating %d sphere samples... ", sampleCount);
 	int averageGenesInASphere = 0;
-	QVector<WorkUnit<Gene>> workUnits =
-		createWorkUnits(sphereRadius, genes, sampleCount,
-						&averageGenesInASphere);
-	printf("Done.\n");
+	WorkUnits workUnits = createSphereWorkUnits(
+		sphereRadius, genes, sampleCount, &averageGenesInASphere);
+	printf("Done (%d spheres).\n", workUnits.size());
 	printf("Average genes in a sphere: %d\n", averageGenesInASphere);
+#endif
+	const SphereCoverage coverage = sphereCoverage(genes.size(), workUnits);
+	coverage.print();
+	coverage.printHistogram();
 
 	// Then, for each of the samples, draw the same number of random samples of
 	// the same gene count. Calculate the same metric and calculate a p-value.
 
 	// Reuse random samples. We don't really need thousands of random samples for each of the thousands of sphere samples. 
 	// We need them for each *gene count*.
-	printf("Calculating statistic on %d random samples for all possible gene set sizes...", workUnits.size());
-	QMap<int, QVector<double>> geneCountToRandomStatistics;
-	for (WorkUnit<Gene> &workUnit : workUnits) {
-		const int geneCount = workUnit.genesInSphere.size();
-		if (geneCountToRandomStatistics.contains(geneCount)) continue;
-		printf("%d ", geneCount);
-
-		geneCountToRandomStatistics[geneCount].reserve(sampleCount);
-		for (int r = 0; r < sampleCount; r++) {
-			workUnit.randomSampler.sample(geneCount, &workUnit.randomGenes);
-			const double statisticInRandom = sphereTestStatistic(workUnit.randomGenes);
-			geneCountToRandomStatistics[geneCount].push_back(statisticInRandom);
-		}
-	}
-	printf("Done\n");
+	printf("Calculating statistic on %d random samples for all possible gene "
+		   "set sizes... ",
+		   nullSampleCount);
+	NullTables nullTables = buildNestedNullTables<NullAccumulator>(
+		genes, workUnits, nullSampleCount);
+	printf("Done (%d gene set sizes).\n", nullTables.geneCounts.size());
+
+#ifdef TAIL_FIT_P_VALUES
+	printf("Fitting generalized Pareto tails to the null tables... ");
+	TailFit::Report tailReport = nullTables.fitTails();
+	printf("Done.\n");
+#endif
+
+	printf("Calculating statistic in each of %d spheres... ",
+		   workUnits.size());
+#if defined(LINEAR_WINDOWS)
+	// Consecutive windows overlap in all but a few genes, so slide an
+	// accumulator along each run of them.
+	calculateWindowStatistics<NullAccumulator>(genes, workUnits);
+	printf("Done.\n");
+#elif defined(JACCARD_INDEX_TEST) || defined(NEAREST_GENE_BALLS) ||           \
+	defined(REGION_GROWING)
+	// Regions are not spheres, and a ball's radius may reach genes tied with
+	// its farthest one, so both use their gene lists rather than the octree.
+	calculateStatisticsInSpheres(genes, workUnits);
+	printf("Done.\n");
+#else
+	const AggregateOctree<Gene, NullAccumulator> octree(genes);
+	calculateStatisticsInSpheres(octree, workUnits);
+	printf("Done (octree of %d nodes).\n", octree.nodeCount());
+#endif
 
 	printf("Calculating p-value for each of %d spheres... ", workUnits.size());
-	for (int i = 0; i < workUnits.size(); i++) {
-		WorkUnit<Gene> &workUnit = workUnits[i];
-		
-		// Calculate metric in the sphere-sample
-		const double statisticInSphere = sphereTestStatistic(workUnit.genesInSphere);
-
-		// Random samples
-		const QVector<double> &statsOnRandomSample = geneCountToRandomStatistics[workUnit.genesInSphere.size()];
-		for (const double statisticInRandom : statsOnRandomSample) {
-			// Is random more extreme than sphere?
-			if (Gene::randomIsMoreExtreme(statisticInRandom, statisticInSphere))
-				workUnit.chanceWinCount++;
-		} // end for (N random samples)
-
-		workUnit.pValue = Gene::calculatePValue(workUnit.chanceWinCount, sampleCount);
-
-		// Give benefit of the doubt to chance: replace zero pValues with the
-		// smallest we can safely say
-		workUnit.pValue = std::max(workUnit.pValue, 1.0 / (double)sampleCount);
-	}
+#ifdef TAIL_FIT_P_VALUES
+	tailReport.fittedPValueCount =
+		calculatePValues<Gene>(workUnits, nullTables);
+	printf("Done.\n");
+	tailReport.print();
+#else
+	calculatePValues<Gene>(workUnits, nullTables);
 	printf("Done.\n");
+#endif
 
 	// Adjust p-values
 	printf("Adjusting p-values using Benjamini-Hochberg method... ");
-	benjamini(workUnits);
+	const QVector<int> order = benjamini(workUnits);
 	printf("Done.\n");
 
 	// Write p-values to file for later reference
@@ -308,36 +634,33 @@ void extractMotifFields(QSqlDatabase &db) {
 		if (!file.open(QIODevice::WriteOnly | QIODevice::Text))
 			throw QString("Failed to open file %1 for writing\n").arg(filename);
 		QTextStream out(&file);
-		for (const WorkUnit<Gene> &workUnit : workUnits) {
-			out << workUnit.pValue << '\t' << workUnit.adjustedPValue << '\n';
+		for (const int i : order) {
+			out << workUnits[i].pValue << '\t' << workUnits[i].adjustedPValue
+				<< '\n';
 		}
 		file.close();
 	}
 
 	// Filter by adjusted p-value
-	QVector<WorkUnit<Gene>> tmp;
-	std::copy_if(workUnits.begin(), workUnits.end(), std::back_inserter(tmp),
-				 [&](const WorkUnit<Gene> &x) {
-					 return x.adjustedPValue <= pAdjThreshold;
-				 });
-	workUnits = tmp;
-	printf("%d significant p-values (below %.05f)\n", workUnits.size(),
+	const QVector<int> significant =
+		filterByAdjustedPValue(workUnits, order, pAdjThreshold);
+	printf("%d significant p-values (below %.05f)\n", significant.size(),
 		   pAdjThreshold);
 
 	// Get the significant genes
-	QSet<QString> significantGenes;
-	for (const WorkUnit<Gene> &workUnit : workUnits) {
-		for (const Gene *gene : workUnit.genesInSphere) {
-			significantGenes.insert(gene->name);
-		}
+	GeneSet significantGenes(genes.size());
+	for (const int i : significant) {
+		significantGenes.insert(workUnits.genesBegin(workUnits[i]),
+								workUnits.genesEnd(workUnits[i]));
 	}
-	printf("%d significant genes.\n", significantGenes.size());
-
-	if (!workUnits.isEmpty()) {
-		printf("Here is the best sphere sample: (p-value: %f)\n",
-			   workUnits.front().pValue);
-		for (const Gene *gene : workUnits.front().genesInSphere) {
-			printf("%s ", gene->name.toUtf8().data());
+	printf("%d significant genes.\n", significantGenes.count());
+
+	if (!significant.isEmpty()) {
+		const WorkUnit &best = workUnits[significant.front()];
+		printf("Here is the best sphere sample: (p-value: %f)\n", best.pValue);
+		for (const GeneIndex *gene = workUnits.genesBegin(best);
+			 gene != workUnits.genesEnd(best); gene++) {
+			printf("%s ", genes.names[*gene].toUtf8().data());
 		}
 		printf("\n");
 	} else {
@@ -350,8 +673,9 @@ void extractMotifFields(QSqlDatabase &db) {
 		   "to consider clusters as distinct ... ",
 		   overlapThreshold * 100.0);
 	double maximumOverlapRatio = 0.0;
-	QVector<QSet<QString>> clusters =
-		clusterByGeneOverlap(workUnits, overlapThreshold, &maximumOverlapRatio);
+	QVector<GeneSet> clusters =
+		clusterByGeneOverlap(workUnits, significant, genes.size(),
+							 overlapThreshold, &maximumOverlapRatio);
 	printf("Done.\n");
 	printf("Stopping clustering with %d clusters, %.02f%% maximum gene "
 		   "overlap.\n",
@@ -361,47 +685,57 @@ void extractMotifFields(QSqlDatabase &db) {
 	// number of clusters because this is a random sampling, but mostly we get
 	// the same. Ordering the clusters by size.
 	std::sort(clusters.begin(), clusters.end(),
-			  [](const QSet<QString> &a, const QSet<QString> &b) {
-				  return a.size() < b.size();
+			  [](const GeneSet &a, const GeneSet &b) {
+				  return a.count() < b.count();
 			  });
 
 	// Cleanup duplicate genes - let the smaller cluster retain all its genes
-	QSet<QString> genesUsed;
-	for (QSet<QString> &cluster : clusters) {
+	GeneSet genesUsed(genes.size());
+	for (GeneSet &cluster : clusters) {
 		cluster.subtract(genesUsed);
 		genesUsed.unite(cluster);
 	}
 
 	// Report clusters
-	QMap<QString, Gene> nameToGene;
-	for (const Gene &gene : genes) {
-		nameToGene.insert(gene.name, gene);
-	}
 	for (int i = 0; i < clusters.size(); i++) {
-		QVector<const Gene*> tmp;
-		for (const QString &geneName : clusters[i]) {
-			tmp.push_back(&nameToGene[geneName]);
-		}
-		const double metric = sphereTestStatistic(tmp);
+		const QVector<GeneIndex> tmp = clusters[i].ids();
+		const double metric = sphereTestStatistic(genes.genes.constData(),
+												  tmp.constData(), tmp.size());
 
 		printf("\tCluster %d: %d genes\tMetric=%f\n", 
-			i + 1, clusters[i].size(), metric);
+			i + 1, tmp.size(), metric);
 	}
 
 	// Calculate the metric for the entire population to give a hint on range
 	{
-		QVector<const Gene*> tmp;
-		for (const Gene &gene : genes) {
-			tmp.push_back(&gene);
-		}
-		const double metricOverGenome = sphereTestStatistic(tmp);
+		const QVector<GeneIndex> tmp = genes.allIds();
+		const double metricOverGenome = sphereTestStatistic(
+			genes.genes.constData(), tmp.constData(), tmp.size());
 		printf("Metric calculated over the entire genome = %f\n", metricOverGenome);
 	}
 
 	// Write clusters to database for further evaluation
 	if (!clusters.isEmpty()) {
 		printf("Writing clusters to database ... ");
-		db::writeClusters(clusters, db, tableName);
+		db::writeClusters(clusters, genes.names, db, tableName);
+		printf("Done.\n");
+
+		// Motifs behind each field
+		const QVector<MotifEnrichment> enrichments =
+			motifEnrichment(genes, clusters);
+		for (int i = 0; i < clusters.size(); i++) {
+			printf("\tField %c enriched motifs:", 'A' + i);
+			for (const MotifEnrichment &enrichment : enrichments) {
+				if (enrichment.field == i &&
+					enrichment.adjustedPValue <= pAdjThreshold)
+					printf(" %s (%.1fx)",
+						   motifNames[enrichment.motif].toUtf8().data(),
+						   enrichment.foldEnrichment);
+			}
+			printf("\n");
+		}
+		printf("Writing motif enrichment to database ... ");
+		writeMotifEnrichment(db, enrichments, motifNames);
 		printf("Done.\n");
 	} else {
 		printf("No clusters found - not creating a table\n");
@@ -411,6 +745,22 @@ void extractMotifFields(QSqlDatabase &db) {
 	printf("\nElapsed time: %.02f minutes.\n", timer.elapsed() / 60000.0);
 }
 
+#ifdef COORDINATE_MODELS
+// Runs the sphere test on every coordinate model (see CoordinateModels.h)
+void extractMotifFieldsAcrossModels(QSqlDatabase &db) {
+	const GenePool<Gene> genes = loadGenes(db);
+	CoordinateModels::extractFields<NullAccumulator>(db, genes, nullSampleCount);
+}
+#endif
+
+#ifdef REPLICATES
+// Runs replicates of the sphere test with consensus fields (see Replicates.h)
+void extractMotifFieldsWithReplicates(QSqlDatabase &db) {
+	const GenePool<Gene> genes = loadGenes(db);
+	Replicates::extractFields<NullAccumulator>(db, genes, nullSampleCount);
+}
+#endif
+
 } // end anonymous namespace
 
 int main(int argc, char *argv[]) {
@@ -428,7 +778,13 @@ int main(int argc, char *argv[]) {
 	}
 
 	try {
+#ifdef COORDINATE_MODELS
+		extractMotifFieldsAcrossModels(db);
+#elif defined(REPLICATES)
+		extractMotifFieldsWithReplicates(db);
+#else
 		extractMotifFields(db);
+#endif
 	} catch (QString errorMessage) {
 		printf("ERROR: %s\n", errorMessage.toUtf8().data());
 		return 0;
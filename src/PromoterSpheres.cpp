@@ -24,6 +24,36 @@ This program implements the sphere sampling algorithm discussed in accompanying
 documentation. We use promoter-site histone modifications as input.
 */
 
+// Define this to take sphere centers from a scrambled Sobol sequence instead
+// of independent uniform draws, covering the box evenly with fewer spheres.
+//#define SOBOL_CENTERS
+
+// Define this to take sphere centers by Poisson-disk dart throwing instead,
+// one sphere radius apart
+//#define POISSON_DISK_CENTERS
+
+// Define this to stop sampling spheres once most genes are in enough of them.
+// sampleCount is then only a cap on the number of spheres (the target
+// is coveredGeneFraction in SphereTest.h).
+//#define COVERAGE_STOPPING
+
+// Define this to replace the histone marks by their leading principal
+// components before any distance is computed
+//#define PCA_HISTONES
+
+// Define this to test windows of consecutive genes along each chromosome
+// instead of spheres, as a linear-genome baseline
+//#define LINEAR_WINDOWS
+
+// Define this to screen spheres by z-score before the Monte Carlo test, so that
+// only spheres near the significance boundary get a Monte Carlo p-value
+//#define Z_SCORE_SCREENING
+
+// Define this to precompute all pairwise histone distances and evaluate the
+// Monte Carlo random sets in cache-blocked batches. Needs 4 bytes per gene
+// pair, so about 140 MB for 6000 genes.
+//#define BATCHED_PAIR_SUMS
+
 // Settings
 namespace {
 
@@ -32,7 +62,11 @@ const char *statisticDescription =
 	"Average gene Euclidean distance of the group, in histone space.";
 
 // Table name in the DB, where the resulting clusters will be persisted.
+#ifdef LINEAR_WINDOWS
+const char *tableName = "PromoterWindowFields";
+#else
 const char *tableName = "PromoterFields";
+#endif
 
 // Radius of the sampling sphere
 const double sphereRadius = 15.0;
@@ -40,6 +74,14 @@ const double sphereRadius = 15.0;
 // Threshold to disregard mostly empty spheres
 const int minimumGeneCount = 50;
 
+#ifdef LINEAR_WINDOWS
+// Windows run from minimumGeneCount to maximumWindowGeneCount consecutive
+// genes in steps of windowSizeStep, one starting every windowStride genes
+const int maximumWindowGeneCount = 200;
+const int windowSizeStep = 10;
+const int windowStride = 1;
+#endif
+
 // Minimum/maximum x,y,z dimension of the gene box. This box is where random
 // spheres are picked from.
 const double boxMinimum = 0.0;
@@ -50,6 +92,12 @@ const double boxMaximum = 210.0;
 // sphere. So processing time is O(n^2) to this.
 const int sampleCount = 10000;
 
+#ifdef PCA_HISTONES
+// Histone space keeps the fewest principal components which explain this
+// fraction of the variance
+const double explainedVarianceFraction = 0.95;
+#endif
+
 // Filter sphere samples by adjusted p-value. I propose to run this program
 // twice: on first run p-values can be examined (they are written to text file).
 // Subsequently, you can set this to a sane value, so that only significant
@@ -62,12 +110,23 @@ const double pAdjThreshold = 0.01;
 // sharing one or a few genes.
 const double overlapThreshold = 0.05;
 
+#ifdef Z_SCORE_SCREENING
+// With z-score screening, sphere p-values come from the analytic mean and
+// variance of the statistic over random sets. Only spheres whose z-score is
+// within this margin of the significance boundary get a Monte Carlo p-value.
+const double zScoreMargin = 2.0;
+#endif
+
 } // namespace
 
 #define HISTONE_COLUMN_COUNT 9
 
+#include "utils/GenePool.h"
+#include "utils/GeneSet.h"
+#include "utils/PrincipalComponents.h"
 #include "utils/RandomGeneSampler.h"
 #include "utils/SaveClustersToDB.h"
+#include "utils/Scheduler.h"
 #include "utils/SphereGeneSampler.h"
 #include "utils/SphereTest.h"
 #include "utils/Vec3D.h"
@@ -89,27 +148,27 @@ const double overlapThreshold = 0.05;
 
 namespace {
 
-// Define your Gene structure here. It is required that Gene at least contains:
-//		* QString name
-//		* Vec3D position
-//		* p-value helper functions. See below. These basically define what
-//			consists an "extreme" outcome.
+// Histone columns the distance reads. Principal component projection may
+// lower this.
+#ifdef PCA_HISTONES
+int histoneDimension = HISTONE_COLUMN_COUNT;
+#else
+const int histoneDimension = HISTONE_COLUMN_COUNT;
+#endif
+
+// Define your Gene structure here. Gene holds the hot data the statistic
+// reads; names and positions are kept separately by GenePool. It is also
+// required that Gene contains p-value helper functions. See below. These
+// basically define what consists an "extreme" outcome.
 struct Gene {
-	QString name;
-	Vec3D position;
-	QVector<double> histones;
+	// Single precision keeps the record within a cache line. Distances are
+	// still accumulated in double precision.
+	float histones[HISTONE_COLUMN_COUNT];
 
 	double histonesDistance(const Gene &other) const {
-		if (histones.size() != other.histones.size())
-			throw(QString("Histone count mismatch: gene %1(%2) - gene %3(%4)")
-					  .arg(name)
-					  .arg(histones.size())
-					  .arg(other.name)
-					  .arg(other.histones.size()));
-
 		double distanceSquared = 0.0;
-		for (int i = 0; i < histones.size(); i++) {
-			const double d = other.histones[i] - histones[i];
+		for (int i = 0; i < histoneDimension; i++) {
+			const double d = (double)other.histones[i] - (double)histones[i];
 			distanceSquared += d * d;
 		}
 		return sqrt(distanceSquared);
@@ -123,12 +182,13 @@ struct Gene {
 	}
 
 	// Implement this to calculate p-value. Single- and Double-tailed tests may
-	// be implemented this way.
-	static double calculatePValue(int randomMoreExtremeOccurrences,
+	// be implemented this way. Occurrences may be fractional when they are
+	// estimated rather than counted.
+	static double calculatePValue(double randomMoreExtremeOccurrences,
 								  int totalRandomSamples) {
 		// Calculate 1-tailed p-value
 		double pValue =
-			(double)randomMoreExtremeOccurrences / (double)totalRandomSamples;
+			randomMoreExtremeOccurrences / (double)totalRandomSamples;
 
 		// Use this to convert to 2-tailed test
 		// pValue = 2.0 * std::min(pValue, 1.0 - pValue);
@@ -137,31 +197,32 @@ struct Gene {
 	}
 
 	// Define this to control when a sphere-sample is acceptable
-	static bool acceptSample(const QVector<const Gene*> &genes) {
-		return genes.size() >= minimumGeneCount;
+	static bool acceptSample(const Gene *, const GeneIndex *, int count) {
+		return count >= minimumGeneCount;
 	}
 };
 
 // Load set of genes from DB
-QVector<Gene> loadGenes(QSqlDatabase &db, const QString &whereClause = "") {
-	QVector<Gene> result;
+GenePool<Gene> loadGenes(QSqlDatabase &db, const QString &whereClause = "") {
+	GenePool<Gene> result;
 
 	const QString sql = QString("SELECT l.Gene, x, y, z, h.* FROM "
 								"Loci l JOIN HistonesPromoterPatched h ON "
 								"l.Gene = h.Gene ORDER BY Chromosome, Start");
 	QSqlQuery query(sql, db);
 	while (query.next()) {
-		Gene gene;
-		gene.name = query.value(0).toString();
-		gene.position.x = query.value(1).toDouble();
-		gene.position.y = query.value(2).toDouble();
-		gene.position.z = query.value(3).toDouble();
+		const QString name = query.value(0).toString();
+		Vec3D position;
+		position.x = query.value(1).toDouble();
+		position.y = query.value(2).toDouble();
+		position.z = query.value(3).toDouble();
 		const QString nameRepeated = query.value(4).toString();
-		for (int i = 5; i < 5 + HISTONE_COLUMN_COUNT; i++) {
-			gene.histones.push_back(query.value(i).toDouble());
+		Gene gene;
+		for (int i = 0; i < HISTONE_COLUMN_COUNT; i++) {
+			gene.histones[i] = (float)query.value(5 + i).toDouble();
 		}
 
-		result.push_back(gene);
+		result.add(name, position, gene);
 	}
 
 	if (query.lastError().type() != QSqlError::NoError)
@@ -173,22 +234,23 @@ QVector<Gene> loadGenes(QSqlDatabase &db, const QString &whereClause = "") {
 }
 
 // This implements the sphere test statistic for our particular test.
-double sphereTestStatistic(const QVector<const Gene *> &genes) {
-	if (genes.isEmpty())
+double sphereTestStatistic(const Gene *genes, const GeneIndex *ids,
+						   int count) {
+	if (count == 0)
 		throw(QString("sphereTestStatistic(): Empty gene list provided!"));
-	if (genes.size() == 1)
+	if (count == 1)
 		return 0.0;
 
 	double totalDistance = 0.0;
-	int count = 0;
-	for (int i = 0; i < genes.size(); i++) {
-		for (double j = i + 1; j < genes.size(); j++) {
-			totalDistance += genes[i]->histonesDistance(*genes[j]);
-			count++;
+	for (int i = 0; i < count; i++) {
+		const Gene &gene = genes[ids[i]];
+		for (int j = i + 1; j < count; j++) {
+			totalDistance += gene.histonesDistance(genes[ids[j]]);
 		}
 	}
+	const int pairCount = count * (count - 1) / 2;
 
-	return totalDistance / (double)count;
+	return totalDistance / (double)pairCount;
 }
 
 // This function performs the sphere test. An almost identical copy of this
@@ -199,35 +261,108 @@ void extractPromoterFields(QSqlDatabase &db) {
 	printf("Description of measured statistic:\n\t%s\n", statisticDescription);
 
 	// Load genes
-	const QVector<Gene> genes = loadGenes(db);
+#ifdef PCA_HISTONES
+	GenePool<Gene> genes = loadGenes(db);
+	histoneDimension = reduceToPrincipalComponents(
+		genes.genes, HISTONE_COLUMN_COUNT, explainedVarianceFraction,
+		[](Gene &gene) { return gene.histones; });
+#else
+	const GenePool<Gene> genes = loadGenes(db);
+#endif
 	printf("%d genes\n", genes.size());
 
 	QElapsedTimer timer;
 	timer.start();
 
+#ifdef BATCHED_PAIR_SUMS
+	printf("Precomputing histone distances... ");
+	const int n = genes.size();
+	QVector<float> histoneDistances(n * n);
+	float *distances = histoneDistances.data();
+#pragma omp parallel for schedule(dynamic, 16)
+	for (int a = 0; a < n; a++) {
+		for (int b = 0; b < n; b++) {
+			distances[a * n + b] =
+				(float)genes.genes[a].histonesDistance(genes.genes[b]);
+		}
+	}
+	const PairSumEvaluator<float> evaluator(histoneDistances.constData(), n);
+	printf("Done (%d MB).\n",
+		   (int)((qint64)n * n * (int)sizeof(float) / (1024 * 1024)));
+#endif
+
 	// Generate a number of sphere samples
 
+#ifdef LINEAR_WINDOWS
+	printf("Generating windows of %d to %d consecutive genes... ",
+		   minimumGeneCount, maximumWindowGeneCount);
+	const Sampler::WindowGeneSampler windowSampler =
+		Sampler::WindowGeneSampler::fromLoci(db, genes);
+	WorkUnits workUnits = createWindowWorkUnits(
+		genes, windowSampler, minimumGeneCount, maximumWindowGeneCount,
+		windowSizeStep, windowStride);
+	printf("Done (%d windows).\n", workUnits.size());
+#else
 	printf("Generating %d sphere samples... ", sampleCount);
 	int averageGenesInASphere = 0;
-	QVector<WorkUnit<Gene>> workUnits =
-		createWorkUnits(sphereRadius, genes, sampleCount,
-						&averageGenesInASphere);
-	printf("Done.\n");
+	WorkUnits workUnits = createSphereWorkUnits(
+		sphereRadius, genes, sampleCount, &averageGenesInASphere);
+	printf("Done (%d spheres).\n", workUnits.size());
 	printf("Average genes in a sphere: %d\n", averageGenesInASphere);
+#endif
+	const SphereCoverage coverage = sphereCoverage(genes.size(), workUnits);
+	coverage.print();
+	coverage.printHistogram();
+
+#ifdef Z_SCORE_SCREENING
+	calculateStatisticsInSpheres(genes, workUnits);
+	printf("Calculating null moments of the statistic... ");
+	const PairwiseNullMoments moments =
+		pairwiseNullMoments(genes.size(), [&](GeneIndex a, GeneIndex b) {
+			return genes.genes[a].histonesDistance(genes.genes[b]);
+		});
+	printf("Done (mean %f).\n", moments.mean);
+	const QVector<int> monteCarloUnits = screenByZScore<Gene>(
+		workUnits, moments, sampleCount, pAdjThreshold, zScoreMargin);
+	printf("%d of %d spheres within %.01f of the significance boundary in "
+		   "z-score\n",
+		   monteCarloUnits.size(), workUnits.size(), zScoreMargin);
+#else
+	QVector<int> monteCarloUnits(workUnits.size());
+	for (int i = 0; i < workUnits.size(); i++) {
+		monteCarloUnits[i] = i;
+	}
+#endif
 
 	// Then, for each of the samples, draw the same number of random samples of
 	// the same gene count. Calculate the same metric and calculate a p-value.
 	printf("Calculating p-values for %d sphere samples using %d random samples "
 		   "for each... ",
-		   sampleCount, sampleCount);
-#pragma omp parallel for
-	for (int i = 0; i < workUnits.size(); i++) {
-		WorkUnit<Gene> &workUnit = workUnits[i];
-		workUnit.calculatePValue(sampleCount);
+		   monteCarloUnits.size(), sampleCount);
+	// A unit costs (gene count)^2 per random sample, and sphere sizes vary a
+	// lot, so we hand out the most expensive units first.
+	QVector<double> costs(monteCarloUnits.size());
+	for (int j = 0; j < monteCarloUnits.size(); j++) {
+		const WorkUnit &workUnit = workUnits[monteCarloUnits[j]];
+		costs[j] = (double)workUnit.geneCount * workUnit.geneCount;
 	}
+	const Scheduler::Report schedulerReport = Scheduler::runLargestFirst(
+		costs, [&]() { return ThreadState(genes.size()); },
+		[&](int j, ThreadState &threadState) {
+#ifdef BATCHED_PAIR_SUMS
+			calculatePValueBatched(genes, workUnits, monteCarloUnits[j],
+								   sampleCount, &threadState, evaluator);
+#else
+			calculatePValue(genes, workUnits, monteCarloUnits[j], sampleCount,
+							&threadState);
+#endif
+		});
 	printf("Done.\n");
+	schedulerReport.print();
 
-	// Write statistic measure for sphere and random to file for further processing
+	// Write statistic measure for sphere and random to file for further
+	// processing. Spheres settled by z-score screening have the null mean as
+	// their random statistic.
 	{
 		const QString filename =
 			QString("Results/StatInSphereAndRandom.%1.tsv").arg(tableName);
@@ -236,7 +371,7 @@ void extractPromoterFields(QSqlDatabase &db) {
 		if (!file.open(QIODevice::WriteOnly | QIODevice::Text))
 			throw QString("Failed to open file %1 for writing\n").arg(filename);
 		QTextStream out(&file);
-		for (const WorkUnit<Gene> &workUnit : workUnits) {
+		for (const WorkUnit &workUnit : workUnits.units) {
 			out << workUnit.statisticInSphere << '\t' << workUnit.statisticInRandom << '\n';
 		}
 		file.close();
@@ -244,7 +379,7 @@ void extractPromoterFields(QSqlDatabase &db) {
 
 	// Adjust p-values
 	printf("Adjusting p-values using Benjamini-Hochberg method... ");
-	benjamini(workUnits);
+	const QVector<int> order = benjamini(workUnits);
 	printf("Done.\n");
 
 	// Write p-values to file for later reference
@@ -256,36 +391,33 @@ void extractPromoterFields(QSqlDatabase &db) {
 		if (!file.open(QIODevice::WriteOnly | QIODevice::Text))
 			throw QString("Failed to open file %1 for writing\n").arg(filename);
 		QTextStream out(&file);
-		for (const WorkUnit<Gene> &workUnit : workUnits) {
-			out << workUnit.pValue << '\t' << workUnit.adjustedPValue << '\n';
+		for (const int i : order) {
+			out << workUnits[i].pValue << '\t' << workUnits[i].adjustedPValue
+				<< '\n';
 		}
 		file.close();
 	}
 
 	// Filter by adjusted p-value
-	QVector<WorkUnit<Gene>> tmp;
-	std::copy_if(workUnits.begin(), workUnits.end(), std::back_inserter(tmp),
-				 [&](const WorkUnit<Gene> &x) {
-					 return x.adjustedPValue <= pAdjThreshold;
-				 });
-	workUnits = tmp;
-	printf("%d significant p-values (below %.05f)\n", workUnits.size(),
+	const QVector<int> significant =
+		filterByAdjustedPValue(workUnits, order, pAdjThreshold);
+	printf("%d significant p-values (below %.05f)\n", significant.size(),
 		   pAdjThreshold);
 
 	// Get the significant genes
-	QSet<QString> significantGenes;
-	for (const WorkUnit<Gene> &workUnit : workUnits) {
-		for (const Gene *gene : workUnit.genesInSphere) {
-			significantGenes.insert(gene->name);
-		}
+	GeneSet significantGenes(genes.size());
+	for (const int i : significant) {
+		significantGenes.insert(workUnits.genesBegin(workUnits[i]),
+								workUnits.genesEnd(workUnits[i]));
 	}
-	printf("%d significant genes.\n", significantGenes.size());
-
-	if (!workUnits.isEmpty()) {
-		printf("Here is the best sphere sample: (p-value: %f)\n",
-			   workUnits.front().pValue);
-		for (const Gene *gene : workUnits.front().genesInSphere) {
-			printf("%s ", gene->name.toUtf8().data());
+	printf("%d significant genes.\n", significantGenes.count());
+
+	if (!significant.isEmpty()) {
+		const WorkUnit &best = workUnits[significant.front()];
+		printf("Here is the best sphere sample: (p-value: %f)\n", best.pValue);
+		for (const GeneIndex *gene = workUnits.genesBegin(best);
+			 gene != workUnits.genesEnd(best); gene++) {
+			printf("%s ", genes.names[*gene].toUtf8().data());
 		}
 		printf("\n");
 	} else {
@@ -298,8 +430,9 @@ void extractPromoterFields(QSqlDatabase &db) {
 		   "to consider clusters as distinct ... ",
 		   overlapThreshold * 100.0);
 	double maximumOverlapRatio = 0.0;
-	QVector<QSet<QString>> clusters =
-		clusterByGeneOverlap(workUnits, overlapThreshold, &maximumOverlapRatio);
+	QVector<GeneSet> clusters =
+		clusterByGeneOverlap(workUnits, significant, genes.size(),
+							 overlapThreshold, &maximumOverlapRatio);
 	printf("Done.\n");
 	printf("Stopping clustering with %d clusters, %.02f%% maximum gene "
 		   "overlap.\n",
@@ -309,26 +442,26 @@ void extractPromoterFields(QSqlDatabase &db) {
 	// number of clusters because this is a random sampling, but mostly we get
 	// the same. Ordering the clusters by size.
 	std::sort(clusters.begin(), clusters.end(),
-			  [](const QSet<QString> &a, const QSet<QString> &b) {
-				  return a.size() < b.size();
+			  [](const GeneSet &a, const GeneSet &b) {
+				  return a.count() < b.count();
 			  });
 
 	// Cleanup duplicate genes - let the smaller cluster retain all its genes
-	QSet<QString> genesUsed;
-	for (QSet<QString> &cluster : clusters) {
+	GeneSet genesUsed(genes.size());
+	for (GeneSet &cluster : clusters) {
 		cluster.subtract(genesUsed);
 		genesUsed.unite(cluster);
 	}
 
 	// Report clusters
 	for (int i = 0; i < clusters.size(); i++) {
-		printf("\tCluster %d: %d genes\n", i + 1, clusters[i].size());
+		printf("\tCluster %d: %d genes\n", i + 1, clusters[i].count());
 	}
 
 	// Write clusters to database for further evaluation
 	if (!clusters.isEmpty()) {
 		printf("Writing clusters to database ... ");
-		db::writeClusters(clusters, db, tableName);
+		db::writeClusters(clusters, genes.names, db, tableName);
 		printf("Done.\n");
 	} else {
 		printf("No clusters found - not creating a table\n");
@@ -24,6 +24,45 @@ This program implements the sphere sampling algorithm discussed in accompanying
 documentation. We use replication timing as input.
 */
 
+// Define this to summarize the null distributions with t-digests instead of
+// keeping every random statistic. Memory then stays at a few kilobytes per
+// gene count however large the sample count.
+//#define NULL_SKETCHES
+
+// Define this to sample balls of a fixed number of nearest genes instead of
+// spheres of a fixed radius. One null distribution then serves all of them.
+//#define NEAREST_GENE_BALLS
+
+// Define this to take sphere centers from a scrambled Sobol sequence instead
+// of independent uniform draws, covering the box evenly with fewer spheres.
+//#define SOBOL_CENTERS
+
+// Define this to take sphere centers by Poisson-disk dart throwing instead,
+// one sphere radius apart
+//#define POISSON_DISK_CENTERS
+
+// Define this to stop sampling spheres once most genes are in enough of them.
+// sampleCount is then only a cap on the number of spheres (the target
+// is coveredGeneFraction in SphereTest.h).
+//#define COVERAGE_STOPPING
+
+// Define this to search for the most extreme spheres by hill climbing from
+// the best random ones, with a max-statistic null, instead of testing
+// thousands of random spheres.
+//#define SPHERE_SEARCH
+
+// Define this to run the test on every coordinate model of the genes (Loci and
+// the LociModels table), with null tables shared by all models
+//#define COORDINATE_MODELS
+
+// Define this to run several replicates of the test at once and combine their
+// fields into consensus fields
+//#define REPLICATES
+
+// Define this to test windows of consecutive genes along each chromosome
+// instead of spheres, as a linear-genome baseline
+//#define LINEAR_WINDOWS
+
 // Settings
 namespace {
 
@@ -31,7 +70,11 @@ namespace {
 const char *statisticDescription = "Standard deviation of replication timing in sphere.";
 
 // Table name in the DB, where the resulting clusters will be persisted.
+#ifdef LINEAR_WINDOWS
+const char *tableName = "ReplicationTimingWindowFields";
+#else
 const char *tableName = "ReplicationTImingFields";
+#endif
 
 // Radius of the sampling sphere
 const double sphereRadius = 15.0;
@@ -39,6 +82,21 @@ const double sphereRadius = 15.0;
 // Threshold to disregard mostly empty spheres
 const int minimumGeneCount = 50;
 
+#ifdef LINEAR_WINDOWS
+// Windows run from minimumGeneCount to maximumWindowGeneCount consecutive
+// genes in steps of windowSizeStep, one starting every windowStride genes
+const int maximumWindowGeneCount = 200;
+const int windowSizeStep = 10;
+const int windowStride = 1;
+#endif
+
+#ifdef NEAREST_GENE_BALLS
+// Genes in each ball, centered on a random gene. Balls wider than
+// maximumBallRadius lie in mostly empty space and are disregarded.
+const int ballGeneCount = 100;
+const double maximumBallRadius = 2.0 * sphereRadius;
+#endif
+
 // Minimum/maximum x,y,z dimension of the gene box. This box is where random
 // spheres are picked from.
 const double boxMinimum = 0.0;
@@ -61,11 +119,23 @@ const double pAdjThreshold = 0.05;
 // sharing one or a few genes.
 const double overlapThreshold = 0.05;
 
+#ifdef REPLICATES
+// Independent replicates of the whole test, and the fraction of them in
+// which two genes must share a field to be linked in the consensus
+const int replicateCount = 10;
+const double consensusThreshold = 0.5;
+#endif
+
 } // namespace
 
+#include "utils/CoordinateModels.h"
+#include "utils/GenePool.h"
+#include "utils/GeneSet.h"
 #include "utils/RandomGeneSampler.h"
+#include "utils/Replicates.h"
 #include "utils/SaveClustersToDB.h"
 #include "utils/SphereGeneSampler.h"
+#include "utils/SphereSearch.h"
 #include "utils/SphereTest.h"
 #include "utils/Vec3D.h"
 
@@ -88,14 +158,11 @@ const double overlapThreshold = 0.05;
 
 namespace {
 
-// Define your Gene structure here. It is required that Gene at least contains:
-//		* QString name
-//		* Vec3D position
-//		* p-value helper functions. See below. These basically define what
-//			consists an "extreme" outcome.
+// Define your Gene structure here. Gene holds the hot data the statistic
+// reads; names and positions are kept separately by GenePool. It is also
+// required that Gene contains p-value helper functions. See below. These
+// basically define what consists an "extreme" outcome.
 struct Gene {
-	QString name;
-	Vec3D position;
 	double replicationTiming = 0.0;
 	int orderInGenome;
 
@@ -107,12 +174,13 @@ struct Gene {
 	}
 
 	// Implement this to calculate p-value. Single- and Double-tailed tests may
-	// be implemented this way.
-	static double calculatePValue(int randomMoreExtremeOccurrences,
+	// be implemented this way. Occurrences may be fractional when they are
+	// estimated rather than counted.
+	static double calculatePValue(double randomMoreExtremeOccurrences,
 								  int totalRandomSamples) {
 		// Calculate 1-tailed p-value
 		double pValue =
-			(double)randomMoreExtremeOccurrences / (double)totalRandomSamples;
+			randomMoreExtremeOccurrences / (double)totalRandomSamples;
 
 		// Use this to convert to 2-tailed test
 		// pValue = 2.0 * std::min(pValue, 1.0 - pValue);
@@ -121,23 +189,23 @@ struct Gene {
 	}
 
 	// Define this to control when a sphere-sample is acceptable
-	static bool acceptSample(const QVector<const Gene *> &genes) {
-		if (genes.size() < minimumGeneCount)
+	static bool acceptSample(const Gene *genes, const GeneIndex *ids,
+							 int count) {
+		if (count < minimumGeneCount)
 			return false;
 
 		// Replication timing is a smooth signal. Therefore we want spheres that
 		// conver more than one chromosome, or more than one locations of the
 		// same chromosome. We encode this as a gene index jump of at least 100
 		// genes.
-		QVector<const Gene *> sorted = genes;
-		std::sort(sorted.begin(), sorted.end(),
-				  [](const Gene *a, const Gene *b) {
-					  return a->orderInGenome < b->orderInGenome;
-				  });
+		QVector<int> sorted(count);
+		for (int i = 0; i < count; i++) {
+			sorted[i] = genes[ids[i]].orderInGenome;
+		}
+		std::sort(sorted.begin(), sorted.end());
 		const int minimumIndexSpaceJump = 100;
 		for (int i = 1; i < sorted.size(); i++) {
-			if (sorted[i]->orderInGenome - sorted[i - 1]->orderInGenome >=
-				minimumIndexSpaceJump)
+			if (sorted[i] - sorted[i - 1] >= minimumIndexSpaceJump)
 				return true;
 		}
 
@@ -146,23 +214,24 @@ struct Gene {
 };
 
 // Load set of genes from DB
-QVector<Gene> loadGenes(QSqlDatabase &db, const QString &whereClause = "") {
-	QVector<Gene> result;
+GenePool<Gene> loadGenes(QSqlDatabase &db, const QString &whereClause = "") {
+	GenePool<Gene> result;
 
 	const QString sql = QString(
 		"SELECT l.Gene, x, y, z, ReplicationTiming FROM Loci l JOIN "
 		"ReplicationTiming r ON l.Gene = r.Gene ORDER BY Chromosome, Start");
 	QSqlQuery query(sql, db);
 	while (query.next()) {
+		const QString name = query.value(0).toString();
+		Vec3D position;
+		position.x = query.value(1).toDouble();
+		position.y = query.value(2).toDouble();
+		position.z = query.value(3).toDouble();
 		Gene gene;
-		gene.name = query.value(0).toString();
-		gene.position.x = query.value(1).toDouble();
-		gene.position.y = query.value(2).toDouble();
-		gene.position.z = query.value(3).toDouble();
 		gene.replicationTiming = query.value(4).toDouble();
 		gene.orderInGenome = result.size();
 
-		result.push_back(gene);
+		result.add(name, position, gene);
 	}
 
 	if (query.lastError().type() != QSqlError::NoError)
@@ -174,29 +243,66 @@ QVector<Gene> loadGenes(QSqlDatabase &db, const QString &whereClause = "") {
 }
 
 // This implements the sphere test statistic for our particular test.
-double sphereTestStatistic(const QVector<const Gene *> &genes) {
-	if (genes.isEmpty())
+double sphereTestStatistic(const Gene *genes, const GeneIndex *ids,
+						   int count) {
+	if (count == 0)
 		throw(QString("Empty gene list provided!"));
 
 	// Calculate average
 	double average = 0.0;
-	for (const Gene *gene : genes) {
-		average += gene->replicationTiming;
+	for (int i = 0; i < count; i++) {
+		average += genes[ids[i]].replicationTiming;
 	}
-	average /= (double)genes.size();
+	average /= (double)count;
 
 	double variance = 0.0;
-	for (const Gene *gene : genes) {
-		double averageDiff = gene->replicationTiming - average;
+	for (int i = 0; i < count; i++) {
+		double averageDiff = genes[ids[i]].replicationTiming - average;
 		variance += averageDiff * averageDiff;
 	}
-	variance /= (double)genes.size();
+	variance /= (double)count;
 
 	const double stdev = sqrt(variance);
 
 	return stdev;
 }
 
+// Incremental version of sphereTestStatistic(), for building the null tables
+// one gene at a time. Uses Welford's update of the mean and the sum of squared
+// deviations, which stays accurate where sum and sum of squares would not.
+struct NullAccumulator {
+	int count = 0;
+	double average = 0.0;
+	double squaredDeviations = 0.0;
+
+	void clear() { *this = NullAccumulator(); }
+
+	void add(const Gene *genes, GeneIndex id) {
+		const double x = genes[id].replicationTiming;
+		count++;
+		const double averageDiff = x - average;
+		average += averageDiff / (double)count;
+		squaredDeviations += averageDiff * (x - average);
+	}
+
+	// Reverse of add(), for sliding windows
+	void remove(const Gene *genes, GeneIndex id) {
+		const double x = genes[id].replicationTiming;
+		count--;
+		if (count == 0) {
+			clear();
+			return;
+		}
+		const double averageDiff = x - average;
+		average -= averageDiff / (double)count;
+		squaredDeviations -= averageDiff * (x - average);
+	}
+
+	double statistic() const {
+		return sqrt(squaredDeviations / (double)count);
+	}
+};
+
 // This function performs the sphere test. An almost identical copy of this
 // function exists in all similar sphere-test programs. This is a compromise
 // between reusability and flexibility. Heavy parts of the procedure have been
@@ -205,20 +311,53 @@ void extractReplicationTimingFields(QSqlDatabase &db) {
 	printf("Description of measured statistic:\n\t%s\n", statisticDescription);
 
 	// Load genes
-	const QVector<Gene> genes = loadGenes(db);
+	const GenePool<Gene> genes = loadGenes(db);
 	printf("%d genes\n", genes.size());
 
 	QElapsedTimer timer;
 	timer.start();
 
+#ifdef SPHERE_SEARCH
+	SphereSearch::Options searchOptions;
+	searchOptions.startRadius = sphereRadius;
+	printf("Searching for the most extreme spheres, with %d shuffled runs for "
+		   "the null... ",
+		   searchOptions.permutationCount);
+	SphereSearch::Result search =
+		SphereSearch::search<NullAccumulator>(genes, searchOptions);
+	WorkUnits &workUnits = search.workUnits;
+	printf("Done (%lld statistic evaluations).\n",
+		   (long long)search.evaluationCount);
+	const QVector<int> order = familyWiseOrder(workUnits);
+#else
 	// Generate a number of sphere samples
 
+#ifdef LINEAR_WINDOWS
+	printf("Generating windows of %d to %d consecutive genes... ",
+		   minimumGeneCount, maximumWindowGeneCount);
+	const Sampler::WindowGeneSampler windowSampler =
+		Sampler::WindowGeneSampler::fromLoci(db, genes);
+	WorkUnits workUnits = createWindowWorkUnits(
+		genes, windowSampler, minimumGeneCount, maximumWindowGeneCount,
+		windowSizeStep, windowStride);
+	printf("Done (%d windows).\n", workUnits.size());
+#elif defined(NEAREST_GENE_BALLS)
+	printf("Generating %d balls of %d nearest genes... ", sampleCount,
+		   ballGeneCount);
+	WorkUnits workUnits = createNearestGeneWorkUnits(
+		ballGeneCount, maximumBallRadius, genes, sampleCount, true);
+	printf("Done.\n");
+#else
 	printf("Generating %d sphere samples... ", sampleCount);
 	int averageGenesInASphere = 0;
-	QVector<WorkUnit<Gene>> workUnits = createWorkUnits(
+	WorkUnits workUnits = createSphereWorkUnits(
 		sphereRadius, genes, sampleCount, &averageGenesInASphere);
-	printf("Done.\n");
+	printf("Done (%d spheres).\n", workUnits.size());
 	printf("Average genes in a sphere: %d\n", averageGenesInASphere);
+#endif
+	const SphereCoverage coverage = sphereCoverage(genes.size(), workUnits);
+	coverage.print();
+	coverage.printHistogram();
 
 	// Then, for each of the samples, draw the same number of random samples of
 	// the same gene count. Calculate the same metric and calculate a p-value.
@@ -227,55 +366,34 @@ void extractReplicationTimingFields(QSqlDatabase &db) {
 	// for each of the thousands of sphere samples. We need them for each *gene
 	// count*.
 	printf("Calculating statistic on %d random samples for all possible gene "
-		   "set sizes...",
-		   workUnits.size());
-	QMap<int, QVector<double>> geneCountToRandomStatistics;
-	for (WorkUnit<Gene> &workUnit : workUnits) {
-		const int geneCount = workUnit.genesInSphere.size();
-		if (geneCountToRandomStatistics.contains(geneCount))
-			continue;
-		printf("%d ", geneCount);
-
-		geneCountToRandomStatistics[geneCount].reserve(sampleCount);
-		for (int r = 0; r < sampleCount; r++) {
-			workUnit.randomSampler.sample(geneCount, &workUnit.randomGenes);
-			const double statisticInRandom =
-				sphereTestStatistic(workUnit.randomGenes);
-			geneCountToRandomStatistics[geneCount].push_back(statisticInRandom);
-		}
-	}
-	printf("Done\n");
+		   "set sizes... ",
+		   sampleCount);
+#ifdef NULL_SKETCHES
+	const NullSketches nullTables = buildNestedNullSketches<NullAccumulator>(
+		genes, workUnits, sampleCount);
+	printf("Done (%d gene set sizes, %d KB of sketches).\n",
+		   nullTables.geneCounts.size(), nullTables.byteSize() / 1024);
+#else
+	const NullTables nullTables = buildNestedNullTables<NullAccumulator>(
+		genes, workUnits, sampleCount);
+	printf("Done (%d gene set sizes).\n", nullTables.geneCounts.size());
+#endif
+
+#ifdef LINEAR_WINDOWS
+	calculateWindowStatistics<NullAccumulator>(genes, workUnits);
+#else
+	calculateStatisticsInSpheres(genes, workUnits);
+#endif
 
 	printf("Calculating p-value for each of %d spheres... ", workUnits.size());
-	for (int i = 0; i < workUnits.size(); i++) {
-		WorkUnit<Gene> &workUnit = workUnits[i];
-
-		// Calculate metric in the sphere-sample
-		const double statisticInSphere =
-			sphereTestStatistic(workUnit.genesInSphere);
-
-		// Random samples
-		const QVector<double> &statsOnRandomSample =
-			geneCountToRandomStatistics[workUnit.genesInSphere.size()];
-		for (const double statisticInRandom : statsOnRandomSample) {
-			// Is random more extreme than sphere?
-			if (Gene::randomIsMoreExtreme(statisticInRandom, statisticInSphere))
-				workUnit.chanceWinCount++;
-		} // end for (N random samples)
-
-		workUnit.pValue =
-			Gene::calculatePValue(workUnit.chanceWinCount, sampleCount);
-
-		// Give benefit of the doubt to chance: replace zero pValues with the
-		// smallest we can safely say
-		workUnit.pValue = std::max(workUnit.pValue, 1.0 / (double)sampleCount);
-	}
+	calculatePValues<Gene>(workUnits, nullTables);
 	printf("Done.\n");
 
 	// Adjust p-values
 	printf("Adjusting p-values using Benjamini-Hochberg method... ");
-	benjamini(workUnits);
+	const QVector<int> order = benjamini(workUnits);
 	printf("Done.\n");
+#endif // SPHERE_SEARCH
 
 	// Write p-values to file for later reference
 	{
@@ -286,36 +404,33 @@ void extractReplicationTimingFields(QSqlDatabase &db) {
 		if (!file.open(QIODevice::WriteOnly | QIODevice::Text))
 			throw QString("Failed to open file %1 for writing\n").arg(filename);
 		QTextStream out(&file);
-		for (const WorkUnit<Gene> &workUnit : workUnits) {
-			out << workUnit.pValue << '\t' << workUnit.adjustedPValue << '\n';
+		for (const int i : order) {
+			out << workUnits[i].pValue << '\t' << workUnits[i].adjustedPValue
+				<< '\n';
 		}
 		file.close();
 	}
 
 	// Filter by adjusted p-value
-	QVector<WorkUnit<Gene>> tmp;
-	std::copy_if(workUnits.begin(), workUnits.end(), std::back_inserter(tmp),
-				 [&](const WorkUnit<Gene> &x) {
-					 return x.adjustedPValue <= pAdjThreshold;
-				 });
-	workUnits = tmp;
-	printf("%d significant p-values (below %.05f)\n", workUnits.size(),
+	const QVector<int> significant =
+		filterByAdjustedPValue(workUnits, order, pAdjThreshold);
+	printf("%d significant p-values (below %.05f)\n", significant.size(),
 		   pAdjThreshold);
 
 	// Get the significant genes
-	QSet<QString> significantGenes;
-	for (const WorkUnit<Gene> &workUnit : workUnits) {
-		for (const Gene *gene : workUnit.genesInSphere) {
-			significantGenes.insert(gene->name);
-		}
+	GeneSet significantGenes(genes.size());
+	for (const int i : significant) {
+		significantGenes.insert(workUnits.genesBegin(workUnits[i]),
+								workUnits.genesEnd(workUnits[i]));
 	}
-	printf("%d significant genes.\n", significantGenes.size());
-
-	if (!workUnits.isEmpty()) {
-		printf("Here is the best sphere sample: (p-value: %f)\n",
-			   workUnits.front().pValue);
-		for (const Gene *gene : workUnits.front().genesInSphere) {
-			printf("%s ", gene->name.toUtf8().data());
+	printf("%d significant genes.\n", significantGenes.count());
+
+	if (!significant.isEmpty()) {
+		const WorkUnit &best = workUnits[significant.front()];
+		printf("Here is the best sphere sample: (p-value: %f)\n", best.pValue);
+		for (const GeneIndex *gene = workUnits.genesBegin(best);
+			 gene != workUnits.genesEnd(best); gene++) {
+			printf("%s ", genes.names[*gene].toUtf8().data());
 		}
 		printf("\n");
 	} else {
@@ -328,8 +443,9 @@ void extractReplicationTimingFields(QSqlDatabase &db) {
 		   "to consider clusters as distinct ... ",
 		   overlapThreshold * 100.0);
 	double maximumOverlapRatio = 0.0;
-	QVector<QSet<QString>> clusters =
-		clusterByGeneOverlap(workUnits, overlapThreshold, &maximumOverlapRatio);
+	QVector<GeneSet> clusters =
+		clusterByGeneOverlap(workUnits, significant, genes.size(),
+							 overlapThreshold, &maximumOverlapRatio);
 	printf("Done.\n");
 	printf("Stopping clustering with %d clusters, %.02f%% maximum gene "
 		   "overlap.\n",
@@ -339,40 +455,32 @@ void extractReplicationTimingFields(QSqlDatabase &db) {
 	// number of clusters because this is a random sampling, but mostly we get
 	// the same. Ordering the clusters by size.
 	std::sort(clusters.begin(), clusters.end(),
-			  [](const QSet<QString> &a, const QSet<QString> &b) {
-				  return a.size() < b.size();
+			  [](const GeneSet &a, const GeneSet &b) {
+				  return a.count() < b.count();
 			  });
 
 	// Cleanup duplicate genes - let the smaller cluster retain all its genes
-	QSet<QString> genesUsed;
-	for (QSet<QString> &cluster : clusters) {
+	GeneSet genesUsed(genes.size());
+	for (GeneSet &cluster : clusters) {
 		cluster.subtract(genesUsed);
 		genesUsed.unite(cluster);
 	}
 
 	// Report clusters
-	QMap<QString, Gene> nameToGene;
-	for (const Gene &gene : genes) {
-		nameToGene.insert(gene.name, gene);
-	}
 	for (int i = 0; i < clusters.size(); i++) {
-		QVector<const Gene *> tmp;
-		for (const QString &geneName : clusters[i]) {
-			tmp.push_back(&nameToGene[geneName]);
-		}
-		const double metric = sphereTestStatistic(tmp);
+		const QVector<GeneIndex> tmp = clusters[i].ids();
+		const double metric = sphereTestStatistic(genes.genes.constData(),
+												  tmp.constData(), tmp.size());
 
-		printf("\tCluster %d: %d genes\tMetric=%f\n", i + 1, clusters[i].size(),
+		printf("\tCluster %d: %d genes\tMetric=%f\n", i + 1, tmp.size(),
 			   metric);
 	}
 
 	// Calculate the metric for the entire population to give a hint on range
 	{
-		QVector<const Gene *> tmp;
-		for (const Gene &gene : genes) {
-			tmp.push_back(&gene);
-		}
-		const double metricOverGenome = sphereTestStatistic(tmp);
+		const QVector<GeneIndex> tmp = genes.allIds();
+		const double metricOverGenome = sphereTestStatistic(
+			genes.genes.constData(), tmp.constData(), tmp.size());
 		printf("Metric calculated over the entire genome = %f\n",
 			   metricOverGenome);
 	}
@@ -380,7 +488,7 @@ void extractReplicationTimingFields(QSqlDatabase &db) {
 	// Write clusters to database for further evaluation
 	if (!clusters.isEmpty()) {
 		printf("Writing clusters to database ... ");
-		db::writeClusters(clusters, db, tableName);
+		db::writeClusters(clusters, genes.names, db, tableName);
 		printf("Done.\n");
 	} else {
 		printf("No clusters found - not creating a table\n");
@@ -390,6 +498,22 @@ void extractReplicationTimingFields(QSqlDatabase &db) {
 	printf("\nElapsed time: %.02f minutes.\n", timer.elapsed() / 60000.0);
 }
 
+#ifdef COORDINATE_MODELS
+// Runs the sphere test on every coordinate model (see CoordinateModels.h)
+void extractReplicationTimingFieldsAcrossModels(QSqlDatabase &db) {
+	const GenePool<Gene> genes = loadGenes(db);
+	CoordinateModels::extractFields<NullAccumulator>(db, genes);
+}
+#endif
+
+#ifdef REPLICATES
+// Runs replicates of the sphere test with consensus fields (see Replicates.h)
+void extractReplicationTimingFieldsWithReplicates(QSqlDatabase &db) {
+	const GenePool<Gene> genes = loadGenes(db);
+	Replicates::extractFields<NullAccumulator>(db, genes);
+}
+#endif
+
 } // end anonymous namespace
 
 int main(int argc, char *argv[]) {
@@ -407,7 +531,13 @@ int main(int argc, char *argv[]) {
 	}
 
 	try {
+#ifdef COORDINATE_MODELS
+		extractReplicationTimingFieldsAcrossModels(db);
+#elif defined(REPLICATES)
+		extractReplicationTimingFieldsWithReplicates(db);
+#else
 		extractReplicationTimingFields(db);
+#endif
 	} catch (QString errorMessage) {
 		printf("ERROR: %s\n", errorMessage.toUtf8().data());
 		return 0;
@@ -0,0 +1,446 @@
+/*
+Copyright 2021 Michael Georgoulopoulos
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files(the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and / or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions :
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+/*
+This program asks, for every per-gene feature we have, whether the feature is
+spatially clustered, without going through sphere sampling. It builds a sparse
+distance-weighted neighbour matrix over the gene positions of the Loci table
+and computes, for every feature column:
+
+- Global Moran's I: is the feature, over the whole nucleus, more similar
+  between neighbours than chance would have it?
+- Local Getis-Ord Gi*: for every gene, is the feature unusually high (hot
+  spot) or low (cold spot) around it?
+
+Both get permutation p-values. Each replicate shuffles the feature values over
+the genes and recomputes every gene's weighted neighbourhood sum once, which
+gives Moran's I and all the Gi* of that replicate together. Replicates run in
+parallel. The Gi* map can then be compared with the sphere-derived fields.
+
+Coexpression is a property of gene pairs rather than of genes, so it is not
+covered here.
+*/
+
+#include <QFile>
+#include <QSqlDatabase>
+#include <QSqlError>
+#include <QSqlQuery>
+#include <QSqlRecord>
+#include <QString>
+#include <QVariant>
+#include <QVector>
+
+#include <algorithm>
+#include <cmath>
+#include <random>
+
+#include "utils/SpatialGrid.h"
+#include "utils/Vec3D.h"
+
+// Settings
+namespace {
+
+// Genes closer than this are neighbours. Weights fall smoothly from 1 at
+// distance 0 to 0 at this distance.
+const double neighbourRadius = 10.0;
+
+// Label permutations for the p-values
+const int permutationCount = 999;
+
+// Feature tables and their columns. No columns means every column except
+// Gene.
+struct FeatureSource {
+	const char *table;
+	QVector<QString> columns;
+};
+const FeatureSource featureSources[] = {
+	{"HistonesPromoterPatched", {}},
+	{"ReplicationTiming", {"ReplicationTiming"}},
+	{"Conservation", {"SpeciesCount"}},
+	{"TranscriptionFactorMotifs", {}},
+};
+
+// Result tables in the DB
+const char *globalTableName = "MoransI";
+const char *localTableName = "GiStar";
+
+} // namespace
+
+namespace {
+
+// All feature columns of one table, for the genes which have them
+struct FeatureTable {
+	QString source;
+	QVector<QString> genes;
+	QVector<Vec3D> positions;
+	QVector<QString> featureNames;
+
+	// One vector per feature, in the order of genes
+	QVector<QVector<double>> features;
+};
+
+FeatureTable loadFeatureTable(QSqlDatabase &db, const FeatureSource &source) {
+	FeatureTable result;
+	result.source = source.table;
+
+	const QString sql = QString("SELECT l.Gene, x, y, z, t.* FROM Loci l JOIN "
+								"%1 t ON l.Gene = t.Gene ORDER BY Chromosome, "
+								"Start")
+							.arg(source.table);
+	QSqlQuery query(sql, db);
+
+	// Record columns to read: the first four are gene and position
+	QVector<int> columns;
+	const QSqlRecord record = query.record();
+	for (int c = 4; c < record.count(); c++) {
+		const QString name = record.fieldName(c);
+		if (source.columns.isEmpty() ? name != "Gene"
+									 : source.columns.contains(name)) {
+			columns.push_back(c);
+			result.featureNames.push_back(name);
+		}
+	}
+	if (columns.isEmpty())
+		throw(QString("No feature columns in table %1").arg(source.table));
+	result.features.resize(columns.size());
+
+	while (query.next()) {
+		result.genes.push_back(query.value(0).toString());
+		result.positions.push_back(Vec3D(query.value(1).toDouble(),
+										 query.value(2).toDouble(),
+										 query.value(3).toDouble()));
+		for (int f = 0; f < columns.size(); f++) {
+			result.features[f].push_back(query.value(columns[f]).toDouble());
+		}
+	}
+
+	if (query.lastError().type() != QSqlError::NoError)
+		throw(QString("Failed to process query: %1\nDBTEXT: %2")
+				  .arg(sql)
+				  .arg(query.lastError().databaseText()));
+
+	return result;
+}
+
+// Sparse symmetric neighbour weights, row by row. A gene is not its own
+// neighbour here; Gi* adds the gene itself with weight 1.
+struct SpatialWeights {
+	QVector<int> offsets;
+	QVector<int> neighbours;
+	QVector<double> weights;
+
+	// Per row: sum and sum of squares of the weights
+	QVector<double> rowSums;
+	QVector<double> rowSquareSums;
+
+	// Sum of all weights
+	double totalWeight = 0.0;
+
+	int size() const { return rowSums.size(); }
+};
+
+SpatialWeights buildWeights(const QVector<Vec3D> &positions, double radius) {
+	const int count = positions.size();
+	const SpatialGrid grid(positions, radius);
+	const double radiusSquared = radius * radius;
+
+	QVector<QVector<QPair<int, double>>> rows(count);
+	QVector<QPair<int, double>> *row = rows.data();
+#pragma omp parallel for schedule(dynamic, 64)
+	for (int i = 0; i < count; i++) {
+		grid.forEachWithin(positions[i], radius, [&](int j, double d) {
+			if (j != i)
+				row[i].push_back(qMakePair(j, 1.0 - d / radiusSquared));
+		});
+	}
+
+	SpatialWeights result;
+	result.offsets.resize(count + 1);
+	result.rowSums.fill(0.0, count);
+	result.rowSquareSums.fill(0.0, count);
+	result.offsets[0] = 0;
+	for (int i = 0; i < count; i++) {
+		result.offsets[i + 1] = result.offsets[i] + rows[i].size();
+		for (const QPair<int, double> &link : rows[i]) {
+			result.neighbours.push_back(link.first);
+			result.weights.push_back(link.second);
+			result.rowSums[i] += link.second;
+			result.rowSquareSums[i] += link.second * link.second;
+		}
+		result.totalWeight += result.rowSums[i];
+	}
+	return result;
+}
+
+// Weighted sum of the neighbours' values, for every gene
+void spatialLag(const SpatialWeights &w, const double *values, double *lag) {
+	const int *offsets = w.offsets.constData();
+	const int *neighbours = w.neighbours.constData();
+	const double *weights = w.weights.constData();
+	for (int i = 0; i < w.size(); i++) {
+		double sum = 0.0;
+		for (int k = offsets[i]; k < offsets[i + 1]; k++) {
+			sum += weights[k] * values[neighbours[k]];
+		}
+		lag[i] = sum;
+	}
+}
+
+struct Autocorrelation {
+	double moransI = 0.0;
+	double expectedI = 0.0;
+	double pValue = 1.0;
+
+	// Per gene
+	QVector<double> giStar;
+	QVector<double> giStarPValues;
+};
+
+// Moran's I and Gi* of one feature, with permutation p-values. Both are
+// two-sided: Moran's I against its expectation, Gi* against 0.
+Autocorrelation autocorrelation(const SpatialWeights &w,
+								const QVector<double> &values,
+								int permutationCount) {
+	const int n = values.size();
+	Autocorrelation result;
+	result.expectedI = -1.0 / (double)(n - 1);
+	result.giStar.fill(0.0, n);
+	result.giStarPValues.fill(1.0, n);
+
+	// Deviations from the mean. Permutations leave mean and variance alone.
+	double mean = 0.0;
+	for (double x : values) {
+		mean += x;
+	}
+	mean /= (double)n;
+	QVector<double> deviations(n);
+	double squareSum = 0.0;
+	for (int i = 0; i < n; i++) {
+		deviations[i] = values[i] - mean;
+		squareSum += deviations[i] * deviations[i];
+	}
+	if (squareSum <= 0.0 || w.totalWeight <= 0.0)
+		return result;
+	const double deviation = sqrt(squareSum / (double)n);
+
+	// Gi* denominators, with the gene itself in its neighbourhood
+	QVector<double> giDenominators(n);
+	for (int i = 0; i < n; i++) {
+		const double rowSum = w.rowSums[i] + 1.0;
+		const double rowSquareSum = w.rowSquareSums[i] + 1.0;
+		giDenominators[i] =
+			deviation * sqrt(std::max(0.0, (n * rowSquareSum -
+											rowSum * rowSum) /
+												(double)(n - 1)));
+	}
+
+	// Moran's I and Gi* of an arrangement of the deviations
+	auto evaluate = [&](const double *z, double *lag, double *giStar) {
+		spatialLag(w, z, lag);
+		double crossSum = 0.0;
+		for (int i = 0; i < n; i++) {
+			crossSum += z[i] * lag[i];
+			giStar[i] = giDenominators[i] > 0.0
+							? (lag[i] + z[i]) / giDenominators[i]
+							: 0.0;
+		}
+		return (double)n / w.totalWeight * crossSum / squareSum;
+	};
+
+	QVector<double> lag(n);
+	result.moransI =
+		evaluate(deviations.constData(), lag.data(), result.giStar.data());
+	const double observedDistance = std::abs(result.moransI - result.expectedI);
+
+	int globalWins = 0;
+	QVector<int> localWins(n, 0);
+#pragma omp parallel
+	{
+		QVector<int> permutation(n);
+		QVector<double> permuted(n);
+		QVector<double> permutedLag(n);
+		QVector<double> permutedGiStar(n);
+		QVector<int> threadLocalWins(n, 0);
+		int threadGlobalWins = 0;
+#pragma omp for schedule(dynamic, 8)
+		for (int r = 0; r < permutationCount; r++) {
+			for (int i = 0; i < n; i++) {
+				permutation[i] = i;
+			}
+			std::default_random_engine generator(r + 1);
+			std::shuffle(permutation.begin(), permutation.end(), generator);
+			for (int i = 0; i < n; i++) {
+				permuted[i] = deviations[permutation[i]];
+			}
+
+			const double moransI = evaluate(
+				permuted.constData(), permutedLag.data(), permutedGiStar.data());
+			if (std::abs(moransI - result.expectedI) >= observedDistance)
+				threadGlobalWins++;
+			for (int i = 0; i < n; i++) {
+				if (std::abs(permutedGiStar[i]) >= std::abs(result.giStar[i]))
+					threadLocalWins[i]++;
+			}
+		}
+#pragma omp critical
+		{
+			globalWins += threadGlobalWins;
+			for (int i = 0; i < n; i++) {
+				localWins[i] += threadLocalWins[i];
+			}
+		}
+	}
+
+	result.pValue =
+		(double)(globalWins + 1) / (double)(permutationCount + 1);
+	for (int i = 0; i < n; i++) {
+		result.giStarPValues[i] =
+			(double)(localWins[i] + 1) / (double)(permutationCount + 1);
+	}
+	return result;
+}
+
+void execNonQuery(QSqlDatabase &db, const QString &sql) {
+	QSqlQuery query = db.exec(sql);
+	if (query.lastError().type() != QSqlError::NoError)
+		throw(QString("Failed to process query: %1\nDBTEXT: %2")
+				  .arg(sql)
+				  .arg(query.lastError().databaseText()));
+}
+
+void createResultTables(QSqlDatabase &db) {
+	execNonQuery(db, QString("DROP TABLE IF EXISTS %1").arg(globalTableName));
+	execNonQuery(db, QString("CREATE TABLE %1 (Source TEXT, Feature TEXT, "
+							 "MoransI REAL, ExpectedI REAL, PValue REAL)")
+						 .arg(globalTableName));
+	execNonQuery(db, QString("DROP TABLE IF EXISTS %1").arg(localTableName));
+	execNonQuery(db, QString("CREATE TABLE %1 (Gene TEXT, Source TEXT, "
+							 "Feature TEXT, GiStar REAL, PValue REAL)")
+						 .arg(localTableName));
+}
+
+void writeResults(QSqlDatabase &db, const FeatureTable &table,
+				  const QString &feature, const Autocorrelation &result) {
+	const QString sqlGlobal =
+		QString("INSERT INTO %1 (Source, Feature, MoransI, ExpectedI, PValue) "
+				"VALUES (:Source, :Feature, :MoransI, :ExpectedI, :PValue)")
+			.arg(globalTableName);
+	QSqlQuery queryGlobal(db);
+	if (!queryGlobal.prepare(sqlGlobal))
+		throw QString("Failed to create query: %1").arg(sqlGlobal);
+	queryGlobal.bindValue(":Source", table.source);
+	queryGlobal.bindValue(":Feature", feature);
+	queryGlobal.bindValue(":MoransI", result.moransI);
+	queryGlobal.bindValue(":ExpectedI", result.expectedI);
+	queryGlobal.bindValue(":PValue", result.pValue);
+	if (!queryGlobal.exec())
+		throw QString("Failed to exec query: %1").arg(sqlGlobal);
+
+	const QString sqlLocal =
+		QString("INSERT INTO %1 (Gene, Source, Feature, GiStar, PValue) "
+				"VALUES (:Gene, :Source, :Feature, :GiStar, :PValue)")
+			.arg(localTableName);
+	QSqlQuery queryLocal(db);
+	if (!queryLocal.prepare(sqlLocal))
+		throw QString("Failed to create query: %1").arg(sqlLocal);
+	for (int i = 0; i < table.genes.size(); i++) {
+		queryLocal.bindValue(":Gene", table.genes[i]);
+		queryLocal.bindValue(":Source", table.source);
+		queryLocal.bindValue(":Feature", feature);
+		queryLocal.bindValue(":GiStar", result.giStar[i]);
+		queryLocal.bindValue(":PValue", result.giStarPValues[i]);
+		if (!queryLocal.exec())
+			throw QString("Failed to exec query: %1").arg(sqlLocal);
+	}
+}
+
+void calculateSpatialAutocorrelation(QSqlDatabase &db) {
+	createResultTables(db);
+
+	for (const FeatureSource &source : featureSources) {
+		const FeatureTable table = loadFeatureTable(db, source);
+		printf("%s: %d genes, %d features\n", source.table,
+			   table.genes.size(), table.features.size());
+
+		// Gene sets differ between tables, so each gets its own weights
+		const SpatialWeights weights =
+			buildWeights(table.positions, neighbourRadius);
+		printf("%.1f neighbours per gene within %.1f\n",
+			   (double)weights.neighbours.size() /
+				   (double)std::max(1, weights.size()),
+			   neighbourRadius);
+
+		// One transaction per table, or inserting the Gi* takes forever
+		db.transaction();
+		for (int f = 0; f < table.features.size(); f++) {
+			const Autocorrelation result = autocorrelation(
+				weights, table.features[f], permutationCount);
+
+			int hotSpots = 0;
+			int coldSpots = 0;
+			for (int i = 0; i < result.giStar.size(); i++) {
+				if (result.giStarPValues[i] > 0.05)
+					continue;
+				if (result.giStar[i] > 0.0)
+					hotSpots++;
+				else
+					coldSpots++;
+			}
+			printf("\t%s: Moran's I %.4f (expected %.4f), p-value %.4f, "
+				   "%d hot and %d cold genes at p <= 0.05\n",
+				   table.featureNames[f].toUtf8().data(), result.moransI,
+				   result.expectedI, result.pValue, hotSpots, coldSpots);
+
+			writeResults(db, table, table.featureNames[f], result);
+		}
+		db.commit();
+	}
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+	const QString &filename = "Results/yeast.sqlite";
+
+	if (!QFile::exists(filename)) {
+		printf("No such file: %s\n", filename.toUtf8().data());
+		return 0;
+	}
+
+	QSqlDatabase db = QSqlDatabase::addDatabase("QSQLITE");
+	db.setDatabaseName(filename);
+	if (!db.open()) {
+		printf("Failed to open file: %s\n", filename.toUtf8().data());
+	}
+
+	try {
+		calculateSpatialAutocorrelation(db);
+	} catch (QString errorMessage) {
+		printf("ERROR: %s\n", errorMessage.toUtf8().data());
+		return 0;
+	}
+
+	db.close();
+
+	printf("Full success\n");
+
+	return 0;
+}
@@ -28,6 +28,12 @@ database table.
 
 #define HISTONE_COUNT 9
 
+// Define this to replace the histone marks by their leading principal
+// components before any distance is computed
+//#define PCA_HISTONES
+
+#include "utils/PrincipalComponents.h"
+
 #include <QFile>
 #include <QMap>
 #include <QSqlDatabase>
@@ -40,6 +46,20 @@ database table.
 #include <algorithm>
 
 namespace {
+#ifdef PCA_HISTONES
+// Histone space keeps the fewest principal components which explain this
+// fraction of the variance
+const double explainedVarianceFraction = 0.95;
+#endif
+
+// Histone columns the distance reads. Principal component projection may
+// lower this.
+#ifdef PCA_HISTONES
+int histoneDimension = HISTONE_COUNT;
+#else
+const int histoneDimension = HISTONE_COUNT;
+#endif
+
 struct Gene {
 	QString name;
 	int chromosome = 1;
@@ -56,7 +76,7 @@ struct Gene {
 
 	double distance(const Gene &other) const {
 		double accum = 0.0;
-		for (int i = 0; i < HISTONE_COUNT; i++) {
+		for (int i = 0; i < histoneDimension; i++) {
 			const double d = other.histones[i] - histones[i];
 			accum += d * d;
 		}
@@ -220,6 +240,12 @@ void classifyAndUpdateDatabase(QSqlDatabase &db) {
 	// Load genes
 	QVector<Gene> genes = loadGenes(db);
 
+#ifdef PCA_HISTONES
+	histoneDimension = reduceToPrincipalComponents(
+		genes, HISTONE_COUNT, explainedVarianceFraction,
+		[](Gene &gene) { return gene.histones; });
+#endif
+
 	// Load scaffold
 	GeneToCommunity scaffold = loadScaffold(db);
 
@@ -0,0 +1,243 @@
+/*
+Copyright 2021 Michael Georgoulopoulos
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files(the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and / or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions :
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+/*
+AggregateOctree answers sphere queries for statistics that decompose into sums
+over genes, such as mean and variance or per-motif counts, without visiting
+every gene of the sphere. Each octree node keeps the aggregate of all genes
+below it. A query takes the aggregates of nodes entirely inside the sphere as
+they are, skips nodes entirely outside, and only visits the genes of leaves
+crossing the sphere's surface. The cost then grows with the sphere's surface
+rather than its volume. Only the statistic is answered this way: sampling the
+centers and listing a sphere's genes for its work unit still go through
+SphereGeneSampler, and stay linear in the genes per sphere.
+
+Aggregate is the statistic's accumulator and must provide:
+	void clear();
+	void add(const Gene *genes, GeneIndex id);
+	void merge(const Aggregate &other); // as if other's genes were add()ed
+Gene membership uses the same test as SphereGeneSampler, so a query gives the
+aggregate of exactly the genes the sampler would return for that sphere.
+*/
+
+#ifndef _AGGREGATE_OCTREE_H_
+#define _AGGREGATE_OCTREE_H_
+
+#include <QVector>
+
+#include <algorithm>
+
+#include "GenePool.h"
+#include "Vec3D.h"
+
+template <class Gene, class Aggregate> class AggregateOctree {
+  public:
+	AggregateOctree(const GenePool<Gene> &pool, int leafSize = 16)
+		: genes(pool.genes.constData()), positions(pool.positions),
+		  leafSize(leafSize) {
+		order = pool.allIds();
+		if (!order.isEmpty()) {
+			nodes.resize(1);
+			aggregates.resize(1);
+			build(0, 0, order.size(), 0);
+		}
+	}
+
+	// Aggregate of the genes within radius of center, and their count.
+	Aggregate query(const Vec3D &center, double radius,
+					int *geneCount = nullptr) const {
+		Aggregate result;
+		result.clear();
+		int count = 0;
+		if (nodes.isEmpty()) {
+			if (geneCount)
+				*geneCount = 0;
+			return result;
+		}
+
+		const double radiusSquared = radius * radius;
+		int stack[8 * maximumDepth + 8];
+		int stackSize = 0;
+		stack[stackSize++] = 0;
+		while (stackSize > 0) {
+			const Node &node = nodes[stack[--stackSize]];
+			if (nearestDistanceSquared(node, center) > radiusSquared)
+				continue;
+			if (farthestDistanceSquared(node, center) <= radiusSquared) {
+				result.merge(aggregates[&node - nodes.constData()]);
+				count += node.count;
+				continue;
+			}
+			if (node.firstChild < 0) {
+				// Leaf crossing the surface: gene by gene
+				const Vec3D *position = positions.constData();
+				for (int i = node.first; i < node.first + node.count; i++) {
+					const GeneIndex id = order[i];
+					if (Vec3D::distanceSquared(center, position[id]) <=
+						radiusSquared) {
+						result.add(genes, id);
+						count++;
+					}
+				}
+				continue;
+			}
+			for (int c = 0; c < node.childCount; c++) {
+				stack[stackSize++] = node.firstChild + c;
+			}
+		}
+
+		if (geneCount)
+			*geneCount = count;
+		return result;
+	}
+
+	int nodeCount() const { return nodes.size(); }
+
+  private:
+	static const int maximumDepth = 24;
+
+	struct Node {
+		// Tight bounding box of the node's genes
+		Vec3D minimum;
+		Vec3D maximum;
+
+		// Genes of the node are order[first] .. order[first + count - 1]
+		int first = 0;
+		int count = 0;
+
+		// Children are stored next to each other; -1 for leaves
+		int firstChild = -1;
+		int childCount = 0;
+	};
+
+	static double nearestDistanceSquared(const Node &node,
+										 const Vec3D &point) {
+		const Vec3D nearest(
+			std::min(std::max(point.x, node.minimum.x), node.maximum.x),
+			std::min(std::max(point.y, node.minimum.y), node.maximum.y),
+			std::min(std::max(point.z, node.minimum.z), node.maximum.z));
+		return Vec3D::distanceSquared(point, nearest);
+	}
+
+	static double farthestDistanceSquared(const Node &node,
+										  const Vec3D &point) {
+		const Vec3D farthest(
+			point.x - node.minimum.x > node.maximum.x - point.x
+				? node.minimum.x
+				: node.maximum.x,
+			point.y - node.minimum.y > node.maximum.y - point.y
+				? node.minimum.y
+				: node.maximum.y,
+			point.z - node.minimum.z > node.maximum.z - point.z
+				? node.minimum.z
+				: node.maximum.z);
+		return Vec3D::distanceSquared(point, farthest);
+	}
+
+	// Builds the node of order[first .. first + count - 1] into the slot at
+	// index, and everything below it.
+	void build(int index, int first, int count, int depth) {
+		Node node;
+		node.first = first;
+		node.count = count;
+		node.minimum = node.maximum = positions[order[first]];
+		for (int i = first; i < first + count; i++) {
+			const Vec3D &p = positions[order[i]];
+			node.minimum.x = std::min(node.minimum.x, p.x);
+			node.minimum.y = std::min(node.minimum.y, p.y);
+			node.minimum.z = std::min(node.minimum.z, p.z);
+			node.maximum.x = std::max(node.maximum.x, p.x);
+			node.maximum.y = std::max(node.maximum.y, p.y);
+			node.maximum.z = std::max(node.maximum.z, p.z);
+		}
+		Aggregate aggregate;
+		aggregate.clear();
+
+		const bool degenerate = node.minimum.x == node.maximum.x &&
+								node.minimum.y == node.maximum.y &&
+								node.minimum.z == node.maximum.z;
+		if (count <= leafSize || depth >= maximumDepth || degenerate) {
+			for (int i = first; i < first + count; i++) {
+				aggregate.add(genes, order[i]);
+			}
+			nodes[index] = node;
+			aggregates[index] = aggregate;
+			return;
+		}
+
+		// Split into octants around the box center (counting sort)
+		const Vec3D middle = (node.minimum + node.maximum) * 0.5;
+		auto octant = [&](GeneIndex id) {
+			const Vec3D &p = positions[id];
+			return (p.x > middle.x ? 1 : 0) | (p.y > middle.y ? 2 : 0) |
+				   (p.z > middle.z ? 4 : 0);
+		};
+		int octantCounts[8] = {};
+		for (int i = first; i < first + count; i++) {
+			octantCounts[octant(order[i])]++;
+		}
+		int octantStarts[9];
+		octantStarts[0] = first;
+		for (int o = 0; o < 8; o++) {
+			octantStarts[o + 1] = octantStarts[o] + octantCounts[o];
+		}
+		QVector<GeneIndex> sorted(count);
+		int next[8];
+		std::copy(octantStarts, octantStarts + 8, next);
+		for (int i = first; i < first + count; i++) {
+			const GeneIndex id = order[i];
+			sorted[next[octant(id)]++ - first] = id;
+		}
+		std::copy(sorted.constBegin(), sorted.constEnd(),
+				  order.begin() + first);
+
+		// Children go next to each other, so reserve their slots first
+		QVector<int> nonEmpty;
+		for (int o = 0; o < 8; o++) {
+			if (octantCounts[o] > 0)
+				nonEmpty.push_back(o);
+		}
+		node.firstChild = nodes.size();
+		node.childCount = nonEmpty.size();
+		nodes.resize(nodes.size() + node.childCount);
+		aggregates.resize(nodes.size());
+		for (int c = 0; c < nonEmpty.size(); c++) {
+			const int o = nonEmpty[c];
+			build(node.firstChild + c, octantStarts[o], octantCounts[o],
+				  depth + 1);
+			aggregate.merge(aggregates[node.firstChild + c]);
+		}
+		nodes[index] = node;
+		aggregates[index] = aggregate;
+	}
+
+	const Gene *genes;
+	const QVector<Vec3D> &positions;
+	int leafSize;
+	QVector<GeneIndex> order;
+
+	// Node geometry is what a query walks, so it is kept apart from the
+	// (possibly large) aggregates, which are only read for inner nodes.
+	QVector<Node> nodes;
+	QVector<Aggregate> aggregates;
+};
+
+#endif // _AGGREGATE_OCTREE_H_
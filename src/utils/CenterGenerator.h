@@ -0,0 +1,241 @@
+/*
+Copyright 2021 Michael Georgoulopoulos
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files(the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and / or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions :
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+/*
+CenterGenerator picks sphere centers in the gene box. Independent uniform draws
+leave clumps and gaps, so covering the whole box takes many redundant spheres.
+Two low-discrepancy alternatives spread the centers evenly instead:
+
+- Sobol: a 3D Sobol sequence, scrambled with a random digital shift drawn
+  from the seed. The shift keeps the sequence's evenness; runs with the same
+  seed, such as the programs' default one, get the same centers.
+- PoissonDisk: blue noise by dart throwing. A center is kept only if it is at
+  least minimumSpacing away from all previous ones. When no dart fits after
+  many attempts the box is full, and a fresh layer starts on top of it.
+*/
+
+#ifndef _CENTER_GENERATOR_H_
+#define _CENTER_GENERATOR_H_
+
+#include <QString>
+#include <QVector>
+
+#include <algorithm>
+#include <cmath>
+#include <random>
+
+#include "Vec3D.h"
+
+namespace Sampler {
+
+enum class CenterSequence { Uniform, Sobol, PoissonDisk };
+
+class CenterGenerator {
+  public:
+	// Runs with different seeds get different centers; for Sobol, a different
+	// random shift. The default seed makes runs repeatable.
+	CenterGenerator(
+		CenterSequence sequence, double boxMinimum, double boxMaximum,
+		double minimumSpacing = 0.0,
+		unsigned seed = std::default_random_engine::default_seed)
+		: sequence(sequence), boxMinimum(boxMinimum), boxMaximum(boxMaximum),
+		  generator(seed), distribution(boxMinimum, boxMaximum) {
+		if (sequence == CenterSequence::Sobol)
+			initializeSobol();
+		if (sequence == CenterSequence::PoissonDisk) {
+			if (minimumSpacing <= 0.0)
+				throw(QString("Poisson-disk centers need a positive spacing"));
+			initializePoissonDisk(minimumSpacing);
+		}
+	}
+
+	Vec3D next() {
+		switch (sequence) {
+		case CenterSequence::Sobol:
+			return nextSobol();
+		case CenterSequence::PoissonDisk:
+			return nextPoissonDisk();
+		default:
+			return nextUniform();
+		}
+	}
+
+  private:
+	static const int sobolBits = 32;
+
+	Vec3D nextUniform() {
+		Vec3D center;
+		center.x = distribution(generator);
+		center.y = distribution(generator);
+		center.z = distribution(generator);
+		return center;
+	}
+
+	// Direction numbers of the first three Sobol dimensions (Joe & Kuo):
+	// the van der Corput sequence, then primitive polynomials x + 1 and
+	// x^2 + x + 1.
+	void initializeSobol() {
+		struct Polynomial {
+			int degree;
+			unsigned coefficients;
+			unsigned initial[2];
+		};
+		const Polynomial polynomials[2] = {{1, 0, {1, 0}}, {2, 1, {1, 3}}};
+
+		for (int bit = 0; bit < sobolBits; bit++) {
+			directions[0][bit] = 1u << (sobolBits - 1 - bit);
+		}
+		for (int d = 1; d < 3; d++) {
+			const Polynomial &p = polynomials[d - 1];
+			quint32 *v = directions[d];
+			for (int bit = 0; bit < sobolBits; bit++) {
+				if (bit < p.degree) {
+					v[bit] = p.initial[bit] << (sobolBits - 1 - bit);
+					continue;
+				}
+				v[bit] = v[bit - p.degree] ^ (v[bit - p.degree] >> p.degree);
+				for (int k = 1; k < p.degree; k++) {
+					if ((p.coefficients >> (p.degree - 1 - k)) & 1)
+						v[bit] ^= v[bit - k];
+				}
+			}
+		}
+
+		std::uniform_int_distribution<quint32> shiftDistribution;
+		for (int d = 0; d < 3; d++) {
+			sobolShift[d] = shiftDistribution(generator);
+			sobolPoint[d] = 0;
+		}
+		sobolIndex = 0;
+	}
+
+	// Gray-code order: each point differs from the previous one by the
+	// direction number of the lowest zero bit of the index.
+	Vec3D nextSobol() {
+		double coordinates[3];
+		for (int d = 0; d < 3; d++) {
+			coordinates[d] =
+				(double)(sobolPoint[d] ^ sobolShift[d]) / 4294967296.0;
+		}
+
+		int bit = 0;
+		while ((sobolIndex >> bit) & 1)
+			bit++;
+		if (bit >= sobolBits)
+			throw(QString("Sobol sequence exhausted"));
+		for (int d = 0; d < 3; d++) {
+			sobolPoint[d] ^= directions[d][bit];
+		}
+		sobolIndex++;
+
+		const double size = boxMaximum - boxMinimum;
+		return Vec3D(boxMinimum + coordinates[0] * size,
+					 boxMinimum + coordinates[1] * size,
+					 boxMinimum + coordinates[2] * size);
+	}
+
+	// Cells are small enough to hold at most one accepted center, so a dart
+	// only needs to look at the 5x5x5 cells around its own.
+	void initializePoissonDisk(double minimumSpacing) {
+		spacingSquared = minimumSpacing * minimumSpacing;
+		cellSize = minimumSpacing / std::sqrt(3.0);
+		cellsPerAxis =
+			std::max(1, (int)std::ceil((boxMaximum - boxMinimum) / cellSize));
+		if ((double)cellsPerAxis * cellsPerAxis * cellsPerAxis > 1e8)
+			throw(QString("Poisson-disk spacing %1 is too small for the box")
+					  .arg(minimumSpacing));
+		cells.fill(-1, cellsPerAxis * cellsPerAxis * cellsPerAxis);
+	}
+
+	int cellCoordinate(double x) const {
+		return std::min(cellsPerAxis - 1,
+						std::max(0, (int)((x - boxMinimum) / cellSize)));
+	}
+
+	Vec3D nextPoissonDisk() {
+		for (;;) {
+			for (int attempt = 0; attempt < maximumDartAttempts; attempt++) {
+				const Vec3D dart = nextUniform();
+				if (fits(dart)) {
+					const int c[3] = {cellCoordinate(dart.x),
+									  cellCoordinate(dart.y),
+									  cellCoordinate(dart.z)};
+					cells[cellIndex(c[0], c[1], c[2])] = acceptedDarts.size();
+					acceptedDarts.push_back(dart);
+					return dart;
+				}
+			}
+
+			// The box is full: start a new layer
+			cells.fill(-1);
+			acceptedDarts.resize(0);
+		}
+	}
+
+	bool fits(const Vec3D &dart) const {
+		const int c[3] = {cellCoordinate(dart.x), cellCoordinate(dart.y),
+						  cellCoordinate(dart.z)};
+		for (int z = std::max(0, c[2] - 2);
+			 z <= std::min(cellsPerAxis - 1, c[2] + 2); z++) {
+			for (int y = std::max(0, c[1] - 2);
+				 y <= std::min(cellsPerAxis - 1, c[1] + 2); y++) {
+				for (int x = std::max(0, c[0] - 2);
+					 x <= std::min(cellsPerAxis - 1, c[0] + 2); x++) {
+					const int other = cells[cellIndex(x, y, z)];
+					if (other >= 0 &&
+						Vec3D::distanceSquared(dart, acceptedDarts[other]) <
+							spacingSquared)
+						return false;
+				}
+			}
+		}
+		return true;
+	}
+
+	int cellIndex(int x, int y, int z) const {
+		return (z * cellsPerAxis + y) * cellsPerAxis + x;
+	}
+
+	static const int maximumDartAttempts = 1000;
+
+	const CenterSequence sequence;
+	const double boxMinimum;
+	const double boxMaximum;
+	std::default_random_engine generator;
+	std::uniform_real_distribution<double> distribution;
+
+	// Sobol state
+	quint32 directions[3][sobolBits];
+	quint32 sobolShift[3];
+	quint32 sobolPoint[3];
+	quint32 sobolIndex = 0;
+
+	// Poisson-disk state: index of the accepted dart in each cell, or -1
+	double spacingSquared = 0.0;
+	double cellSize = 1.0;
+	int cellsPerAxis = 1;
+	QVector<int> cells;
+	QVector<Vec3D> acceptedDarts;
+};
+
+} // end namespace Sampler
+
+#endif // _CENTER_GENERATOR_H_
@@ -0,0 +1,357 @@
+/*
+Copyright 2021 Michael Georgoulopoulos
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files(the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and / or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions :
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+/*
+The sphere test on several 3D models of the same genes. Random-set null
+distributions depend on the features of the genes and on the set size, never
+on positions, so one set of null tables serves the spheres of every model.
+Each model gets its own spheres, p-values and fields; a gene's stability is
+the fraction of models in which it ends up in a field.
+
+Models come from the Loci table (model "Loci") and from the optional LociModels
+table, with columns Model, Gene, x, y, z, holding alternative coordinates of
+the same genes.
+
+Spheres are placed as in the program (center sequence, coverage stopping) and
+tested by Monte Carlo against nested null tables, with fitted tails when the
+program fits them. Switches that replace random spheres or Monte Carlo
+p-values have no counterpart here and are rejected at compile time.
+*/
+
+#ifndef _COORDINATE_MODELS_H_
+#define _COORDINATE_MODELS_H_
+
+#include <QElapsedTimer>
+#include <QHash>
+#include <QSqlDatabase>
+#include <QSqlError>
+#include <QSqlQuery>
+#include <QString>
+#include <QVariant>
+#include <QVector>
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+
+#include "GenePool.h"
+#include "GeneSet.h"
+#include "SaveClustersToDB.h"
+#include "SphereTest.h"
+#include "Vec3D.h"
+
+#ifdef COORDINATE_MODELS
+#if defined(NEAREST_GENE_BALLS) || defined(REGION_GROWING) ||                 \
+	defined(LINEAR_WINDOWS) || defined(SPHERE_SEARCH) ||                      \
+	defined(SCAN_STATISTIC) || defined(NULL_SKETCHES) ||                      \
+	defined(Z_SCORE_SCREENING)
+#error "COORDINATE_MODELS tests random spheres by Monte Carlo. Undefine \
+NEAREST_GENE_BALLS, REGION_GROWING, LINEAR_WINDOWS, SPHERE_SEARCH, \
+SCAN_STATISTIC, NULL_SKETCHES and Z_SCORE_SCREENING."
+#endif
+#endif
+
+namespace CoordinateModels {
+
+struct Model {
+	QString name;
+
+	// Position of every gene of the pool, in pool order
+	QVector<Vec3D> positions;
+};
+
+// Model names become parts of table names
+inline bool isValidName(const QString &name) {
+	const QByteArray bytes = name.toUtf8();
+	if (bytes.size() == 0)
+		return false;
+	for (int i = 0; i < bytes.size(); i++) {
+		const char c = bytes.constData()[i];
+		if (!isalnum((unsigned char)c) && c != '_')
+			return false;
+	}
+	return true;
+}
+
+// The pool's own positions, followed by every model of the LociModels table
+// if the database has one. Each model must place every gene of the pool
+// exactly once. The name "Loci" is taken by the pool's own positions.
+template <class Gene>
+QVector<Model> load(QSqlDatabase &db, const GenePool<Gene> &pool) {
+	QVector<Model> result;
+	Model loci;
+	loci.name = "Loci";
+	loci.positions = pool.positions;
+	result.push_back(loci);
+	if (!db.tables().contains("LociModels"))
+		return result;
+
+	QHash<QString, int> geneIds;
+	for (int i = 0; i < pool.size(); i++) {
+		geneIds.insert(pool.names[i], i);
+	}
+
+	const QString sql =
+		"SELECT Model, Gene, x, y, z FROM LociModels ORDER BY Model";
+	QSqlQuery query(sql, db);
+	// Distinct genes placed by each model, and which genes the current model
+	// has placed so far
+	QVector<int> placedGenes;
+	QVector<char> placed;
+	while (query.next()) {
+		const QString name = query.value(0).toString();
+		if (result.size() == 1 || result.back().name != name) {
+			if (!isValidName(name))
+				throw(QString("Invalid coordinate model name: %1").arg(name));
+			if (name == loci.name)
+				throw(QString("Coordinate model name %1 is reserved for the "
+							  "Loci table")
+						  .arg(name));
+			Model model;
+			model.name = name;
+			model.positions.resize(pool.size());
+			result.push_back(model);
+			placedGenes.push_back(0);
+			placed.fill(0, pool.size());
+		}
+
+		const int id = geneIds.value(query.value(1).toString(), -1);
+		if (id < 0)
+			continue;
+		if (placed[id])
+			throw(QString("Coordinate model %1 places gene %2 more than once")
+					  .arg(name)
+					  .arg(query.value(1).toString()));
+		placed[id] = 1;
+		result.back().positions[id] = Vec3D(query.value(2).toDouble(),
+											query.value(3).toDouble(),
+											query.value(4).toDouble());
+		placedGenes.back()++;
+	}
+
+	if (query.lastError().type() != QSqlError::NoError)
+		throw(QString("Failed to process query: %1\nDBTEXT: %2")
+				  .arg(sql)
+				  .arg(query.lastError().databaseText()));
+
+	for (int m = 0; m < placedGenes.size(); m++) {
+		if (placedGenes[m] != pool.size())
+			throw(QString("Coordinate model %1 places %2 of %3 genes")
+					  .arg(result[m + 1].name)
+					  .arg(placedGenes[m])
+					  .arg(pool.size()));
+	}
+
+	return result;
+}
+
+struct Options {
+	double sphereRadius = 15.0;
+	int sampleCount = 10000;
+	double pAdjThreshold = 0.05;
+	double overlapThreshold = 0.05;
+
+	// Random sets per gene count, and whether their tails are fitted
+	int nullSampleCount = 10000;
+	bool fitTails = false;
+};
+
+struct ModelFields {
+	QString model;
+	int sphereCount = 0;
+	int significantCount = 0;
+
+	// Disjoint, ordered by size
+	QVector<GeneSet> fields;
+};
+
+struct Result {
+	QVector<ModelFields> models;
+
+	// Per gene: fraction of models in which it is in a field
+	QVector<double> stability;
+
+	void print() const {
+		for (const ModelFields &model : models) {
+			printf("Model %s: %d spheres, %d significant, %d fields:",
+				   model.model.toUtf8().data(), model.sphereCount,
+				   model.significantCount, model.fields.size());
+			for (const GeneSet &field : model.fields) {
+				printf(" %d", field.count());
+			}
+			printf("\n");
+		}
+
+		// Genes by the number of models placing them in a field
+		const int modelCount = models.size();
+		QVector<int> histogram(modelCount + 1, 0);
+		for (const double s : stability) {
+			histogram[(int)std::round(s * modelCount)]++;
+		}
+		printf("Genes in a field in k of %d models:\n", modelCount);
+		for (int k = 0; k <= modelCount; k++) {
+			printf("\tk=%d: %d genes\n", k, histogram[k]);
+		}
+	}
+};
+
+// All work units of several runs in one, for sizing shared null tables
+inline WorkUnits mergeWorkUnits(const QVector<WorkUnits> &runs) {
+	WorkUnits result;
+	for (const WorkUnits &run : runs) {
+		for (WorkUnit workUnit : run.units) {
+			workUnit.firstGene += result.arena.size();
+			result.units.push_back(workUnit);
+		}
+		result.arena += run.arena;
+	}
+	return result;
+}
+
+// Runs the sphere test on every model. Null tables are built once, for all
+// gene counts found in the spheres of any model.
+template <class Accumulator, class Gene>
+Result sphereTest(const GenePool<Gene> &pool, const QVector<Model> &models,
+				  const Options &options) {
+	QVector<WorkUnits> runs;
+	for (const Model &model : models) {
+		GenePool<Gene> modelPool = pool;
+		modelPool.positions = model.positions;
+		int averageGenesInASphere = 0;
+		runs.push_back(createSphereWorkUnits(options.sphereRadius, modelPool,
+											 options.sampleCount,
+											 &averageGenesInASphere));
+	}
+
+	NullTables nullTables = buildNestedNullTables<Accumulator>(
+		pool, mergeWorkUnits(runs), options.nullSampleCount);
+	if (options.fitTails)
+		nullTables.fitTails();
+
+	Result result;
+	result.stability.fill(0.0, pool.size());
+	for (int m = 0; m < models.size(); m++) {
+		WorkUnits &workUnits = runs[m];
+		calculateStatisticsInSpheres(pool, workUnits);
+		calculatePValues<Gene>(workUnits, nullTables);
+		const QVector<int> order = benjamini(workUnits);
+		const QVector<int> significant =
+			filterByAdjustedPValue(workUnits, order, options.pAdjThreshold);
+
+		ModelFields modelFields;
+		modelFields.model = models[m].name;
+		modelFields.sphereCount = workUnits.size();
+		modelFields.significantCount = significant.size();
+		modelFields.fields = disjointFields(workUnits, significant, pool.size(),
+											options.overlapThreshold);
+
+		for (const GeneSet &field : modelFields.fields) {
+			for (const GeneIndex id : field.ids()) {
+				result.stability[id] += 1.0 / (double)models.size();
+			}
+		}
+		result.models.push_back(modelFields);
+	}
+
+	return result;
+}
+
+// Fields of each model go to <tableName>_<model>, stability to
+// <tableName>Stability
+inline void write(QSqlDatabase &db, const Result &result,
+				  const QVector<QString> &names, const QString &tableName) {
+	for (const ModelFields &model : result.models) {
+		if (!model.fields.isEmpty())
+			db::writeClusters(model.fields, names, db,
+							  QString("%1_%2").arg(tableName).arg(model.model));
+	}
+
+	const QString stabilityTable = QString("%1Stability").arg(tableName);
+	const QString sqlDrop =
+		QString("DROP TABLE IF EXISTS %1").arg(stabilityTable);
+	QSqlQuery queryDrop(db);
+	if (!queryDrop.exec(sqlDrop))
+		throw QString("Failed to exec query: %1").arg(sqlDrop);
+
+	const QString sqlCreate =
+		QString("CREATE TABLE %1 (Gene TEXT PRIMARY KEY, Stability REAL)")
+			.arg(stabilityTable);
+	QSqlQuery queryCreate(db);
+	if (!queryCreate.exec(sqlCreate))
+		throw QString("Failed to exec query: %1").arg(sqlCreate);
+
+	const QString sqlInsert =
+		QString("INSERT INTO %1 (Gene, Stability) VALUES (:Gene, :Stability)")
+			.arg(stabilityTable);
+	QSqlQuery queryInsert(db);
+	if (!queryInsert.prepare(sqlInsert))
+		throw QString("Failed to create query: %1").arg(sqlInsert);
+	db.transaction();
+	for (int i = 0; i < names.size(); i++) {
+		queryInsert.bindValue(":Gene", names[i]);
+		queryInsert.bindValue(":Stability", result.stability[i]);
+		if (!queryInsert.exec())
+			throw QString("Failed to exec query: %1").arg(sqlInsert);
+	}
+	db.commit();
+}
+
+#ifdef COORDINATE_MODELS
+// The COORDINATE_MODELS mode of a sphere program: runs the sphere test on
+// every coordinate model and writes the fields of each, together with how
+// stable every gene's field membership is across models. Settings are the
+// program's own, like the gene box of SphereTest.h; programs with smaller
+// null tables pass their size.
+template <class Accumulator, class Gene>
+void extractFields(QSqlDatabase &db, const GenePool<Gene> &genes,
+				   int nullSampleCount = sampleCount) {
+	printf("Description of measured statistic:\n\t%s\n", statisticDescription);
+	printf("%d genes\n", genes.size());
+
+	const QVector<Model> models = load(db, genes);
+	printf("%d coordinate models\n", models.size());
+
+	QElapsedTimer timer;
+	timer.start();
+
+	Options options;
+	options.sphereRadius = sphereRadius;
+	options.sampleCount = sampleCount;
+	options.pAdjThreshold = pAdjThreshold;
+	options.overlapThreshold = overlapThreshold;
+	options.nullSampleCount = nullSampleCount;
+#ifdef TAIL_FIT_P_VALUES
+	options.fitTails = true;
+#endif
+	const Result result = sphereTest<Accumulator>(genes, models, options);
+	result.print();
+
+	printf("Writing fields and stability to database ... ");
+	write(db, result, genes.names, tableName);
+	printf("Done.\n");
+
+	printf("\nElapsed time: %.02f minutes.\n", timer.elapsed() / 60000.0);
+}
+#endif
+
+} // namespace CoordinateModels
+
+#endif // _COORDINATE_MODELS_H_
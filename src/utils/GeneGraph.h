@@ -0,0 +1,103 @@
+/*
+Copyright 2021 Michael Georgoulopoulos
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files(the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and / or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions :
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+/*
+GeneGraph is a sparse neighbour graph over gene positions: every gene is
+linked to its k nearest genes, and links are made symmetric, so a gene may
+end up with more than k neighbours. Neighbour lists are stored back to back
+(compressed sparse rows) and found with a SpatialGrid, so building the graph
+takes time roughly linear in the number of genes.
+*/
+
+#ifndef _GENE_GRAPH_H_
+#define _GENE_GRAPH_H_
+
+#include <QVector>
+
+#include <algorithm>
+
+#include "GenePool.h"
+#include "SpatialGrid.h"
+#include "Vec3D.h"
+
+struct GeneGraph {
+	// Neighbours of gene i are neighbours[offsets[i]] ..
+	// neighbours[offsets[i + 1] - 1], in ascending order
+	QVector<int> offsets;
+	QVector<GeneIndex> neighbours;
+
+	int size() const { return offsets.size() - 1; }
+
+	const GeneIndex *neighboursBegin(int gene) const {
+		return neighbours.constData() + offsets[gene];
+	}
+	const GeneIndex *neighboursEnd(int gene) const {
+		return neighbours.constData() + offsets[gene + 1];
+	}
+	int degree(int gene) const { return offsets[gene + 1] - offsets[gene]; }
+};
+
+// Builds the symmetric k-nearest-neighbour graph of the positions. The grid
+// cell size should be close to the distance of the k-th neighbour.
+inline GeneGraph nearestNeighbourGraph(const QVector<Vec3D> &positions, int k,
+									   double cellSize) {
+	const int count = positions.size();
+	const SpatialGrid grid(positions, cellSize);
+
+	QVector<QVector<GeneIndex>> nearestOfGene(count);
+	QVector<GeneIndex> *nearestLists = nearestOfGene.data();
+	QVector<int> nearest;
+#pragma omp parallel for schedule(dynamic, 64) private(nearest)
+	for (int i = 0; i < count; i++) {
+		// The gene itself is its own nearest neighbour
+		grid.nearest(positions[i], k + 1, cellSize, &nearest);
+		for (int n : nearest) {
+			if (n != i)
+				nearestLists[i].push_back((GeneIndex)n);
+		}
+	}
+
+	// Links both ways round, duplicates removed below
+	QVector<QVector<GeneIndex>> links(count);
+	for (int i = 0; i < count; i++) {
+		for (GeneIndex n : nearestOfGene[i]) {
+			links[i].push_back(n);
+			links[n].push_back((GeneIndex)i);
+		}
+	}
+
+	GeneGraph result;
+	result.offsets.resize(count + 1);
+	result.offsets[0] = 0;
+	for (int i = 0; i < count; i++) {
+		std::sort(links[i].begin(), links[i].end());
+		links[i].erase(std::unique(links[i].begin(), links[i].end()),
+					   links[i].end());
+		result.offsets[i + 1] = result.offsets[i] + links[i].size();
+	}
+	result.neighbours.reserve(result.offsets[count]);
+	for (const QVector<GeneIndex> &list : links) {
+		result.neighbours += list;
+	}
+	return result;
+}
+
+#endif // _GENE_GRAPH_H_
@@ -0,0 +1,75 @@
+/*
+Copyright 2021 Michael Georgoulopoulos
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files(the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and / or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions :
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+/*
+This module defines GenePool, the container every sphere program keeps its
+genes in. Genes are referred to by dense integer IDs (their index in the pool).
+Data is split by how often it is touched: positions are read by sphere sampling,
+the program-specific Gene records are read by the test statistic, and names are
+only consulted when writing output. Keeping names out of the hot arrays means
+the sampling and statistic loops never touch a QString.
+*/
+
+#ifndef _GENE_POOL_H_
+#define _GENE_POOL_H_
+
+#include <QString>
+#include <QVector>
+
+#include <limits>
+
+#include "Vec3D.h"
+
+// Gene ID, i.e. index of a gene in its GenePool. 16 bits are plenty for the
+// ~6000 genes of yeast and keep sphere membership lists small.
+using GeneIndex = quint16;
+
+template <class Gene> struct GenePool {
+	// Hot data. Gene holds whatever the test statistic needs.
+	QVector<Gene> genes;
+	QVector<Vec3D> positions;
+
+	// Cold data, for output only.
+	QVector<QString> names;
+
+	int size() const { return genes.size(); }
+	bool isEmpty() const { return genes.isEmpty(); }
+
+	void add(const QString &name, const Vec3D &position, const Gene &gene) {
+		if (genes.size() > (int)std::numeric_limits<GeneIndex>::max())
+			throw(QString("Too many genes for the GeneIndex type: %1")
+					  .arg(name));
+		names.push_back(name);
+		positions.push_back(position);
+		genes.push_back(gene);
+	}
+
+	// All IDs of the pool, in order.
+	QVector<GeneIndex> allIds() const {
+		QVector<GeneIndex> result(genes.size());
+		for (int i = 0; i < result.size(); i++) {
+			result[i] = (GeneIndex)i;
+		}
+		return result;
+	}
+};
+
+#endif // _GENE_POOL_H_
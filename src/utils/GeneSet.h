@@ -0,0 +1,130 @@
+/*
+Copyright 2021 Michael Georgoulopoulos
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files(the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and / or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions :
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+/*
+GeneSet is a set of gene IDs stored as a bitset, one bit per gene of the pool.
+Sphere post-processing (significant genes, overlap clustering, duplicate
+removal) is all unions, intersections and differences of gene sets; on bitsets
+these are a few hundred word operations each, instead of hashing gene names.
+*/
+
+#ifndef _GENE_SET_H_
+#define _GENE_SET_H_
+
+#include <QVector>
+#include <QtAlgorithms>
+
+#include "GenePool.h"
+
+class GeneSet {
+  public:
+	GeneSet() {}
+	GeneSet(int poolSize) : words((poolSize + 63) / 64, 0) {}
+
+	void insert(GeneIndex id) { words[id >> 6] |= bit(id); }
+
+	void insert(const GeneIndex *begin, const GeneIndex *end) {
+		quint64 *w = words.data();
+		for (const GeneIndex *id = begin; id != end; id++) {
+			w[*id >> 6] |= bit(*id);
+		}
+	}
+
+	bool contains(GeneIndex id) const {
+		return (words.constData()[id >> 6] & bit(id)) != 0;
+	}
+
+	// Number of genes in the set
+	int count() const {
+		int result = 0;
+		for (const quint64 word : words) {
+			result += qPopulationCount(word);
+		}
+		return result;
+	}
+
+	bool isEmpty() const {
+		for (const quint64 word : words) {
+			if (word != 0)
+				return false;
+		}
+		return true;
+	}
+
+	// Size of the intersection, without building it
+	int intersectionCount(const GeneSet &other) const {
+		const quint64 *a = words.constData();
+		const quint64 *b = other.words.constData();
+		int result = 0;
+		for (int i = 0; i < words.size(); i++) {
+			result += qPopulationCount(a[i] & b[i]);
+		}
+		return result;
+	}
+
+	GeneSet &unite(const GeneSet &other) {
+		quint64 *a = words.data();
+		const quint64 *b = other.words.constData();
+		for (int i = 0; i < words.size(); i++) {
+			a[i] |= b[i];
+		}
+		return *this;
+	}
+
+	GeneSet &subtract(const GeneSet &other) {
+		quint64 *a = words.data();
+		const quint64 *b = other.words.constData();
+		for (int i = 0; i < words.size(); i++) {
+			a[i] &= ~b[i];
+		}
+		return *this;
+	}
+
+	GeneSet &intersect(const GeneSet &other) {
+		quint64 *a = words.data();
+		const quint64 *b = other.words.constData();
+		for (int i = 0; i < words.size(); i++) {
+			a[i] &= b[i];
+		}
+		return *this;
+	}
+
+	// IDs of the genes in the set, in ascending order
+	QVector<GeneIndex> ids() const {
+		QVector<GeneIndex> result;
+		for (int i = 0; i < words.size(); i++) {
+			quint64 word = words[i];
+			while (word != 0) {
+				const int lowest = qCountTrailingZeroBits(word);
+				result.push_back((GeneIndex)(i * 64 + lowest));
+				word &= word - 1;
+			}
+		}
+		return result;
+	}
+
+  private:
+	static quint64 bit(GeneIndex id) { return (quint64)1 << (id & 63); }
+
+	QVector<quint64> words;
+};
+
+#endif // _GENE_SET_H_
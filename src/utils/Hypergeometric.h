@@ -0,0 +1,76 @@
+/*
+Copyright 2021 Michael Georgoulopoulos
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files(the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and / or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions :
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+/*
+Hypergeometric tail probabilities for gene set enrichment. Of N genes, K carry
+a property; a set of n genes has k of them. How likely is k or more, if the set
+were drawn at random? Log-factorials up to N are tabulated once, so each test
+is a short sum over the tail and many tests are cheap.
+*/
+
+#ifndef _HYPERGEOMETRIC_H_
+#define _HYPERGEOMETRIC_H_
+
+#include <QVector>
+
+#include <algorithm>
+#include <cmath>
+
+class Hypergeometric {
+  public:
+	Hypergeometric(int populationSize) : logFactorials(populationSize + 1) {
+		logFactorials[0] = 0.0;
+		for (int i = 1; i <= populationSize; i++) {
+			logFactorials[i] = logFactorials[i - 1] + log((double)i);
+		}
+	}
+
+	int populationSize() const { return logFactorials.size() - 1; }
+
+	// Probability of exactly k successes in n draws, with K successes in the
+	// population
+	double probability(int k, int K, int n) const {
+		const int N = populationSize();
+		if (k < std::max(0, n + K - N) || k > std::min(K, n))
+			return 0.0;
+		return exp(logChoose(K, k) + logChoose(N - K, n - k) - logChoose(N, n));
+	}
+
+	// Probability of k or more successes
+	double upperTail(int k, int K, int n) const {
+		const int N = populationSize();
+		k = std::max(k, std::max(0, n + K - N));
+		double result = 0.0;
+		for (int i = k; i <= std::min(K, n); i++) {
+			result += probability(i, K, n);
+		}
+		return std::min(1.0, result);
+	}
+
+  private:
+	double logChoose(int n, int k) const {
+		return logFactorials[n] - logFactorials[k] - logFactorials[n - k];
+	}
+
+	QVector<double> logFactorials;
+};
+
+#endif // _HYPERGEOMETRIC_H_
@@ -84,13 +84,19 @@ struct PackedCoex {
 		fclose(fp);
 	}
 
-	unsigned char lookup(int gene1, int gene2) {
-		return coex[gene1 * genes.size() + gene2];
+	unsigned char lookup(int gene1, int gene2) const {
+		return coex.constData()[gene1 * genes.size() + gene2];
 	}
 
-	unsigned char lookup(const QString &gene1, const QString &gene2) {
-		int i = geneToIndex[gene1];
-		int j = geneToIndex[gene2];
+	// Row of the square table for one gene. Indexing the row by the other
+	// gene's index gives their score, same as lookup().
+	const unsigned char *row(int gene) const {
+		return coex.constData() + gene * genes.size();
+	}
+
+	unsigned char lookup(const QString &gene1, const QString &gene2) const {
+		int i = geneToIndex.value(gene1);
+		int j = geneToIndex.value(gene2);
 		return lookup(i, j);
 	}
 
@@ -0,0 +1,325 @@
+/*
+Copyright 2021 Michael Georgoulopoulos
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files(the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and / or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions :
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+/*
+Principal component analysis of a small, dense feature space, such as the 9
+promoter histone marks. The marks are strongly correlated, so a few components
+carry most of the variance. Projecting genes onto the leading components
+rotates the space and drops the rest: Euclidean distances become slightly
+smaller, and distance kernels run on 3-4 dimensions instead of 9.
+
+The covariance matrix is diagonalized with the cyclic Jacobi method, which is
+simple and exact enough for matrices of this size.
+*/
+
+#ifndef _PRINCIPAL_COMPONENTS_H_
+#define _PRINCIPAL_COMPONENTS_H_
+
+#include <QVector>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <type_traits>
+
+// Eigenvalues and eigenvectors of a symmetric matrix, given row by row.
+// Eigenvalues come in decreasing order; eigenvector i is row i of vectors.
+inline void symmetricEigen(QVector<double> matrix, int dimension,
+						   QVector<double> *values, QVector<double> *vectors) {
+	const int d = dimension;
+	double *a = matrix.data();
+
+	// Accumulated rotations, starting from identity. Columns are the
+	// eigenvectors.
+	QVector<double> rotations(d * d, 0.0);
+	double *v = rotations.data();
+	for (int i = 0; i < d; i++) {
+		v[i * d + i] = 1.0;
+	}
+
+	for (int sweep = 0; sweep < 100; sweep++) {
+		double offDiagonal = 0.0;
+		double diagonal = 0.0;
+		for (int p = 0; p < d; p++) {
+			diagonal += a[p * d + p] * a[p * d + p];
+			for (int q = p + 1; q < d; q++) {
+				offDiagonal += a[p * d + q] * a[p * d + q];
+			}
+		}
+		if (offDiagonal <= 1e-30 * diagonal)
+			break;
+
+		for (int p = 0; p < d; p++) {
+			for (int q = p + 1; q < d; q++) {
+				const double apq = a[p * d + q];
+				if (apq == 0.0)
+					continue;
+
+				// Rotation which zeroes a[p][q]
+				const double theta = (a[q * d + q] - a[p * d + p]) / (2.0 * apq);
+				const double t = (theta >= 0.0 ? 1.0 : -1.0) /
+								 (std::abs(theta) + sqrt(theta * theta + 1.0));
+				const double c = 1.0 / sqrt(t * t + 1.0);
+				const double s = t * c;
+
+				for (int k = 0; k < d; k++) {
+					const double akp = a[k * d + p];
+					const double akq = a[k * d + q];
+					a[k * d + p] = c * akp - s * akq;
+					a[k * d + q] = s * akp + c * akq;
+				}
+				for (int k = 0; k < d; k++) {
+					const double apk = a[p * d + k];
+					const double aqk = a[q * d + k];
+					a[p * d + k] = c * apk - s * aqk;
+					a[q * d + k] = s * apk + c * aqk;
+				}
+				for (int k = 0; k < d; k++) {
+					const double vkp = v[k * d + p];
+					const double vkq = v[k * d + q];
+					v[k * d + p] = c * vkp - s * vkq;
+					v[k * d + q] = s * vkp + c * vkq;
+				}
+			}
+		}
+	}
+
+	QVector<int> order(d);
+	for (int i = 0; i < d; i++) {
+		order[i] = i;
+	}
+	std::sort(order.begin(), order.end(),
+			  [&](int i, int j) { return a[i * d + i] > a[j * d + j]; });
+
+	values->resize(d);
+	vectors->resize(d * d);
+	for (int i = 0; i < d; i++) {
+		(*values)[i] = a[order[i] * d + order[i]];
+		for (int k = 0; k < d; k++) {
+			(*vectors)[i * d + k] = v[k * d + order[i]];
+		}
+	}
+}
+
+class PrincipalComponents {
+  public:
+	// Data has one row of dimension values per sample
+	PrincipalComponents(const QVector<double> &data, int dimension)
+		: d(dimension), mean(dimension, 0.0) {
+		const int n = data.size() / d;
+		for (int s = 0; s < n; s++) {
+			for (int i = 0; i < d; i++) {
+				mean[i] += data[s * d + i];
+			}
+		}
+		for (int i = 0; i < d; i++) {
+			mean[i] /= (double)n;
+		}
+
+		QVector<double> covariance(d * d, 0.0);
+		for (int s = 0; s < n; s++) {
+			const double *x = data.constData() + s * d;
+			for (int i = 0; i < d; i++) {
+				for (int j = i; j < d; j++) {
+					covariance[i * d + j] += (x[i] - mean[i]) * (x[j] - mean[j]);
+				}
+			}
+		}
+		for (int i = 0; i < d; i++) {
+			for (int j = i; j < d; j++) {
+				covariance[i * d + j] /= (double)std::max(1, n - 1);
+				covariance[j * d + i] = covariance[i * d + j];
+			}
+		}
+
+		symmetricEigen(covariance, d, &variances, &components);
+		for (double &variance : variances) {
+			variance = std::max(0.0, variance);
+		}
+	}
+
+	int dimension() const { return d; }
+
+	// Fraction of the total variance in the first count components
+	double explainedVariance(int count) const {
+		double total = 0.0;
+		double explained = 0.0;
+		for (int i = 0; i < d; i++) {
+			total += variances[i];
+			if (i < count)
+				explained += variances[i];
+		}
+		return total > 0.0 ? explained / total : 1.0;
+	}
+
+	// Fewest components which explain the given fraction of variance
+	int componentCount(double fraction) const {
+		for (int count = 1; count < d; count++) {
+			if (explainedVariance(count) >= fraction)
+				return count;
+		}
+		return d;
+	}
+
+	// Coordinates of x on the first count components
+	template <typename T>
+	void project(const T *x, T *result, int count) const {
+		for (int c = 0; c < count; c++) {
+			const double *component = components.constData() + c * d;
+			double sum = 0.0;
+			for (int i = 0; i < d; i++) {
+				sum += component[i] * ((double)x[i] - mean[i]);
+			}
+			result[c] = (T)sum;
+		}
+	}
+
+	void print() const {
+		printf("Principal components:\n");
+		for (int c = 0; c < d; c++) {
+			printf("\t%d: variance %.4f, cumulative %.02f%%\n", c + 1,
+				   variances[c], explainedVariance(c + 1) * 100.0);
+		}
+	}
+
+  private:
+	int d;
+	QVector<double> mean;
+	QVector<double> variances;
+
+	// One row per component
+	QVector<double> components;
+};
+
+// How well distances between projected samples approximate the distances in
+// the original space. Projected distances are never larger.
+struct DistanceError {
+	double meanRelativeError = 0.0;
+	double maximumRelativeError = 0.0;
+
+	// Pearson correlation of original and projected distances
+	double correlation = 1.0;
+
+	void print() const {
+		printf("Distance approximation: mean relative error %.02f%%, maximum "
+			   "%.02f%%, correlation %.4f\n",
+			   meanRelativeError * 100.0, maximumRelativeError * 100.0,
+			   correlation);
+	}
+};
+
+// Compares distances over pairCount random pairs of samples
+inline DistanceError distanceError(const QVector<double> &data,
+								   const PrincipalComponents &pca, int count,
+								   int pairCount) {
+	const int d = pca.dimension();
+	const int n = data.size() / d;
+	DistanceError result;
+	if (n < 2)
+		return result;
+
+	std::mt19937 generator(1);
+	std::uniform_int_distribution<int> distribution(0, n - 1);
+	QVector<double> a(d);
+	QVector<double> b(d);
+	double sumX = 0.0, sumY = 0.0, sumXX = 0.0, sumYY = 0.0, sumXY = 0.0;
+	int measured = 0;
+	for (int p = 0; p < pairCount; p++) {
+		const int i = distribution(generator);
+		const int j = distribution(generator);
+		const double *x = data.constData() + i * d;
+		const double *y = data.constData() + j * d;
+
+		double original = 0.0;
+		for (int k = 0; k < d; k++) {
+			original += (x[k] - y[k]) * (x[k] - y[k]);
+		}
+		original = sqrt(original);
+		if (original <= 0.0)
+			continue;
+
+		pca.project(x, a.data(), count);
+		pca.project(y, b.data(), count);
+		double projected = 0.0;
+		for (int k = 0; k < count; k++) {
+			projected += (a[k] - b[k]) * (a[k] - b[k]);
+		}
+		projected = sqrt(projected);
+
+		const double relativeError = (original - projected) / original;
+		result.meanRelativeError += relativeError;
+		result.maximumRelativeError =
+			std::max(result.maximumRelativeError, relativeError);
+		sumX += original;
+		sumY += projected;
+		sumXX += original * original;
+		sumYY += projected * projected;
+		sumXY += original * projected;
+		measured++;
+	}
+	if (measured == 0)
+		return result;
+
+	result.meanRelativeError /= (double)measured;
+	const double covariance = sumXY - sumX * sumY / measured;
+	const double varianceX = sumXX - sumX * sumX / measured;
+	const double varianceY = sumYY - sumY * sumY / measured;
+	if (varianceX > 0.0 && varianceY > 0.0)
+		result.correlation = covariance / sqrt(varianceX * varianceY);
+	return result;
+}
+
+// Replaces the dimension features of every sample by its coordinates on the
+// leading principal components, as many as explain fraction of the variance.
+// featuresOf(sample) gives a sample's features, double or float; those past
+// the kept components become zero. Prints the components and how well
+// distances survive, and returns the number of components kept.
+template <class Samples, class FeaturesOf>
+int reduceToPrincipalComponents(Samples &samples, int dimension,
+								double fraction, FeaturesOf featuresOf) {
+	QVector<double> data;
+	data.reserve(samples.size() * dimension);
+	for (auto &sample : samples) {
+		const auto *features = featuresOf(sample);
+		for (int i = 0; i < dimension; i++) {
+			data.push_back(features[i]);
+		}
+	}
+
+	const PrincipalComponents pca(data, dimension);
+	pca.print();
+	const int count = pca.componentCount(fraction);
+	printf("Keeping %d components (%.02f%% of variance)\n", count,
+		   pca.explainedVariance(count) * 100.0);
+	distanceError(data, pca, count, 100000).print();
+
+	for (auto &sample : samples) {
+		auto *features = featuresOf(sample);
+		using Element = typename std::remove_pointer<decltype(features)>::type;
+		QVector<Element> projected(dimension, (Element)0);
+		pca.project(features, projected.data(), count);
+		std::copy(projected.constBegin(), projected.constEnd(), features);
+	}
+	return count;
+}
+
+#endif // _PRINCIPAL_COMPONENTS_H_
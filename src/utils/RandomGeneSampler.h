@@ -20,9 +20,8 @@ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 */
 
 /*
-Random gene sampler. Template similar to SphereGeneSampler. Provided for
-symmetry. Returns fully random Gene sets with replacement from the pool
-provided.
+Random gene sampler. Companion to SphereGeneSampler. Returns fully random gene
+ID sets with replacement from a pool of the size provided.
 */
 
 #ifndef _RANDOM_GENE_SAMPLER_H_
@@ -31,33 +30,36 @@ provided.
 #include <QVector>
 #include <random>
 
+#include "GenePool.h"
+
 namespace Sampler {
 
-template <class Gene> class RandomGeneSampler {
+class RandomGeneSampler {
   public:
 	RandomGeneSampler() {}
-	RandomGeneSampler(const QVector<Gene> &pool)
-		: pool(&pool), generator(std::random_device()()),
-		  distribution(0, pool.size() - 1) {}
-	RandomGeneSampler(const RandomGeneSampler &other)
-		: pool(other.pool), generator(other.generator),
-		  distribution(other.distribution) {}
-
-	void sample(int count, QVector<const Gene *> *genes) const {
-		genes->resize(0);
+	RandomGeneSampler(int poolSize)
+		: poolSize(poolSize), generator(std::random_device()()),
+		  distribution(0, poolSize - 1) {}
 
-		if (pool->isEmpty())
+	// Fills the buffer with count random gene IDs. The buffer is reused, so
+	// sampling repeatedly with the same count does not allocate.
+	void sample(int count, QVector<GeneIndex> *genes) const {
+		if (poolSize <= 0) {
+			genes->resize(0);
 			return;
+		}
 
+		genes->resize(count);
+		GeneIndex *ids = genes->data();
 		for (int i = 0; i < count; i++) {
-			genes->push_back(&(*pool)[distribution(generator)]);
+			ids[i] = (GeneIndex)distribution(generator);
 		}
 	}
 
 	int random() const { return distribution(generator); }
 
   private:
-	const QVector<Gene> *pool = nullptr;
+	int poolSize = 0;
 	mutable std::default_random_engine generator;
 	mutable std::uniform_int_distribution<int> distribution;
 };
@@ -0,0 +1,204 @@
+/*
+Copyright 2021 Michael Georgoulopoulos
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files(the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and / or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions :
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+/*
+Region growing on the gene neighbour graph, as an alternative to sphere
+sampling. Spheres force every field into a ball, and fields only take their
+shape when overlapping balls are glued together. Here a region starts from a
+seed gene and grows along graph links, one neighbour at a time, taking the
+neighbour that makes the statistic most extreme. It stops once it has at least
+minimumGeneCount genes and no neighbour improves it, or at maximumGeneCount.
+
+Regions of different sizes are compared by z-score, from geneCountMoments().
+Seeds are taken in order of how extreme their own neighbourhood is, and a gene
+belongs to at most one region, so the regions partition the genes they cover
+and the work is roughly linear in the number of genes.
+
+The regions come out as work units, so the per-gene-count null tables, the
+Benjamini-Hochberg correction and clustering work on them as on spheres. Keep
+in mind that growth selects for extreme statistics, so their p-values are
+optimistic and best used for ranking.
+
+Accumulator is the one of the nested null tables. Growth evaluates a candidate
+on a copy of it, so copies should be cheap.
+*/
+
+#ifndef _REGION_GROWING_H_
+#define _REGION_GROWING_H_
+
+#include <QVector>
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include "GeneGraph.h"
+#include "GenePool.h"
+#include "SphereTest.h"
+
+namespace RegionGrowing {
+
+struct Options {
+	// Neighbours per gene in the graph, and a grid cell size close to the
+	// distance of the furthest of them
+	int neighbourCount = 8;
+	double cellSize = 5.0;
+
+	int minimumGeneCount = 50;
+	int maximumGeneCount = 300;
+
+	// Random sets per gene count for the z-scores
+	int momentSampleCount = 2000;
+};
+
+template <class Accumulator, class Gene>
+WorkUnits growRegions(const GenePool<Gene> &pool, const Options &options) {
+	const GeneGraph graph = nearestNeighbourGraph(
+		pool.positions, options.neighbourCount, options.cellSize);
+	const GeneCountMoments moments = geneCountMoments<Accumulator>(
+		pool, std::min(options.maximumGeneCount, pool.size()),
+		options.momentSampleCount);
+
+	const Gene *genes = pool.genes.constData();
+	const bool lower = lowerIsMoreExtreme<Gene>();
+	auto score = [&](const Accumulator &accumulator, int geneCount) {
+		const double z =
+			moments.zScore(geneCount, accumulator.statistic());
+		return lower ? -z : z;
+	};
+
+	// Seeds, most extreme neighbourhood first
+	QVector<double> seedScores(pool.size());
+	double *seedScore = seedScores.data();
+#pragma omp parallel for schedule(dynamic, 64)
+	for (int i = 0; i < pool.size(); i++) {
+		Accumulator accumulator;
+		accumulator.clear();
+		accumulator.add(genes, (GeneIndex)i);
+		for (const GeneIndex *n = graph.neighboursBegin(i);
+			 n != graph.neighboursEnd(i); n++) {
+			accumulator.add(genes, *n);
+		}
+		seedScore[i] = score(accumulator, graph.degree(i) + 1);
+	}
+	QVector<int> seeds(pool.size());
+	for (int i = 0; i < seeds.size(); i++) {
+		seeds[i] = i;
+	}
+	std::stable_sort(seeds.begin(), seeds.end(), [&](int a, int b) {
+		return seedScores[a] > seedScores[b];
+	});
+
+	WorkUnits result;
+	QVector<bool> claimed(pool.size(), false);
+
+	// Genes of the region being grown and of its frontier are marked with the
+	// number of the region, so marks never need clearing.
+	QVector<int> inRegion(pool.size(), -1);
+	QVector<int> inFrontier(pool.size(), -1);
+	QVector<GeneIndex> region;
+	QVector<GeneIndex> frontier;
+
+	for (int regionNumber = 0; regionNumber < seeds.size(); regionNumber++) {
+		const int seed = seeds[regionNumber];
+		if (claimed[seed])
+			continue;
+
+		Accumulator accumulator;
+		accumulator.clear();
+		region.resize(0);
+		frontier.resize(0);
+		auto addToRegion = [&](GeneIndex id) {
+			accumulator.add(genes, id);
+			region.push_back(id);
+			inRegion[id] = regionNumber;
+			for (const GeneIndex *n = graph.neighboursBegin(id);
+				 n != graph.neighboursEnd(id); n++) {
+				if (!claimed[*n] && inRegion[*n] != regionNumber &&
+					inFrontier[*n] != regionNumber) {
+					inFrontier[*n] = regionNumber;
+					frontier.push_back(*n);
+				}
+			}
+		};
+		addToRegion((GeneIndex)seed);
+		double currentScore = score(accumulator, 1);
+
+		while (region.size() < options.maximumGeneCount) {
+			// Best frontier gene
+			int bestSlot = -1;
+			double bestScore = -std::numeric_limits<double>::infinity();
+			for (int f = 0; f < frontier.size(); f++) {
+				Accumulator candidate = accumulator;
+				candidate.add(genes, frontier[f]);
+				const double candidateScore =
+					score(candidate, region.size() + 1);
+				if (candidateScore > bestScore) {
+					bestScore = candidateScore;
+					bestSlot = f;
+				}
+			}
+			if (bestSlot < 0)
+				break;
+			if (region.size() >= options.minimumGeneCount &&
+				bestScore <= currentScore)
+				break;
+
+			const GeneIndex best = frontier[bestSlot];
+			frontier[bestSlot] = frontier.back();
+			frontier.pop_back();
+			addToRegion(best);
+			currentScore = bestScore;
+		}
+
+		for (GeneIndex id : region) {
+			claimed[id] = true;
+		}
+		if (region.size() < options.minimumGeneCount ||
+			!Gene::acceptSample(genes, region.constData(), region.size()))
+			continue;
+
+		// Regions are not spheres, but center and radius still say roughly
+		// where they are.
+		std::sort(region.begin(), region.end());
+		WorkUnit workUnit;
+		for (GeneIndex id : region) {
+			workUnit.center += pool.positions[id];
+		}
+		workUnit.center = workUnit.center / (double)region.size();
+		for (GeneIndex id : region) {
+			workUnit.radius = std::max(
+				workUnit.radius,
+				sqrt(Vec3D::distanceSquared(workUnit.center,
+											pool.positions[id])));
+		}
+		workUnit.firstGene = result.arena.size();
+		workUnit.geneCount = region.size();
+		result.arena += region;
+		result.units.push_back(workUnit);
+	}
+
+	return result;
+}
+
+} // namespace RegionGrowing
+
+#endif // _REGION_GROWING_H_
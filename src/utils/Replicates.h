@@ -0,0 +1,353 @@
+/*
+Copyright 2021 Michael Georgoulopoulos
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files(the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and / or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions :
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+/*
+Sphere sampling is random, so two runs of a sphere program may disagree on the
+number and shape of the fields. Replicates runs the whole sphere test several
+times at once, each replicate with its own sphere centers and random sets, and
+combines the runs into consensus fields.
+
+Two genes are co-assigned in a replicate when they end up in the same field.
+Consensus fields link genes co-assigned in at least a given fraction of the
+replicates. The co-assignment of a pair is counted from the per-replicate field
+labels when needed, so the gene x gene matrix is never stored. A gene's
+stability is its average co-assignment with the other genes of its consensus
+field.
+
+Each replicate places and tests its spheres like the program's own run does,
+under the same restrictions as CoordinateModels.h. The two modes do not
+compose: define at most one of them.
+*/
+
+#ifndef _REPLICATES_H_
+#define _REPLICATES_H_
+
+#include <QElapsedTimer>
+#include <QSqlDatabase>
+#include <QSqlQuery>
+#include <QString>
+#include <QVariant>
+#include <QVector>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <random>
+
+#include "GenePool.h"
+#include "GeneSet.h"
+#include "SaveClustersToDB.h"
+#include "SphereTest.h"
+
+#ifdef REPLICATES
+#ifdef COORDINATE_MODELS
+#error "Define either REPLICATES or COORDINATE_MODELS, not both."
+#endif
+#if defined(NEAREST_GENE_BALLS) || defined(REGION_GROWING) ||                 \
+	defined(LINEAR_WINDOWS) || defined(SPHERE_SEARCH) ||                      \
+	defined(SCAN_STATISTIC) || defined(NULL_SKETCHES) ||                      \
+	defined(Z_SCORE_SCREENING)
+#error "REPLICATES tests random spheres by Monte Carlo. Undefine \
+NEAREST_GENE_BALLS, REGION_GROWING, LINEAR_WINDOWS, SPHERE_SEARCH, \
+SCAN_STATISTIC, NULL_SKETCHES and Z_SCORE_SCREENING."
+#endif
+#endif
+
+namespace Replicates {
+
+struct Options {
+	double sphereRadius = 15.0;
+	int sampleCount = 10000;
+	double pAdjThreshold = 0.05;
+	double overlapThreshold = 0.05;
+
+	// Random sets per gene count, and whether their tails are fitted
+	int nullSampleCount = 10000;
+	bool fitTails = false;
+
+	int replicateCount = 10;
+
+	// Genes co-assigned in at least this fraction of the replicates are
+	// linked in the consensus
+	double consensusThreshold = 0.5;
+
+	// Smaller consensus fields are dropped
+	int minimumFieldSize = 50;
+};
+
+struct Result {
+	// Fields of every replicate, disjoint and ordered by size
+	QVector<QVector<GeneSet>> replicateFields;
+
+	// Consensus fields, ordered by size
+	QVector<GeneSet> consensusFields;
+
+	// Per gene: fraction of replicates in which it is in a field
+	QVector<double> fieldFraction;
+
+	// Per gene: average co-assignment with the rest of its consensus field,
+	// or 0 outside consensus fields
+	QVector<double> stability;
+
+	void print() const {
+		for (int r = 0; r < replicateFields.size(); r++) {
+			printf("Replicate %d: %d fields:", r + 1,
+				   replicateFields[r].size());
+			for (const GeneSet &field : replicateFields[r]) {
+				printf(" %d", field.count());
+			}
+			printf("\n");
+		}
+		printf("%d consensus fields:\n", consensusFields.size());
+		for (int i = 0; i < consensusFields.size(); i++) {
+			const QVector<GeneIndex> ids = consensusFields[i].ids();
+			double averageStability = 0.0;
+			for (const GeneIndex id : ids) {
+				averageStability += stability[id];
+			}
+			averageStability /= (double)ids.size();
+			printf("\tField %c: %d genes, stability %.3f\n", 'A' + i,
+				   ids.size(), averageStability);
+		}
+	}
+};
+
+// Disjoint-set forest over gene IDs
+struct DisjointSets {
+	QVector<int> parents;
+
+	DisjointSets(int size) : parents(size) {
+		for (int i = 0; i < size; i++) {
+			parents[i] = i;
+		}
+	}
+
+	int find(int i) {
+		while (parents[i] != i) {
+			parents[i] = parents[parents[i]];
+			i = parents[i];
+		}
+		return i;
+	}
+
+	void unite(int a, int b) { parents[find(a)] = find(b); }
+};
+
+// Runs the replicates concurrently, one per thread; the parallel loops inside
+// each replicate are nested and run on that thread alone. The pool is only
+// read.
+template <class Accumulator, class Gene>
+Result run(const GenePool<Gene> &pool, const Options &options) {
+	const int n = pool.size();
+	const int replicateCount = options.replicateCount;
+
+	Result result;
+	result.replicateFields.resize(replicateCount);
+	QVector<GeneSet> *replicateFields = result.replicateFields.data();
+#pragma omp parallel for schedule(dynamic, 1)
+	for (int r = 0; r < replicateCount; r++) {
+		int averageGenesInASphere = 0;
+		WorkUnits workUnits = createSphereWorkUnits(
+			options.sphereRadius, pool, options.sampleCount,
+			&averageGenesInASphere,
+			std::default_random_engine::default_seed + (unsigned)r);
+		NullTables nullTables = buildNestedNullTables<Accumulator>(
+			pool, workUnits, options.nullSampleCount);
+		if (options.fitTails)
+			nullTables.fitTails();
+		calculateStatisticsInSpheres(pool, workUnits);
+		calculatePValues<Gene>(workUnits, nullTables);
+		const QVector<int> order = benjamini(workUnits);
+		const QVector<int> significant =
+			filterByAdjustedPValue(workUnits, order, options.pAdjThreshold);
+		replicateFields[r] = disjointFields(workUnits, significant, n,
+											options.overlapThreshold);
+	}
+
+	// Field label of every gene in every replicate, gene by gene, -1 outside
+	// fields
+	QVector<int> labels(n * replicateCount, -1);
+	result.fieldFraction.fill(0.0, n);
+	for (int r = 0; r < replicateCount; r++) {
+		for (int f = 0; f < result.replicateFields[r].size(); f++) {
+			for (const GeneIndex id : result.replicateFields[r][f].ids()) {
+				labels[id * replicateCount + r] = f;
+				result.fieldFraction[id] += 1.0 / (double)replicateCount;
+			}
+		}
+	}
+	const int *label = labels.constData();
+	auto coAssignment = [&](int a, int b) {
+		const int *la = label + a * replicateCount;
+		const int *lb = label + b * replicateCount;
+		int count = 0;
+		for (int r = 0; r < replicateCount; r++) {
+			count += la[r] >= 0 && la[r] == lb[r];
+		}
+		return count;
+	};
+
+	// Only genes in enough fields can have enough co-assignments
+	const int linkCount = (int)std::ceil(options.consensusThreshold *
+										 (double)replicateCount - 1e-9);
+	QVector<int> candidates;
+	for (int i = 0; i < n; i++) {
+		if (result.fieldFraction[i] * replicateCount + 1e-9 >= linkCount)
+			candidates.push_back(i);
+	}
+
+	QVector<QVector<int>> links(candidates.size());
+	QVector<int> *link = links.data();
+#pragma omp parallel for schedule(dynamic, 16)
+	for (int a = 0; a < candidates.size(); a++) {
+		for (int b = a + 1; b < candidates.size(); b++) {
+			if (coAssignment(candidates[a], candidates[b]) >= linkCount)
+				link[a].push_back(b);
+		}
+	}
+	DisjointSets sets(candidates.size());
+	for (int a = 0; a < links.size(); a++) {
+		for (const int b : links[a]) {
+			sets.unite(a, b);
+		}
+	}
+
+	QVector<QVector<int>> members(candidates.size());
+	for (int a = 0; a < candidates.size(); a++) {
+		members[sets.find(a)].push_back(candidates[a]);
+	}
+	for (const QVector<int> &field : members) {
+		if (field.size() < options.minimumFieldSize)
+			continue;
+		GeneSet consensusField(n);
+		for (const int id : field) {
+			consensusField.insert((GeneIndex)id);
+		}
+		result.consensusFields.push_back(consensusField);
+	}
+	std::sort(result.consensusFields.begin(), result.consensusFields.end(),
+			  [](const GeneSet &a, const GeneSet &b) {
+				  return a.count() < b.count();
+			  });
+
+	result.stability.fill(0.0, n);
+	double *stability = result.stability.data();
+	for (const GeneSet &field : result.consensusFields) {
+		const QVector<GeneIndex> ids = field.ids();
+#pragma omp parallel for schedule(dynamic, 16)
+		for (int i = 0; i < ids.size(); i++) {
+			int total = 0;
+			for (int j = 0; j < ids.size(); j++) {
+				if (j != i)
+					total += coAssignment(ids[i], ids[j]);
+			}
+			stability[ids[i]] =
+				(double)total / ((double)replicateCount * (ids.size() - 1));
+		}
+	}
+
+	return result;
+}
+
+// Consensus fields go to <tableName>Consensus, per-gene scores to
+// <tableName>ConsensusStability
+inline void write(QSqlDatabase &db, const Result &result,
+				  const QVector<QString> &names, const QString &tableName) {
+	if (!result.consensusFields.isEmpty())
+		db::writeClusters(result.consensusFields, names, db,
+						  QString("%1Consensus").arg(tableName));
+
+	const QString stabilityTable =
+		QString("%1ConsensusStability").arg(tableName);
+	const QString sqlDrop =
+		QString("DROP TABLE IF EXISTS %1").arg(stabilityTable);
+	QSqlQuery queryDrop(db);
+	if (!queryDrop.exec(sqlDrop))
+		throw QString("Failed to exec query: %1").arg(sqlDrop);
+
+	const QString sqlCreate =
+		QString("CREATE TABLE %1 (Gene TEXT PRIMARY KEY, FieldFraction REAL, "
+				"Stability REAL)")
+			.arg(stabilityTable);
+	QSqlQuery queryCreate(db);
+	if (!queryCreate.exec(sqlCreate))
+		throw QString("Failed to exec query: %1").arg(sqlCreate);
+
+	const QString sqlInsert =
+		QString("INSERT INTO %1 (Gene, FieldFraction, Stability) VALUES "
+				"(:Gene, :FieldFraction, :Stability)")
+			.arg(stabilityTable);
+	QSqlQuery queryInsert(db);
+	if (!queryInsert.prepare(sqlInsert))
+		throw QString("Failed to create query: %1").arg(sqlInsert);
+	db.transaction();
+	for (int i = 0; i < names.size(); i++) {
+		queryInsert.bindValue(":Gene", names[i]);
+		queryInsert.bindValue(":FieldFraction", result.fieldFraction[i]);
+		queryInsert.bindValue(":Stability", result.stability[i]);
+		if (!queryInsert.exec())
+			throw QString("Failed to exec query: %1").arg(sqlInsert);
+	}
+	db.commit();
+}
+
+#ifdef REPLICATES
+// The REPLICATES mode of a sphere program: runs replicateCount replicates of
+// the sphere test concurrently and writes the consensus fields with per-gene
+// stability. Settings are the program's own, like the gene box of
+// SphereTest.h; programs with smaller null tables pass their size.
+template <class Accumulator, class Gene>
+void extractFields(QSqlDatabase &db, const GenePool<Gene> &genes,
+				   int nullSampleCount = sampleCount) {
+	printf("Description of measured statistic:\n\t%s\n", statisticDescription);
+	printf("%d genes\n", genes.size());
+
+	QElapsedTimer timer;
+	timer.start();
+
+	Options options;
+	options.sphereRadius = sphereRadius;
+	options.sampleCount = sampleCount;
+	options.pAdjThreshold = pAdjThreshold;
+	options.overlapThreshold = overlapThreshold;
+	options.nullSampleCount = nullSampleCount;
+#ifdef TAIL_FIT_P_VALUES
+	options.fitTails = true;
+#endif
+	options.replicateCount = replicateCount;
+	options.consensusThreshold = consensusThreshold;
+	options.minimumFieldSize = minimumGeneCount;
+	printf("Running %d replicates... ", replicateCount);
+	const Result result = run<Accumulator>(genes, options);
+	printf("Done.\n");
+	result.print();
+
+	printf("Writing consensus fields and stability to database ... ");
+	write(db, result, genes.names, tableName);
+	printf("Done.\n");
+
+	printf("\nElapsed time: %.02f minutes.\n", timer.elapsed() / 60000.0);
+}
+#endif
+
+} // namespace Replicates
+
+#endif // _REPLICATES_H_
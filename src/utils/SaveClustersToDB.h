@@ -42,6 +42,8 @@ provided.
 #include <QVariant>
 #include <QVector>
 
+#include "GeneSet.h"
+
 namespace db {
 
 void writeClusters(const QVector<QSet<QString>> &geneClusters, QSqlDatabase &db,
@@ -85,6 +87,22 @@ void writeClusters(const QVector<QSet<QString>> &geneClusters, QSqlDatabase &db,
 	}	  // end for (all clusters)
 }
 
+// Same as above, for clusters of gene IDs. Names are resolved here, right
+// before writing.
+void writeClusters(const QVector<GeneSet> &geneClusters,
+				   const QVector<QString> &names, QSqlDatabase &db,
+				   const QString &tableName) {
+	QVector<QSet<QString>> namedClusters;
+	for (const GeneSet &cluster : geneClusters) {
+		QSet<QString> genes;
+		for (const GeneIndex id : cluster.ids()) {
+			genes.insert(names[id]);
+		}
+		namedClusters.push_back(genes);
+	}
+	writeClusters(namedClusters, db, tableName);
+}
+
 } // end namespace db
 
 #endif // _SAVE_CLUSTERS_TO_DB_H_
@@ -0,0 +1,146 @@
+/*
+Copyright 2021 Michael Georgoulopoulos
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files(the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and / or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions :
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+/*
+Cost-aware scheduling of independent jobs over OpenMP threads. The sphere
+p-value loops have very uneven jobs: a sphere's cost grows with the square of
+its gene count, and gene counts vary a lot. With a static schedule the threads
+that happen to get the big spheres finish last while the others idle. Here
+jobs are sorted by estimated cost, largest first, and threads pull them one at
+a time from a shared atomic counter. Taking the biggest jobs first leaves the
+small ones to fill the gaps at the end (longest-processing-time-first).
+
+Only programs that still draw random sets for each sphere need this, which is
+PromoterSpheres. The others share null tables per gene count, whose jobs are
+of equal cost.
+*/
+
+#ifndef _SCHEDULER_H_
+#define _SCHEDULER_H_
+
+#include <QElapsedTimer>
+#include <QVector>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+namespace Scheduler {
+
+// What each thread did during a run
+struct Report {
+	double wallSeconds = 0.0;
+	QVector<double> busySeconds;
+	QVector<int> jobCounts;
+
+	// Total busy time over threads times wall time. 1.0 means no thread
+	// was ever idle.
+	double efficiency() const {
+		double busy = 0.0;
+		for (const double seconds : busySeconds) {
+			busy += seconds;
+		}
+		const double available = wallSeconds * (double)busySeconds.size();
+		return available > 0.0 ? busy / available : 1.0;
+	}
+
+	void print() const {
+		printf("Scheduling: %d threads, %.02f s wall time, %.01f%% "
+			   "efficiency\n",
+			   busySeconds.size(), wallSeconds, efficiency() * 100.0);
+		for (int t = 0; t < busySeconds.size(); t++) {
+			printf("\tThread %d: %d jobs, %.02f s busy\n", t, jobCounts[t],
+				   busySeconds[t]);
+		}
+	}
+};
+
+inline int threadCount() {
+#ifdef _OPENMP
+	return omp_get_max_threads();
+#else
+	return 1;
+#endif
+}
+
+inline int threadIndex() {
+#ifdef _OPENMP
+	return omp_get_thread_num();
+#else
+	return 0;
+#endif
+}
+
+// Runs work(job, state) for every job, most expensive first. Each thread
+// creates its own state with makeState() and reuses it for all its jobs.
+template <class MakeState, class Work>
+Report runLargestFirst(const QVector<double> &costs, MakeState makeState,
+					   Work work) {
+	QVector<int> order(costs.size());
+	for (int i = 0; i < order.size(); i++) {
+		order[i] = i;
+	}
+	std::stable_sort(order.begin(), order.end(),
+					 [&](int a, int b) { return costs[a] > costs[b]; });
+
+	Report report;
+	report.busySeconds.fill(0.0, threadCount());
+	report.jobCounts.fill(0, threadCount());
+
+	double *busySeconds = report.busySeconds.data();
+	int *jobCounts = report.jobCounts.data();
+
+	QElapsedTimer wallTimer;
+	wallTimer.start();
+
+	std::atomic<int> next(0);
+#pragma omp parallel
+	{
+		auto state = makeState();
+		const int thread = threadIndex();
+		QElapsedTimer busyTimer;
+		busyTimer.start();
+		int jobCount = 0;
+
+		while (true) {
+			const int slot = next.fetch_add(1, std::memory_order_relaxed);
+			if (slot >= order.size())
+				break;
+			work(order[slot], state);
+			jobCount++;
+		}
+
+		busySeconds[thread] = busyTimer.nsecsElapsed() * 1e-9;
+		jobCounts[thread] = jobCount;
+	}
+
+	report.wallSeconds = wallTimer.nsecsElapsed() * 1e-9;
+
+	return report;
+}
+
+} // end namespace Scheduler
+
+#endif // _SCHEDULER_H_
@@ -0,0 +1,187 @@
+/*
+Copyright 2021 Michael Georgoulopoulos
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files(the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and / or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions :
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+/*
+SpatialGrid is a uniform grid over a set of 3D points, used to find the points
+near a location without scanning all of them. Points are bucketed by cell and
+stored cell by cell (counting sort), so a query only visits the cells
+overlapping the query sphere. Choose a cell size close to the typical query
+radius.
+*/
+
+#ifndef _SPATIAL_GRID_H_
+#define _SPATIAL_GRID_H_
+
+#include <QString>
+#include <QVector>
+
+#include <algorithm>
+#include <cmath>
+#include <utility>
+
+#include "Vec3D.h"
+
+class SpatialGrid {
+  public:
+	SpatialGrid() {}
+	SpatialGrid(const QVector<Vec3D> &points, double cellSize)
+		: cellSize(cellSize) {
+		if (cellSize <= 0.0)
+			throw(QString("SpatialGrid: cell size must be positive"));
+		if (points.isEmpty())
+			return;
+
+		// Bounding box
+		Vec3D maximum = points.front();
+		origin = points.front();
+		for (const Vec3D &p : points) {
+			origin.x = std::min(origin.x, p.x);
+			origin.y = std::min(origin.y, p.y);
+			origin.z = std::min(origin.z, p.z);
+			maximum.x = std::max(maximum.x, p.x);
+			maximum.y = std::max(maximum.y, p.y);
+			maximum.z = std::max(maximum.z, p.z);
+		}
+		dimensions[0] = cellCoordinate(maximum.x - origin.x) + 1;
+		dimensions[1] = cellCoordinate(maximum.y - origin.y) + 1;
+		dimensions[2] = cellCoordinate(maximum.z - origin.z) + 1;
+
+		// Count points per cell, then place them
+		QVector<int> cellOfPoint(points.size());
+		cellStart.fill(0, dimensions[0] * dimensions[1] * dimensions[2] + 1);
+		for (int i = 0; i < points.size(); i++) {
+			const Vec3D &p = points[i];
+			cellOfPoint[i] = cellIndex(cellCoordinate(p.x - origin.x),
+									   cellCoordinate(p.y - origin.y),
+									   cellCoordinate(p.z - origin.z));
+			cellStart[cellOfPoint[i] + 1]++;
+		}
+		for (int c = 1; c < cellStart.size(); c++) {
+			cellStart[c] += cellStart[c - 1];
+		}
+		QVector<int> next = cellStart;
+		sortedIndices.resize(points.size());
+		sortedPoints.resize(points.size());
+		for (int i = 0; i < points.size(); i++) {
+			const int slot = next[cellOfPoint[i]]++;
+			sortedIndices[slot] = i;
+			sortedPoints[slot] = points[i];
+		}
+	}
+
+	// Calls f(index, distanceSquared) for every point within radius of the
+	// center.
+	template <class F>
+	void forEachWithin(const Vec3D &center, double radius, F f) const {
+		if (sortedPoints.isEmpty())
+			return;
+
+		int low[3], high[3];
+		const double c[3] = {center.x - origin.x, center.y - origin.y,
+							 center.z - origin.z};
+		for (int axis = 0; axis < 3; axis++) {
+			low[axis] = std::max(0, cellCoordinate(c[axis] - radius));
+			high[axis] = std::min(dimensions[axis] - 1,
+								  cellCoordinate(c[axis] + radius));
+			if (low[axis] > high[axis])
+				return;
+		}
+
+		const double radiusSquared = radius * radius;
+		const Vec3D *points = sortedPoints.constData();
+		const int *indices = sortedIndices.constData();
+		const int *start = cellStart.constData();
+		for (int z = low[2]; z <= high[2]; z++) {
+			for (int y = low[1]; y <= high[1]; y++) {
+				// Cells along x are contiguous
+				const int first = start[cellIndex(low[0], y, z)];
+				const int last = start[cellIndex(high[0], y, z) + 1];
+				for (int i = first; i < last; i++) {
+					const double d = Vec3D::distanceSquared(center, points[i]);
+					if (d <= radiusSquared)
+						f(indices[i], d);
+				}
+			}
+		}
+	}
+
+	// Appends the indices of the points within radius of the center.
+	void query(const Vec3D &center, double radius, QVector<int> *result) const {
+		forEachWithin(center, radius,
+					  [&](int index, double) { result->push_back(index); });
+	}
+
+	// Replaces result with the indices of the k points nearest to the center,
+	// closest first, and returns the distance of the farthest of them. The
+	// search starts at startRadius and doubles it until k points are within.
+	double nearest(const Vec3D &center, int k, double startRadius,
+				   QVector<int> *result) const {
+		result->resize(0);
+		k = std::min(k, size());
+		if (k <= 0)
+			return 0.0;
+
+		QVector<std::pair<double, int>> candidates;
+		double radius = std::max(startRadius, cellSize);
+		for (;;) {
+			candidates.resize(0);
+			forEachWithin(center, radius, [&](int index, double d) {
+				candidates.push_back(std::make_pair(d, index));
+			});
+			// All points within radius are here, so if there are k of them
+			// they include the k nearest.
+			if (candidates.size() >= k)
+				break;
+			radius *= 2.0;
+		}
+
+		std::partial_sort(candidates.begin(), candidates.begin() + k,
+						  candidates.end());
+		for (int i = 0; i < k; i++) {
+			result->push_back(candidates[i].second);
+		}
+		return std::sqrt(candidates[k - 1].first);
+	}
+
+	int size() const { return sortedIndices.size(); }
+
+  private:
+	int cellCoordinate(double offset) const {
+		return (int)std::floor(offset / cellSize);
+	}
+
+	int cellIndex(int x, int y, int z) const {
+		return (z * dimensions[1] + y) * dimensions[0] + x;
+	}
+
+	double cellSize = 1.0;
+	Vec3D origin;
+	int dimensions[3] = {0, 0, 0};
+
+	// First slot of every cell in the sorted arrays. One extra at the end.
+	QVector<int> cellStart;
+
+	// Points and their original indices, ordered by cell
+	QVector<int> sortedIndices;
+	QVector<Vec3D> sortedPoints;
+};
+
+#endif // _SPATIAL_GRID_H_
@@ -20,14 +20,11 @@ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 */
 
 /*
-This module defines templated class SphereSampler. SphereSampler was a piece of
-code I copied and pasted a lot so it probably deserves its own module. The
-reason for not doing so from the start was that "Gene" meant very different
-things to different programs. Some program might have histone modification
-profiles included in the Gene struct, some other conservation, transcription
-factor motifs and so on. The natural way of handling this is a C++ template
-which requires the common denominator of all structs: having a name and a 3D
-position so we can sample them.
+This module defines class SphereGeneSampler. SphereSampler was a piece of code I
+copied and pasted a lot so it probably deserves its own module. "Gene" means
+very different things to different programs, but all of them share a 3D
+position per gene, so the sampler works on the positions array of a GenePool
+and returns gene IDs.
 */
 
 #ifndef _SPHERE_SAMPLER_H_
@@ -36,39 +33,54 @@ position so we can sample them.
 #include <QVector>
 #include <random>
 
+#include "GenePool.h"
 #include "Vec3D.h"
 
 namespace Sampler {
 
-template <class Gene> class SphereGeneSampler {
+class SphereGeneSampler {
   public:
-	SphereGeneSampler(const QVector<Gene> &pool, double boxMinimum,
+	SphereGeneSampler(const QVector<Vec3D> &positions, double boxMinimum,
 					  double boxMaximum)
-		: pool(pool), distribution(boxMinimum, boxMaximum),
+		: positions(positions), distribution(boxMinimum, boxMaximum),
 		  boxMinimum(boxMinimum), boxMaximum(boxMaximum) {}
 
-	// Samples genes from the pool and returns pointers to them, using the
-	// specified radius and a random center. The center x,y,z coordinates are
-	// taken using a uniform distribution in the user-provided box.
-	QVector<const Gene *> sample(double radius) const {
-		QVector<const Gene *> result;
+	// Samples genes from the pool and returns their IDs, using the specified
+	// radius and a random center. The center x,y,z coordinates are taken using
+	// a uniform distribution in the user-provided box. The center is returned,
+	// so callers can keep track of where the sphere was. IDs come out in
+	// ascending order.
+	Vec3D sample(double radius, QVector<GeneIndex> *result) const {
+		const Vec3D center = randomCenter();
+		sampleAt(center, radius, result);
+		return center;
+	}
 
-		Vec3D center;
-		center.x = distribution(generator);
-		center.y = distribution(generator);
-		center.z = distribution(generator);
+	// Same, around a given center.
+	void sampleAt(const Vec3D &center, double radius,
+				  QVector<GeneIndex> *result) const {
+		result->resize(0);
 
-		for (const Gene &gene : pool) {
-			if (Vec3D::distance(center, gene.position) <= radius) {
-				result.push_back(&gene);
+		const double radiusSquared = radius * radius;
+		const Vec3D *position = positions.constData();
+		for (int i = 0; i < positions.size(); i++) {
+			if (Vec3D::distanceSquared(center, position[i]) <= radiusSquared) {
+				result->push_back((GeneIndex)i);
 			}
 		}
+	}
 
-		return result;
+	// A center taken uniformly in the box, as sample() does.
+	Vec3D randomCenter() const {
+		Vec3D center;
+		center.x = distribution(generator);
+		center.y = distribution(generator);
+		center.z = distribution(generator);
+		return center;
 	}
 
   private:
-	const QVector<Gene> &pool;
+	const QVector<Vec3D> &positions;
 	const double boxMinimum;
 	const double boxMaximum;
 	mutable std::default_random_engine generator;
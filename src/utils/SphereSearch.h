@@ -0,0 +1,372 @@
+/*
+Copyright 2021 Michael Georgoulopoulos
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files(the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and / or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions :
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+/*
+Sphere search: instead of blanket sampling, start from the most promising of a
+number of random spheres and move their centers, and optionally radii, to make
+the statistic as extreme as possible. Moves are accepted by hill climbing, or
+by simulated annealing when a starting temperature is given. Membership of a
+moved sphere comes from a spatial grid, so only genes near it are looked at,
+and its statistic is updated from the previous one with the genes that left
+and entered it.
+
+Spheres of different gene counts are compared by z-score against random sets
+of their own size, with geneCountMoments().
+
+Since the search picks the best spheres out of many, their statistics cannot
+be compared to random sets directly. Significance comes from a max-statistic
+null instead: the whole search is repeated on data whose gene records have
+been shuffled over the positions, and each found sphere is ranked against the
+best score of every shuffled run. These p-values control the family-wise error
+rate, so familyWiseOrder() ranks them without further adjustment.
+
+Like SphereTest.h, this expects Gene::acceptSample() and
+Gene::randomIsMoreExtreme() from the program, and boxMinimum/boxMaximum in
+scope. The statistic comes from the program's accumulator, which must be able
+to remove genes as for calculateWindowStatistics().
+*/
+
+#ifndef _SPHERE_SEARCH_H_
+#define _SPHERE_SEARCH_H_
+
+#include <QVector>
+
+#include <algorithm>
+#include <cmath>
+#include <iterator>
+#include <limits>
+#include <random>
+
+#include "CenterGenerator.h"
+#include "GenePool.h"
+#include "SpatialGrid.h"
+#include "SphereTest.h"
+
+namespace SphereSearch {
+
+struct Options {
+	// Random spheres of the starting radius, and how many of the best of them
+	// are refined
+	double startRadius = 15.0;
+	int startCount = 2000;
+	int climberCount = 50;
+
+	// Moves tried per refined sphere. A move shifts the center by a normal
+	// step of centerStep per axis and scales the radius by exp() of a normal
+	// step of radiusStep, kept within the radius limits. A radiusStep of 0
+	// keeps the starting radius.
+	int moveCount = 300;
+	double centerStep = 2.0;
+	double radiusStep = 0.1;
+	double minimumRadius = 8.0;
+	double maximumRadius = 25.0;
+
+	// Simulated annealing temperature, in z-score units, at the first move. It
+	// cools geometrically to 1% of that by the last. 0 for hill climbing.
+	double temperature = 0.0;
+
+	// Random sets per gene count for the z-scores, and shuffled runs for the
+	// max-statistic null
+	int momentSampleCount = 2000;
+	int permutationCount = 100;
+};
+
+// A sphere found by the search
+struct Sphere {
+	Vec3D center;
+	double radius = 0.0;
+	QVector<GeneIndex> genes;
+	double statistic = 0.0;
+
+	// z-score signed so that higher is more extreme; -infinity if the sphere
+	// is not acceptable
+	double score = -std::numeric_limits<double>::infinity();
+};
+
+template <class Accumulator, class Gene> class Searcher {
+  public:
+	// A climbing sphere is rebuilt from scratch after this many incremental
+	// updates, which bounds rounding drift in the accumulator.
+	static const int rebuildLimit = 256;
+
+	Searcher(const GenePool<Gene> &pool, const GeneCountMoments &moments,
+			 const Options &options)
+		: moments(moments), options(options),
+		  grid(pool.positions, options.maximumRadius),
+		  lower(lowerIsMoreExtreme<Gene>()) {}
+
+	// Runs the search on the given gene records, the pool's own or a
+	// shuffled copy, and returns the refined spheres, best first. Refined
+	// spheres are searched in parallel if asked to. Adds the number of
+	// statistic evaluations to evaluationCount.
+	QVector<Sphere> run(const Gene *genes, unsigned seed, bool parallel,
+						qint64 *evaluationCount) const {
+		// Starting spheres, the same centers for every run
+		Sampler::CenterGenerator centers(Sampler::CenterSequence::Uniform,
+										 boxMinimum, boxMaximum);
+		QVector<Sphere> starts(options.startCount);
+		for (Sphere &sphere : starts) {
+			sphere.center = centers.next();
+			sphere.radius = options.startRadius;
+		}
+		Sphere *start = starts.data();
+#pragma omp parallel if (parallel)
+		{
+			Accumulator accumulator;
+#pragma omp for schedule(dynamic, 16)
+			for (int i = 0; i < starts.size(); i++) {
+				if (findMembers(genes, &start[i]))
+					rebuild(genes, start[i], &accumulator);
+			}
+		}
+		*evaluationCount += starts.size();
+
+		const int climberCount = std::min(options.climberCount, starts.size());
+		std::partial_sort(starts.begin(), starts.begin() + climberCount,
+						  starts.end(), [](const Sphere &a, const Sphere &b) {
+							  return a.score > b.score;
+						  });
+		QVector<Sphere> result;
+		for (int i = 0; i < climberCount; i++) {
+			if (starts[i].score > -std::numeric_limits<double>::infinity())
+				result.push_back(starts[i]);
+		}
+
+		Sphere *climber = result.data();
+#pragma omp parallel for schedule(dynamic, 1) if (parallel)
+		for (int i = 0; i < result.size(); i++) {
+			climb(genes, seed * 7919u + (unsigned)i, &climber[i]);
+		}
+		*evaluationCount += (qint64)result.size() * options.moveCount;
+
+		std::sort(result.begin(), result.end(),
+				  [](const Sphere &a, const Sphere &b) {
+					  return a.score > b.score;
+				  });
+		return result;
+	}
+
+  private:
+	// Fills in the genes of a sphere from center and radius, sorted, and
+	// returns whether the sphere is acceptable. Unacceptable spheres get a
+	// score of -infinity.
+	bool findMembers(const Gene *genes, Sphere *sphere) const {
+		sphere->genes.resize(0);
+		sphere->score = -std::numeric_limits<double>::infinity();
+		grid.forEachWithin(sphere->center, sphere->radius,
+						   [&](int index, double) {
+							   sphere->genes.push_back((GeneIndex)index);
+						   });
+		const int count = sphere->genes.size();
+		if (count > moments.largestGeneCount())
+			return false;
+		std::sort(sphere->genes.begin(), sphere->genes.end());
+		return Gene::acceptSample(genes, sphere->genes.constData(), count);
+	}
+
+	// Fills in statistic and score of a sphere from the accumulator
+	void score(const Accumulator &accumulator, Sphere *sphere) const {
+		sphere->statistic = accumulator.statistic();
+		const double z = moments.zScore(sphere->genes.size(), sphere->statistic);
+		sphere->score = lower ? -z : z;
+	}
+
+	// Refills the accumulator with the genes of an acceptable sphere and
+	// scores it
+	void rebuild(const Gene *genes, Sphere &sphere,
+				 Accumulator *accumulator) const {
+		accumulator->clear();
+		for (const GeneIndex id : sphere.genes) {
+			accumulator->add(genes, id);
+		}
+		score(*accumulator, &sphere);
+	}
+
+	void climb(const Gene *genes, unsigned seed, Sphere *best) const {
+		std::default_random_engine generator(seed);
+		std::normal_distribution<double> normal(0.0, 1.0);
+		std::uniform_real_distribution<double> uniform(0.0, 1.0);
+
+		// The accumulator always holds the genes of the current sphere; a
+		// candidate is scored by moving the genes that differ in and out of
+		// it, and moving them back if the candidate is rejected.
+		Sphere current = *best;
+		Sphere candidate;
+		Accumulator accumulator;
+		rebuild(genes, current, &accumulator);
+		int updateCount = 0;
+		QVector<GeneIndex> leaving;
+		QVector<GeneIndex> entering;
+		for (int move = 0; move < options.moveCount; move++) {
+			candidate.center =
+				current.center + Vec3D(normal(generator), normal(generator),
+									   normal(generator)) *
+									 options.centerStep;
+			candidate.radius = current.radius;
+			if (options.radiusStep > 0.0) {
+				candidate.radius = std::min(
+					options.maximumRadius,
+					std::max(options.minimumRadius,
+							 current.radius *
+								 exp(options.radiusStep * normal(generator))));
+			}
+			if (!findMembers(genes, &candidate))
+				continue;
+
+			// Both gene lists are sorted
+			leaving.resize(0);
+			entering.resize(0);
+			std::set_difference(current.genes.constBegin(),
+								current.genes.constEnd(),
+								candidate.genes.constBegin(),
+								candidate.genes.constEnd(),
+								std::back_inserter(leaving));
+			std::set_difference(candidate.genes.constBegin(),
+								candidate.genes.constEnd(),
+								current.genes.constBegin(),
+								current.genes.constEnd(),
+								std::back_inserter(entering));
+			const bool incremental =
+				updateCount < rebuildLimit &&
+				leaving.size() + entering.size() < candidate.genes.size();
+			if (incremental) {
+				for (const GeneIndex id : leaving) {
+					accumulator.remove(genes, id);
+				}
+				for (const GeneIndex id : entering) {
+					accumulator.add(genes, id);
+				}
+				score(accumulator, &candidate);
+				updateCount++;
+			} else {
+				rebuild(genes, candidate, &accumulator);
+				updateCount = 0;
+			}
+
+			bool accept = candidate.score >= current.score;
+			if (!accept && options.temperature > 0.0 &&
+				candidate.score > -std::numeric_limits<double>::infinity()) {
+				const double temperature =
+					options.temperature *
+					pow(0.01, (double)move / (double)options.moveCount);
+				accept = uniform(generator) <
+						 exp((candidate.score - current.score) / temperature);
+			}
+			if (!accept) {
+				if (incremental) {
+					for (const GeneIndex id : entering) {
+						accumulator.remove(genes, id);
+					}
+					for (const GeneIndex id : leaving) {
+						accumulator.add(genes, id);
+					}
+					updateCount++;
+				} else {
+					rebuild(genes, current, &accumulator);
+				}
+				continue;
+			}
+
+			std::swap(current, candidate);
+			if (current.score > best->score)
+				*best = current;
+		}
+	}
+
+	const GeneCountMoments &moments;
+	const Options options;
+	const SpatialGrid grid;
+	const bool lower;
+};
+
+// Result of search(): the refined spheres as work units, with family-wise
+// p-values, and what it took to get them.
+struct Result {
+	WorkUnits workUnits;
+	QVector<double> nullMaxima;
+	qint64 evaluationCount = 0;
+};
+
+// Searches the pool and the shuffled copies, and gives every refined sphere
+// its p-value against the best scores of the shuffled runs.
+template <class Accumulator, class Gene>
+Result search(const GenePool<Gene> &pool, const Options &options) {
+	// Largest gene count a sphere can reach, with some room for spheres not
+	// centered on a gene
+	const SpatialGrid grid(pool.positions, options.maximumRadius);
+	int largestGeneCount = 0;
+	for (const Vec3D &position : pool.positions) {
+		int count = 0;
+		grid.forEachWithin(position, options.maximumRadius,
+						   [&](int, double) { count++; });
+		largestGeneCount = std::max(largestGeneCount, count);
+	}
+	largestGeneCount = std::min(pool.size(), largestGeneCount * 3 / 2 + 1);
+
+	const GeneCountMoments moments = geneCountMoments<Accumulator>(
+		pool, largestGeneCount, options.momentSampleCount);
+	const Searcher<Accumulator, Gene> searcher(pool, moments, options);
+
+	Result result;
+	const QVector<Sphere> spheres =
+		searcher.run(pool.genes.constData(), 0, true, &result.evaluationCount);
+
+	// Max-statistic null, one shuffled run per thread at a time
+	result.nullMaxima.fill(-std::numeric_limits<double>::infinity(),
+						   options.permutationCount);
+	double *nullMaxima = result.nullMaxima.data();
+	qint64 nullEvaluationCount = 0;
+#pragma omp parallel for schedule(dynamic, 1) reduction(+ : nullEvaluationCount)
+	for (int r = 0; r < options.permutationCount; r++) {
+		QVector<Gene> shuffled = pool.genes;
+		std::default_random_engine generator(r + 1);
+		std::shuffle(shuffled.begin(), shuffled.end(), generator);
+		const QVector<Sphere> nullSpheres = searcher.run(
+			shuffled.constData(), r + 1, false, &nullEvaluationCount);
+		if (!nullSpheres.isEmpty())
+			nullMaxima[r] = nullSpheres.front().score;
+	}
+	result.evaluationCount += nullEvaluationCount;
+	std::sort(result.nullMaxima.begin(), result.nullMaxima.end());
+
+	for (const Sphere &sphere : spheres) {
+		WorkUnit workUnit;
+		workUnit.center = sphere.center;
+		workUnit.radius = sphere.radius;
+		workUnit.firstGene = result.workUnits.arena.size();
+		workUnit.geneCount = sphere.genes.size();
+		workUnit.statisticInSphere = sphere.statistic;
+		workUnit.chanceWinCount =
+			result.nullMaxima.constEnd() -
+			std::lower_bound(result.nullMaxima.constBegin(),
+							 result.nullMaxima.constEnd(), sphere.score);
+		workUnit.pValue = (double)(workUnit.chanceWinCount + 1) /
+						  (double)(options.permutationCount + 1);
+		result.workUnits.arena += sphere.genes;
+		result.workUnits.units.push_back(workUnit);
+	}
+
+	return result;
+}
+
+} // namespace SphereSearch
+
+#endif // _SPHERE_SEARCH_H_
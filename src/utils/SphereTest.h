@@ -28,177 +28,1741 @@ The test itself is not templated and is a (copied) large function in each
 specific program. We at least deflate the large function using these templates
 here. We dont include the large function here so the various programs can have
 some room to recombine parts of the procedure.
+
+Genes are handled by their IDs in a GenePool. The statistic gets the hot Gene
+array and a list of IDs; names are only looked up when producing output.
 */
 
 #ifndef _SPHERE_TEST_H_
 #define _SPHERE_TEST_H_
 
-// One work unit is one successfully-sampled sphere together with its results
-// (genes and p-values). We use a separate struct for this to facilitate
-// multithreading. Each sphere does its p-value calculation in its own thread.
-// Each thread has its own private data to work with.
-template <class Gene> struct WorkUnit {
-	QVector<const Gene *> genesInSphere;
+#include <QSet>
+#include <QString>
+#include <QVector>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <iterator>
+#include <limits>
+#include <queue>
+#include <random>
+
+#include "AggregateOctree.h"
+#include "CenterGenerator.h"
+#include "GenePool.h"
+#include "GeneSet.h"
+#include "RandomGeneSampler.h"
+#include "Scheduler.h"
+#include "TDigest.h"
+#include "TailFit.h"
+#include "SpatialGrid.h"
+#include "SphereGeneSampler.h"
+#include "WindowGeneSampler.h"
+
+// One work unit is one successfully-sampled sphere together with its results.
+// We keep this a small, plain struct: the genes of the sphere are not stored
+// here but in the shared arena of WorkUnits, and everything that is only needed
+// while a unit is being evaluated (random sampler, buffers) lives in the
+// ThreadState of the thread doing the evaluation.
+struct WorkUnit {
+	// Where the sphere was sampled
+	Vec3D center;
+	double radius = 0.0;
+
+	// Genes of the sphere: geneCount indices, starting at firstGene in the
+	// arena.
+	int firstGene = 0;
+	int geneCount = 0;
+
 	double pValue = 1.0;
-	Sampler::RandomGeneSampler<Gene> randomSampler;
 
 	// How many times we got a more extreme result by sheer luck?
 	int chanceWinCount = 0;
 
-	// Buffer for sampling random sets
-	QVector<const Gene *> randomGenes;
-
-	// Keep these 2 for further processing - random is the last of the random tests
+	// Keep these 2 for further processing - random is the last of the random
+	// tests
 	double statisticInSphere = 0.0;
 	double statisticInRandom = 0.0;
 
 	// P-value rank and Benjamini-Hochberg-adjusted version of it.
 	int rank = 0;
 	double adjustedPValue = 1.0;
+};
 
-	WorkUnit() {}
-	WorkUnit(const WorkUnit &other) : randomSampler(other.randomSampler) {
-		genesInSphere = other.genesInSphere;
-		pValue = other.pValue;
-		chanceWinCount = other.chanceWinCount;
-		randomGenes = other.randomGenes;
-		rank = other.rank;
-		adjustedPValue = other.adjustedPValue;
+// All work units of a run, together with the arena holding their genes back to
+// back.
+struct WorkUnits {
+	QVector<WorkUnit> units;
+	QVector<GeneIndex> arena;
+
+	int size() const { return units.size(); }
+	bool isEmpty() const { return units.isEmpty(); }
+	WorkUnit &operator[](int i) { return units[i]; }
+	const WorkUnit &operator[](int i) const { return units[i]; }
+
+	const GeneIndex *genesBegin(const WorkUnit &workUnit) const {
+		return arena.constData() + workUnit.firstGene;
+	}
+	const GeneIndex *genesEnd(const WorkUnit &workUnit) const {
+		return genesBegin(workUnit) + workUnit.geneCount;
 	}
+};
 
-	WorkUnit(const QVector<Gene> &pool) : randomSampler(pool) {}
+// Buffers of calculatePValueBatched() and PairSumEvaluator::evaluate()
+struct PairSumScratch {
+	// A tile of random sets, back to back, and their pair sums
+	QVector<GeneIndex> tileGenes;
+	QVector<int> offsets;
+	QVector<double> pairSums;
 
-	void calculatePValue(int randomSampleCount) {
-		// Calculate metric in the sphere-sample
-		statisticInSphere = sphereTestStatistic(genesInSphere);
+	// Sorted matrix indices of the tile, and where each set enters each block
+	QVector<int> indices;
+	QVector<int> blockStarts;
+};
 
-		// Random samples
-		for (int r = 0; r < randomSampleCount; r++) {
-			randomSampler.sample(genesInSphere.size(), &randomGenes);
-			statisticInRandom = sphereTestStatistic(randomGenes);
+// Private data of each thread evaluating work units. Create one of these per
+// thread and reuse it for all the units the thread processes.
+struct ThreadState {
+	ThreadState(int poolSize) : randomSampler(poolSize) {}
 
-			// Is random more extreme than sphere?
-			if (Gene::randomIsMoreExtreme(statisticInRandom, statisticInSphere))
-				chanceWinCount++;
-		} // end for (N random samples)
+	Sampler::RandomGeneSampler randomSampler;
 
-		pValue = Gene::calculatePValue(chanceWinCount, randomSampleCount);
+	// Buffer for sampling random sets
+	QVector<GeneIndex> randomGenes;
 
-		// Give benefit of the doubt to chance: replace zero pValues with the
-		// smallest we can safely say
-		pValue = std::max(pValue, 1.0 / (double)randomSampleCount);
+	// Buffers for batched evaluation of random sets
+	PairSumScratch pairSumScratch;
+};
+
+// Calculates the p-value of one work unit, by comparing the statistic in the
+// sphere to randomSampleCount random sets of the same size.
+template <class Gene>
+void calculatePValue(const GenePool<Gene> &pool, WorkUnits &workUnits,
+					 int index, int randomSampleCount, ThreadState *state) {
+	const Gene *genes = pool.genes.constData();
+	WorkUnit &workUnit = workUnits[index];
+
+	// Calculate metric in the sphere-sample
+	workUnit.statisticInSphere = sphereTestStatistic(
+		genes, workUnits.genesBegin(workUnit), workUnit.geneCount);
+
+	// Random samples
+	workUnit.chanceWinCount = 0;
+	for (int r = 0; r < randomSampleCount; r++) {
+		state->randomSampler.sample(workUnit.geneCount, &state->randomGenes);
+		workUnit.statisticInRandom = sphereTestStatistic(
+			genes, state->randomGenes.constData(), workUnit.geneCount);
+
+		// Is random more extreme than sphere?
+		if (Gene::randomIsMoreExtreme(workUnit.statisticInRandom,
+									  workUnit.statisticInSphere))
+			workUnit.chanceWinCount++;
+	} // end for (N random samples)
+
+	workUnit.pValue =
+		Gene::calculatePValue(workUnit.chanceWinCount, randomSampleCount);
+
+	// Give benefit of the doubt to chance: replace zero pValues with the
+	// smallest we can safely say
+	workUnit.pValue =
+		std::max(workUnit.pValue, 1.0 / (double)randomSampleCount);
+}
+
+// Batched evaluation of pairwise-average statistics backed by a dense matrix
+// of pair values, such as coexpression scores or precomputed histone
+// distances. The pair sum of a set is x'Cx minus the diagonal, x being the
+// set's indicator (count) vector. Evaluating one set at a time gathers
+// scattered entries from all over C; instead we take a tile of sets and walk C
+// block by block, so each block is loaded into cache once and used by every
+// set of the tile that has members in both its row and column ranges. That is
+// the diagonal of X C X' computed as a blocked matrix product.
+template <class Element> class PairSumEvaluator {
+  public:
+	// matrix is size x size, row major. matrixIndexOfGene maps gene IDs to
+	// matrix rows; leave it empty if they are the same. The statistic is the
+	// pair sum over ordered pairs, times scale, divided by the pair count.
+	PairSumEvaluator(const Element *matrix, int size,
+					 const QVector<int> &matrixIndexOfGene = QVector<int>(),
+					 double scale = 1.0, int blockSize = 512)
+		: matrix(matrix), size(size), matrixIndexOfGene(matrixIndexOfGene),
+		  scale(scale), blockSize(blockSize),
+		  blockCount((size + blockSize - 1) / blockSize) {}
+
+	double statistic(double pairSum, int count) const {
+		if (count < 2)
+			return 0.0;
+		return scale * pairSum / ((double)count * (count - 1));
+	}
+
+	// Sums matrix(a, b) over ordered pairs of distinct positions for each of
+	// setCount sets given back to back: set s is genes[offsets[s]] up to
+	// genes[offsets[s + 1]]. Single-threaded: callers run one sphere per
+	// thread (see calculatePValueBatched()), so each thread already has whole
+	// tiles of its own. Blocks only pay off when many sets of the tile touch
+	// each block, so tiles should be large: about a thousand sets of a
+	// hundred genes out of a few thousand. The index buffers are taken from
+	// scratch, to be reused across calls.
+	void evaluate(const GeneIndex *genes, const int *offsets, int setCount,
+				  double *pairSums, PairSumScratch *scratch) const {
+		const int total = offsets[setCount] - offsets[0];
+
+		// Matrix indices of each set, sorted, so that the members of a set
+		// in any block are a contiguous range.
+		QVector<int> &indices = scratch->indices;
+		indices.resize(total);
+		for (int i = 0; i < total; i++) {
+			const GeneIndex gene = genes[offsets[0] + i];
+			indices[i] = matrixIndexOfGene.isEmpty() ? (int)gene
+													 : matrixIndexOfGene[gene];
+		}
+		QVector<int> &blockStarts = scratch->blockStarts;
+		blockStarts.resize(setCount * (blockCount + 1));
+		for (int s = 0; s < setCount; s++) {
+			int *begin = indices.data() + offsets[s] - offsets[0];
+			int *end = indices.data() + offsets[s + 1] - offsets[0];
+			std::sort(begin, end);
+			int *starts = blockStarts.data() + s * (blockCount + 1);
+			int *position = begin;
+			for (int b = 0; b <= blockCount; b++) {
+				while (position != end && *position < b * blockSize)
+					position++;
+				starts[b] = (int)(position - indices.data());
+			}
+			pairSums[s] = 0.0;
+		}
+
+		const int *sorted = indices.constData();
+		for (int rowBlock = 0; rowBlock < blockCount; rowBlock++) {
+			for (int columnBlock = 0; columnBlock < blockCount;
+				 columnBlock++) {
+				for (int s = 0; s < setCount; s++) {
+					const int *starts = blockStarts.constData() +
+										s * (blockCount + 1);
+					const int rowBegin = starts[rowBlock];
+					const int rowEnd = starts[rowBlock + 1];
+					const int columnBegin = starts[columnBlock];
+					const int columnEnd = starts[columnBlock + 1];
+					if (rowBegin == rowEnd || columnBegin == columnEnd)
+						continue;
+
+					double sum = 0.0;
+					for (int i = rowBegin; i < rowEnd; i++) {
+						const Element *row =
+							matrix + (qint64)sorted[i] * size;
+						for (int j = columnBegin; j < columnEnd; j++) {
+							sum += row[sorted[j]];
+						}
+					}
+					pairSums[s] += sum;
+				}
+			}
+		}
+
+		// Remove each position paired with itself
+		for (int s = 0; s < setCount; s++) {
+			for (int i = offsets[s] - offsets[0];
+				 i < offsets[s + 1] - offsets[0]; i++) {
+				pairSums[s] -= matrix[(qint64)sorted[i] * size + sorted[i]];
+			}
+		}
 	}
+
+  private:
+	const Element *matrix;
+	int size;
+	QVector<int> matrixIndexOfGene;
+	double scale;
+	int blockSize;
+	int blockCount;
 };
 
-// Creates a number of randomized WorkUnits.
+// Same as calculatePValue(), evaluating the random sets in tiles with a
+// PairSumEvaluator. Meant to be called from one thread per unit. Random sets
+// are compared to the sphere as evaluated on the same matrix, so that
+// rounding of the matrix elements cannot flip near ties.
+template <class Gene, class Element>
+void calculatePValueBatched(const GenePool<Gene> &pool, WorkUnits &workUnits,
+							int index, int randomSampleCount,
+							ThreadState *state,
+							const PairSumEvaluator<Element> &evaluator,
+							int tileSize = 1024) {
+	const Gene *genes = pool.genes.constData();
+	WorkUnit &workUnit = workUnits[index];
+	const int geneCount = workUnit.geneCount;
+
+	// Calculate metric in the sphere-sample
+	workUnit.statisticInSphere = sphereTestStatistic(
+		genes, workUnits.genesBegin(workUnit), geneCount);
+
+	PairSumScratch &scratch = state->pairSumScratch;
+	QVector<int> &offsets = scratch.offsets;
+	offsets.resize(tileSize + 1);
+	offsets[0] = 0;
+	offsets[1] = geneCount;
+	double sphereInMatrix = 0.0;
+	evaluator.evaluate(workUnits.genesBegin(workUnit), offsets.constData(), 1,
+					   &sphereInMatrix, &scratch);
+	sphereInMatrix = evaluator.statistic(sphereInMatrix, geneCount);
+
+	// Random samples, a tile at a time
+	QVector<GeneIndex> &tileGenes = scratch.tileGenes;
+	QVector<double> &pairSums = scratch.pairSums;
+	tileGenes.resize(tileSize * geneCount);
+	pairSums.resize(tileSize);
+	for (int t = 0; t <= tileSize; t++) {
+		offsets[t] = t * geneCount;
+	}
+
+	workUnit.chanceWinCount = 0;
+	for (int first = 0; first < randomSampleCount; first += tileSize) {
+		const int count = std::min(tileSize, randomSampleCount - first);
+		for (int t = 0; t < count; t++) {
+			state->randomSampler.sample(geneCount, &state->randomGenes);
+			std::copy(state->randomGenes.constBegin(),
+					  state->randomGenes.constEnd(),
+					  tileGenes.begin() + t * geneCount);
+		}
+		evaluator.evaluate(tileGenes.constData(), offsets.constData(), count,
+						   pairSums.data(), &scratch);
+
+		for (int t = 0; t < count; t++) {
+			workUnit.statisticInRandom =
+				evaluator.statistic(pairSums[t], geneCount);
+
+			// Is random more extreme than sphere?
+			if (Gene::randomIsMoreExtreme(workUnit.statisticInRandom,
+										  sphereInMatrix))
+				workUnit.chanceWinCount++;
+		}
+	}
+
+	workUnit.pValue =
+		Gene::calculatePValue(workUnit.chanceWinCount, randomSampleCount);
+
+	// Give benefit of the doubt to chance: replace zero pValues with the
+	// smallest we can safely say
+	workUnit.pValue =
+		std::max(workUnit.pValue, 1.0 / (double)randomSampleCount);
+}
+
+// Optional stopping rule for createWorkUnits(): enough spheres have been
+// sampled once geneFraction of all genes are each in at least depth of them.
+struct CoverageTarget {
+	CoverageTarget() {}
+	CoverageTarget(double geneFraction, int depth)
+		: geneFraction(geneFraction), depth(depth) {}
+
+	bool isSet() const { return geneFraction > 0.0; }
+
+	double geneFraction = 0.0;
+	int depth = 1;
+};
+
+#ifdef COVERAGE_STOPPING
+// Under COVERAGE_STOPPING, createSphereWorkUnits() stops sampling once this
+// fraction of genes is in coverageDepth spheres or more
+const double coveredGeneFraction = 0.95;
+const int coverageDepth = 10;
+#endif
+
+// Creates a number of randomized WorkUnits. Centers come from the chosen
+// sequence; Poisson-disk centers are at least centerSpacing apart. With a
+// coverage target, sampling stops as soon as the target is met and count is
+// only a cap. Independent runs need different center seeds.
+template <class Gene>
+WorkUnits createWorkUnits(
+	double sphereRadius, const GenePool<Gene> &pool, int count,
+	int *averageGenesInASphere,
+	Sampler::CenterSequence centerSequence = Sampler::CenterSequence::Uniform,
+	double centerSpacing = 0.0,
+	const CoverageTarget &coverageTarget = CoverageTarget(),
+	unsigned centerSeed = std::default_random_engine::default_seed) {
+	WorkUnits result;
+	result.units.reserve(count);
+
+	const Sampler::SphereGeneSampler sphereSampler(pool.positions, boxMinimum,
+												   boxMaximum);
+	Sampler::CenterGenerator centers(centerSequence, boxMinimum, boxMaximum,
+									 centerSpacing, centerSeed);
+
+	// Spheres in a batch are scanned in parallel, then taken in order, so the
+	// result does not depend on the number of threads. Per-gene counts are
+	// updated while taking them, which needs no atomics.
+	const int batchSize = 256;
+	QVector<Vec3D> batchCenters(batchSize);
+	QVector<QVector<GeneIndex>> batchGenes(batchSize);
+	QVector<char> batchAccepted(batchSize);
+
+	QVector<int> spheresPerGene(coverageTarget.isSet() ? pool.size() : 0, 0);
+	const int coveredGenesNeeded =
+		(int)std::ceil(coverageTarget.geneFraction * (double)pool.size());
+	int coveredGenes = 0;
+	auto targetMet = [&]() {
+		return coverageTarget.isSet() && coveredGenes >= coveredGenesNeeded;
+	};
+
+	qint64 genesInSpheres = 0;
+	while (result.size() < count && !targetMet()) {
+		for (int b = 0; b < batchSize; b++) {
+			batchCenters[b] = centers.next();
+		}
+
+		QVector<GeneIndex> *genesOfSphere = batchGenes.data();
+		char *accepted = batchAccepted.data();
+#pragma omp parallel for schedule(dynamic, 8)
+		for (int b = 0; b < batchSize; b++) {
+			sphereSampler.sampleAt(batchCenters[b], sphereRadius,
+								   &genesOfSphere[b]);
+			// Reject samples in mostly empty space
+			accepted[b] = Gene::acceptSample(pool.genes.constData(),
+											 genesOfSphere[b].constData(),
+											 genesOfSphere[b].size());
+		}
+
+		for (int b = 0; b < batchSize; b++) {
+			if (result.size() >= count || targetMet())
+				break;
+			if (!accepted[b])
+				continue;
+
+			// Successful sample
+			const QVector<GeneIndex> &genesInSphere = genesOfSphere[b];
+			WorkUnit workUnit;
+			workUnit.center = batchCenters[b];
+			workUnit.radius = sphereRadius;
+			workUnit.firstGene = result.arena.size();
+			workUnit.geneCount = genesInSphere.size();
+			result.arena += genesInSphere;
+			result.units.push_back(workUnit);
+			genesInSpheres += workUnit.geneCount;
+
+			if (coverageTarget.isSet()) {
+				for (GeneIndex id : genesInSphere) {
+					if (++spheresPerGene[id] == coverageTarget.depth)
+						coveredGenes++;
+				}
+			}
+		}
+	}
+
+	*averageGenesInASphere =
+		result.isEmpty() ? 0 : (int)(genesInSpheres / result.size());
+
+	return result;
+}
+
+// createWorkUnits() with the center sequence chosen by the program's
+// SOBOL_CENTERS or POISSON_DISK_CENTERS switch, uniform draws otherwise.
+// Poisson-disk centers are kept one sphere radius apart. Under
+// COVERAGE_STOPPING, count is only a cap.
+template <class Gene>
+WorkUnits createSphereWorkUnits(
+	double sphereRadius, const GenePool<Gene> &pool, int count,
+	int *averageGenesInASphere,
+	unsigned centerSeed = std::default_random_engine::default_seed) {
+#if defined(SOBOL_CENTERS)
+	const Sampler::CenterSequence centerSequence =
+		Sampler::CenterSequence::Sobol;
+#elif defined(POISSON_DISK_CENTERS)
+	const Sampler::CenterSequence centerSequence =
+		Sampler::CenterSequence::PoissonDisk;
+#else
+	const Sampler::CenterSequence centerSequence =
+		Sampler::CenterSequence::Uniform;
+#endif
+#ifdef COVERAGE_STOPPING
+	const CoverageTarget coverageTarget(coveredGeneFraction, coverageDepth);
+#else
+	const CoverageTarget coverageTarget;
+#endif
+	return createWorkUnits(sphereRadius, pool, count, averageGenesInASphere,
+						   centerSequence, sphereRadius, coverageTarget,
+						   centerSeed);
+}
+
+// Creates a number of randomized WorkUnits of exactly geneCount genes each:
+// the genes nearest to a random center, taken in the box or at a random gene.
+// All units then share a single null distribution, and a spatial index
+// replaces the scan over all genes. The radius of a unit is the distance of
+// its farthest gene; units wider than maximumRadius lie in mostly empty space
+// and are rejected, like those failing Gene::acceptSample().
 template <class Gene>
-QVector<WorkUnit<Gene>> createWorkUnits(double sphereRadius,
-										const QVector<Gene> &genes, int count,
-										int *averageGenesInASphere) {
-	QVector<WorkUnit<Gene>> result;
-	result.reserve(count);
+WorkUnits createNearestGeneWorkUnits(int geneCount, double maximumRadius,
+									 const GenePool<Gene> &pool, int count,
+									 bool centerOnGenes) {
+	if (geneCount <= 0 || geneCount > pool.size())
+		throw(QString("Cannot make balls of %1 genes out of %2")
+				  .arg(geneCount)
+				  .arg(pool.size()));
 
-	const Sampler::SphereGeneSampler<Gene> sphereSampler(genes, boxMinimum,
-														 boxMaximum);
+	WorkUnits result;
+	result.units.reserve(count);
+	result.arena.reserve(count * geneCount);
 
-	*averageGenesInASphere = 0;
+	const Sampler::SphereGeneSampler sphereSampler(pool.positions, boxMinimum,
+												   boxMaximum);
+	const SpatialGrid grid(pool.positions, maximumRadius);
+	std::default_random_engine generator;
+	std::uniform_int_distribution<int> geneDistribution(0, pool.size() - 1);
 
+	// Start each search at the radius which held geneCount genes last time
+	double startRadius = maximumRadius;
+
+	QVector<int> nearest;
+	QVector<GeneIndex> genesInBall(geneCount);
 	while (result.size() < count) {
-		WorkUnit<Gene> workUnit(genes);
+		WorkUnit workUnit;
+		workUnit.center = centerOnGenes
+							  ? pool.positions[geneDistribution(generator)]
+							  : sphereSampler.randomCenter();
+		workUnit.radius =
+			grid.nearest(workUnit.center, geneCount, startRadius, &nearest);
+		if (workUnit.radius > maximumRadius)
+			continue;
+		startRadius = workUnit.radius;
 
-		workUnit.genesInSphere = sphereSampler.sample(sphereRadius);
-		if (!Gene::acceptSample(workUnit.genesInSphere)) {
-			// Reject sample - we don't want spheres in mostly empty space
+		// IDs in ascending order, like SphereGeneSampler gives them
+		for (int i = 0; i < geneCount; i++) {
+			genesInBall[i] = (GeneIndex)nearest[i];
+		}
+		std::sort(genesInBall.begin(), genesInBall.end());
+		if (!Gene::acceptSample(pool.genes.constData(),
+								genesInBall.constData(), geneCount)) {
 			continue;
 		}
 
-		// Successful sample
-		result.push_back(workUnit);
-		*averageGenesInASphere += workUnit.genesInSphere.size();
+		workUnit.firstGene = result.arena.size();
+		workUnit.geneCount = geneCount;
+		result.arena += genesInBall;
+		result.units.push_back(workUnit);
 	}
 
-	*averageGenesInASphere /= count;
+	return result;
+}
+
+// Creates a WorkUnit for every window of consecutive genes along the genome:
+// sizes from minimumGeneCount to maximumGeneCount in steps of sizeStep,
+// starting every stride genes. The arena is the genome order itself and each
+// unit is a slice of it, so windows take no extra memory. Units come ordered
+// by size, then position, so consecutive units of a chromosome overlap and
+// calculateWindowStatistics() can slide from one to the next. Center and
+// radius are those of the smallest ball around the centroid holding all genes
+// of the window, which keeps clusterByGeneOverlap() working. Windows are not
+// subject to Gene::acceptSample(); their size is fixed by construction.
+template <class Gene>
+WorkUnits createWindowWorkUnits(const GenePool<Gene> &pool,
+								const Sampler::WindowGeneSampler &sampler,
+								int minimumGeneCount, int maximumGeneCount,
+								int sizeStep, int stride) {
+	WorkUnits result;
+	result.arena = sampler.genes();
+	for (int size = minimumGeneCount; size <= maximumGeneCount;
+		 size += sizeStep) {
+		for (const int start : sampler.windowStarts(size, stride)) {
+			WorkUnit workUnit;
+			workUnit.firstGene = start;
+			workUnit.geneCount = size;
+			result.units.push_back(workUnit);
+		}
+	}
+
+	const Vec3D *positions = pool.positions.constData();
+	const GeneIndex *arena = result.arena.constData();
+	WorkUnit *units = result.units.data();
+#pragma omp parallel for schedule(dynamic, 64)
+	for (int i = 0; i < result.size(); i++) {
+		WorkUnit &workUnit = units[i];
+		const GeneIndex *ids = arena + workUnit.firstGene;
+		Vec3D center;
+		for (int k = 0; k < workUnit.geneCount; k++) {
+			center += positions[ids[k]];
+		}
+		center = center * (1.0 / (double)workUnit.geneCount);
+		double radiusSquared = 0.0;
+		for (int k = 0; k < workUnit.geneCount; k++) {
+			radiusSquared = std::max(
+				radiusSquared, Vec3D::distanceSquared(center, positions[ids[k]]));
+		}
+		workUnit.center = center;
+		workUnit.radius = sqrt(radiusSquared);
+	}
 
 	return result;
 }
 
-// Adjusts p-values and reorders all work units.
-template <class Gene> void benjamini(QVector<WorkUnit<Gene>> &workUnits) {
-	// Sort p-values from smaller to larger
-	auto pValueCompare = [](const WorkUnit<Gene> &a, const WorkUnit<Gene> &b) {
-		return a.pValue < b.pValue;
+// How well a set of work units covers the genes, in the order the units were
+// created. Compare center sequences by the number of spheres they need to
+// reach the same coverage.
+struct SphereCoverage {
+	// Index of the first unit containing each gene, or -1
+	QVector<int> firstCoveringUnit;
+
+	// Number of units containing each gene
+	QVector<int> unitsPerGene;
+
+	// Average number of units containing a gene
+	double averageUnitsPerGene = 0.0;
+
+	double coveredFraction() const {
+		const int uncovered = (int)std::count(firstCoveringUnit.constBegin(),
+											  firstCoveringUnit.constEnd(), -1);
+		return 1.0 - (double)uncovered /
+						 (double)std::max(1, firstCoveringUnit.size());
+	}
+
+	// How many units it took to cover this fraction of all genes, or -1 if
+	// the units never did.
+	int unitsToCover(double fraction) const {
+		QVector<int> sorted;
+		for (int unit : firstCoveringUnit) {
+			if (unit >= 0)
+				sorted.push_back(unit);
+		}
+		const int needed =
+			(int)std::ceil(fraction * (double)firstCoveringUnit.size());
+		if (needed <= 0)
+			return 0;
+		if (needed > sorted.size())
+			return -1;
+		std::nth_element(sorted.begin(), sorted.begin() + needed - 1,
+						 sorted.end());
+		return sorted[needed - 1] + 1;
+	}
+
+	void print() const {
+		printf("Sphere coverage: %.1f%% of genes, %.1f spheres per gene",
+			   100.0 * coveredFraction(), averageUnitsPerGene);
+		const double fractions[] = {0.5, 0.9, 0.99};
+		for (double fraction : fractions) {
+			const int units = unitsToCover(fraction);
+			if (units >= 0)
+				printf(", %g%% after %d", 100.0 * fraction, units);
+		}
+		printf("\n");
+	}
+
+	// Genes by the number of units containing them, in buckets of 0, 1, 2-3,
+	// 4-7 and so on.
+	void printHistogram() const {
+		QVector<int> buckets;
+		for (int units : unitsPerGene) {
+			int bucket = 0;
+			while (units > 0) {
+				bucket++;
+				units >>= 1;
+			}
+			if (bucket >= buckets.size())
+				buckets.resize(bucket + 1);
+			buckets[bucket]++;
+		}
+		printf("Genes by spheres containing them:");
+		for (int bucket = 0; bucket < buckets.size(); bucket++) {
+			const int low = bucket == 0 ? 0 : 1 << (bucket - 1);
+			const int high = bucket == 0 ? 0 : (1 << bucket) - 1;
+			const char *separator = bucket == 0 ? " " : ", ";
+			if (low == high)
+				printf("%s%d: %d", separator, low, buckets[bucket]);
+			else
+				printf("%s%d-%d: %d", separator, low, high, buckets[bucket]);
+		}
+		printf("\n");
+	}
+};
+
+inline SphereCoverage sphereCoverage(int poolSize, const WorkUnits &workUnits) {
+	SphereCoverage result;
+	result.firstCoveringUnit.fill(-1, poolSize);
+	result.unitsPerGene.fill(0, poolSize);
+	qint64 memberships = 0;
+	for (int i = 0; i < workUnits.size(); i++) {
+		const WorkUnit &workUnit = workUnits[i];
+		for (const GeneIndex *id = workUnits.genesBegin(workUnit);
+			 id != workUnits.genesEnd(workUnit); id++) {
+			if (result.firstCoveringUnit[*id] < 0)
+				result.firstCoveringUnit[*id] = i;
+			result.unitsPerGene[*id]++;
+		}
+		memberships += workUnit.geneCount;
+	}
+	result.averageUnitsPerGene =
+		(double)memberships / (double)std::max(1, poolSize);
+	return result;
+}
+
+// Calculates the statistic in every sphere from its genes.
+template <class Gene>
+void calculateStatisticsInSpheres(const GenePool<Gene> &pool,
+								  WorkUnits &workUnits) {
+	const Gene *genes = pool.genes.constData();
+	WorkUnit *units = workUnits.units.data();
+
+#pragma omp parallel for schedule(dynamic, 16)
+	for (int i = 0; i < workUnits.size(); i++) {
+		WorkUnit &workUnit = units[i];
+		workUnit.statisticInSphere = sphereTestStatistic(
+			genes, workUnits.genesBegin(workUnit), workUnit.geneCount);
+	}
+}
+
+// Same, from the centers and radii of the spheres, with the aggregates of an
+// octree. The accumulator's statistic() gives the statistic.
+template <class Gene, class Aggregate>
+void calculateStatisticsInSpheres(
+	const AggregateOctree<Gene, Aggregate> &octree, WorkUnits &workUnits) {
+	WorkUnit *units = workUnits.units.data();
+
+#pragma omp parallel for schedule(dynamic, 16)
+	for (int i = 0; i < workUnits.size(); i++) {
+		WorkUnit &workUnit = units[i];
+		workUnit.statisticInSphere =
+			octree.query(workUnit.center, workUnit.radius).statistic();
+	}
+}
+
+// Calculates the statistic in every window made by createWindowWorkUnits().
+// A window overlapping the previous one of the same size is not rebuilt: the
+// accumulator drops the genes that left, oldest first, and adds those that
+// came in. Besides clear(), add() and statistic() (see growRandomSet()), the
+// accumulator must then provide
+//	void remove(const Gene *genes, GeneIndex id);
+// which undoes the add() of any gene still in the set; windows remove the
+// oldest first, but SphereSearch.h removes them in any order. Runs of sliding
+// windows are cut every slideLimit steps and rebuilt, which bounds rounding
+// drift and lets the runs spread over threads.
+template <class Accumulator, class Gene>
+void calculateWindowStatistics(const GenePool<Gene> &pool,
+							   WorkUnits &workUnits, int slideLimit = 256) {
+	const Gene *genes = pool.genes.constData();
+	const GeneIndex *arena = workUnits.arena.constData();
+	WorkUnit *units = workUnits.units.data();
+
+	// First unit of every run
+	QVector<int> runStarts;
+	for (int i = 0; i < workUnits.size(); i++) {
+		const bool slides =
+			i > 0 && i - runStarts.back() < slideLimit &&
+			units[i].geneCount == units[i - 1].geneCount &&
+			units[i].firstGene > units[i - 1].firstGene &&
+			units[i].firstGene - units[i - 1].firstGene < units[i].geneCount;
+		if (!slides)
+			runStarts.push_back(i);
+	}
+	runStarts.push_back(workUnits.size());
+
+#pragma omp parallel
+	{
+		Accumulator accumulator;
+#pragma omp for schedule(dynamic)
+		for (int r = 0; r < runStarts.size() - 1; r++) {
+			for (int i = runStarts[r]; i < runStarts[r + 1]; i++) {
+				WorkUnit &workUnit = units[i];
+				const int end = workUnit.firstGene + workUnit.geneCount;
+				if (i == runStarts[r]) {
+					accumulator.clear();
+					for (int k = workUnit.firstGene; k < end; k++) {
+						accumulator.add(genes, arena[k]);
+					}
+				} else {
+					const WorkUnit &previous = units[i - 1];
+					const int previousEnd =
+						previous.firstGene + previous.geneCount;
+					for (int k = previous.firstGene; k < workUnit.firstGene;
+						 k++) {
+						accumulator.remove(genes, arena[k]);
+					}
+					for (int k = previousEnd; k < end; k++) {
+						accumulator.add(genes, arena[k]);
+					}
+				}
+				workUnit.statisticInSphere = accumulator.statistic();
+			}
+		}
+	}
+}
+
+// Random-set statistics for every gene count found in a set of work units.
+// Spheres of the same size can share one null distribution, so instead of
+// drawing random sets per sphere we draw them once per distinct gene count.
+//
+// GeneCountSlots numbers the distinct gene counts of the work units; the null
+// of each gene count is then kept in the slot of that number.
+struct GeneCountSlots {
+	// Distinct gene counts, ascending
+	QVector<int> geneCounts;
+
+	// Gene count -> slot, or -1 if there is no slot
+	QVector<int> slotOfGeneCount;
+
+	int slotCount() const { return geneCounts.size(); }
+
+	// Sets up one slot per distinct gene count of the work units, or of the
+	// selected work units only.
+	void prepareSlots(const WorkUnits &workUnits,
+					  const QVector<int> *selection = nullptr) {
+		QVector<int> neededGeneCounts;
+		if (selection) {
+			for (const int i : *selection) {
+				neededGeneCounts.push_back(workUnits[i].geneCount);
+			}
+		} else {
+			for (const WorkUnit &workUnit : workUnits.units) {
+				neededGeneCounts.push_back(workUnit.geneCount);
+			}
+		}
+
+		int maximumGeneCount = 0;
+		for (const int geneCount : neededGeneCounts) {
+			maximumGeneCount = std::max(maximumGeneCount, geneCount);
+		}
+		slotOfGeneCount.fill(-1, maximumGeneCount + 1);
+		for (const int geneCount : neededGeneCounts) {
+			slotOfGeneCount[geneCount] = 0;
+		}
+		geneCounts.clear();
+		for (int k = 0; k < slotOfGeneCount.size(); k++) {
+			if (slotOfGeneCount[k] < 0)
+				continue;
+			slotOfGeneCount[k] = geneCounts.size();
+			geneCounts.push_back(k);
+		}
+	}
+};
+
+struct NullTables : GeneCountSlots {
+	// One table per slot, sorted ascending
+	QVector<QVector<double>> tables;
+
+	// Generalized Pareto fits of both tails of every table, if fitTails() was
+	// called. Lower tails are fitted on negated values.
+	QVector<TailFit::Fit> lowerTails;
+	QVector<TailFit::Fit> upperTails;
+	TailFit::Options tailOptions;
+
+	// Sets up one empty table per distinct gene count.
+	void prepare(const WorkUnits &workUnits,
+				 const QVector<int> *selection = nullptr) {
+		prepareSlots(workUnits, selection);
+		tables.clear();
+		tables.resize(slotCount());
+	}
+
+	const QVector<double> &table(int geneCount) const {
+		return tables[slotOfGeneCount[geneCount]];
+	}
+
+	// Fits both tails of every (sorted) table, so calculatePValues() can give
+	// p-values smaller than one over the table size.
+	TailFit::Report fitTails(const TailFit::Options &options = TailFit::Options()) {
+		tailOptions = options;
+		lowerTails.resize(tables.size());
+		upperTails.resize(tables.size());
+#pragma omp parallel for schedule(dynamic)
+		for (int slot = 0; slot < tables.size(); slot++) {
+			const QVector<double> &table = tables[slot];
+			lowerTails[slot] =
+				TailFit::fitLowerTail(table.constData(), table.size(), options);
+			upperTails[slot] =
+				TailFit::fitUpperTail(table.constData(), table.size(), options);
+		}
+
+		TailFit::Report report;
+		for (int slot = 0; slot < tables.size(); slot++) {
+			report.add(lowerTails[slot]);
+			report.add(upperTails[slot]);
+		}
+		return report;
+	}
+
+	bool hasTails() const { return !upperTails.isEmpty(); }
+};
+
+// Grows one random set from one gene up to the largest gene count of the
+// slots, and records its statistic whenever the set reaches one of them. The
+// set of size k+1 extends the one of size k.
+//
+// Accumulator holds the running state of one random set and must provide:
+//	void clear();
+//	void add(const Gene *genes, GeneIndex id);
+//	double statistic() const; // same value sphereTestStatistic() would give
+template <class Accumulator, class Gene, class Record>
+void growRandomSet(const Gene *genes, const GeneCountSlots &slots,
+				   ThreadState &state, Accumulator &accumulator,
+				   Record record) {
+	accumulator.clear();
+	const int *geneCounts = slots.geneCounts.constData();
+	const int largestGeneCount = slots.geneCounts.back();
+	int slot = 0;
+	for (int k = 1; k <= largestGeneCount; k++) {
+		accumulator.add(genes, (GeneIndex)state.randomSampler.random());
+		if (k == geneCounts[slot]) {
+			record(slot, accumulator.statistic());
+			slot++;
+		}
+	}
+}
+
+// Fills the null tables of all gene counts found in the work units with
+// sampleCount random-set statistics each, sorted ascending. Each random set is
+// grown by growRandomSet(), so all tables together cost about as much as the
+// largest one alone. Tables of different sizes are therefore not independent
+// of each other; each one on its own is still a proper sample of random sets
+// of its size. If a selection is given, only the gene counts of the selected
+// units get a table.
+template <class Accumulator, class Gene>
+NullTables buildNestedNullTables(const GenePool<Gene> &pool,
+								 const WorkUnits &workUnits, int sampleCount,
+								 const QVector<int> *selection = nullptr) {
+	NullTables result;
+	result.prepare(workUnits, selection);
+	if (result.geneCounts.isEmpty())
+		return result;
+
+	// Grab raw pointers up front, so threads never touch the QVectors
+	QVector<double *> tables(result.tables.size());
+	for (int slot = 0; slot < tables.size(); slot++) {
+		result.tables[slot].resize(sampleCount);
+		tables[slot] = result.tables[slot].data();
+	}
+
+	const Gene *genes = pool.genes.constData();
+
+#pragma omp parallel
+	{
+		ThreadState state(pool.size());
+		Accumulator accumulator;
+#pragma omp for schedule(static)
+		for (int r = 0; r < sampleCount; r++) {
+			growRandomSet(genes, result, state, accumulator,
+						  [&](int slot, double statistic) {
+							  tables[slot][r] = statistic;
+						  });
+		}
+
+#pragma omp for schedule(dynamic)
+		for (int slot = 0; slot < tables.size(); slot++) {
+			std::sort(tables[slot], tables[slot] + sampleCount);
+		}
+	}
+
+	return result;
+}
+
+// Whether low values of the statistic are the extreme ones, as defined by
+// Gene::randomIsMoreExtreme().
+template <class Gene> bool lowerIsMoreExtreme() {
+	return Gene::randomIsMoreExtreme(0.0, 1.0);
+}
+
+// Null distributions summarized by t-digests instead of full tables. Memory
+// per gene count is bounded by the digest compression, whatever the sample
+// count, at the price of approximate p-values away from the extreme tails.
+struct NullSketches : GeneCountSlots {
+	QVector<TDigest> sketches;
+
+	int sampleCount = 0;
+
+	int byteSize() const {
+		int result = 0;
+		for (const TDigest &sketch : sketches) {
+			result += sketch.byteSize();
+		}
+		return result;
+	}
+};
+
+// Same as buildNestedNullTables(), summarizing the random statistics in one
+// t-digest per gene count. Every thread fills its own digests; at the end
+// each gene count is merged by exactly one thread, so no locking is needed.
+template <class Accumulator, class Gene>
+NullSketches buildNestedNullSketches(const GenePool<Gene> &pool,
+									 const WorkUnits &workUnits,
+									 int sampleCount,
+									 double compression = 500.0) {
+	NullSketches result;
+	result.prepareSlots(workUnits);
+	result.sampleCount = sampleCount;
+	result.sketches.fill(TDigest(compression), result.slotCount());
+	if (result.slotCount() == 0)
+		return result;
+
+	const Gene *genes = pool.genes.constData();
+	QVector<QVector<TDigest>> threadSketches(Scheduler::threadCount());
+
+#pragma omp parallel
+	{
+		int thread = 0;
+#ifdef _OPENMP
+		thread = omp_get_thread_num();
+#endif
+		QVector<TDigest> &sketches = threadSketches[thread];
+		sketches.fill(TDigest(compression), result.slotCount());
+
+		ThreadState state(pool.size());
+		Accumulator accumulator;
+#pragma omp for schedule(static)
+		for (int r = 0; r < sampleCount; r++) {
+			growRandomSet(genes, result, state, accumulator,
+						  [&](int slot, double statistic) {
+							  sketches[slot].add(statistic);
+						  });
+		}
+
+		// Implicit barrier above: all threads are done sampling
+#pragma omp for schedule(dynamic)
+		for (int slot = 0; slot < result.slotCount(); slot++) {
+			for (QVector<TDigest> &perThread : threadSketches) {
+				if (perThread.isEmpty())
+					continue;
+				perThread[slot].compress();
+				result.sketches[slot].merge(perThread[slot]);
+			}
+		}
+	}
+
+	return result;
+}
+
+// Calculates the p-values of all work units against null sketches. The count
+// of more extreme random statistics is estimated from the digest. The
+// statistics in the spheres must have been calculated.
+template <class Gene>
+void calculatePValues(WorkUnits &workUnits, const NullSketches &nullSketches) {
+	WorkUnit *units = workUnits.units.data();
+	const bool lower = lowerIsMoreExtreme<Gene>();
+	const int sampleCount = nullSketches.sampleCount;
+
+#pragma omp parallel for schedule(dynamic, 16)
+	for (int i = 0; i < workUnits.size(); i++) {
+		WorkUnit &workUnit = units[i];
+		const TDigest &sketch =
+			nullSketches
+				.sketches[nullSketches.slotOfGeneCount[workUnit.geneCount]];
+		const double x = workUnit.statisticInSphere;
+
+		// At most x for the lower tail, at least x for the upper one
+		const double moreExtreme =
+			lower ? sketch.cdf(x)
+				  : 1.0 - sketch.cdf(std::nextafter(
+							  x, -std::numeric_limits<double>::infinity()));
+		const double moreExtremeOccurrences = moreExtreme * sampleCount;
+		workUnit.chanceWinCount = (int)std::round(moreExtremeOccurrences);
+
+		workUnit.pValue =
+			Gene::calculatePValue(moreExtremeOccurrences, sampleCount);
+
+		// Give benefit of the doubt to chance: replace zero pValues with the
+		// smallest we can safely say
+		workUnit.pValue = std::max(workUnit.pValue, 1.0 / (double)sampleCount);
+	}
+}
+
+// Estimates how many of the random statistics of a table are at least as
+// extreme as the one in the sphere, from the fitted tails. Only used where
+// counting gives fewer than tailOptions.minimumChanceWins, or fewer than that
+// many are less extreme, which matters to double-tailed tests. Returns false
+// if the fit can not be used here.
+template <class Gene>
+bool estimateMoreExtreme(const NullTables &nullTables, int slot,
+						 double statisticInSphere, int chanceWinCount,
+						 double *moreExtremeOccurrences) {
+	const int sampleCount = nullTables.tables[slot].size();
+	const int minimumChanceWins = nullTables.tailOptions.minimumChanceWins;
+	const bool lower = lowerIsMoreExtreme<Gene>();
+
+	// Pick the tail the sphere is in, with the statistic mirrored for lower
+	// tails.
+	const TailFit::Fit *fit = nullptr;
+	double x = 0.0;
+	bool countsMoreExtreme = true;
+	if (chanceWinCount < minimumChanceWins) {
+		fit = lower ? &nullTables.lowerTails[slot] : &nullTables.upperTails[slot];
+		x = lower ? -statisticInSphere : statisticInSphere;
+	} else if (sampleCount - chanceWinCount < minimumChanceWins) {
+		fit = lower ? &nullTables.upperTails[slot] : &nullTables.lowerTails[slot];
+		x = lower ? statisticInSphere : -statisticInSphere;
+		countsMoreExtreme = false;
+	} else {
+		return false;
+	}
+
+	if (!fit->valid || x <= fit->threshold)
+		return false;
+	const double tailProbability = fit->tailProbability(x);
+	if (tailProbability <= 0.0)
+		return false; // beyond the end point of the fit
+
+	const double tailOccurrences = tailProbability * (double)sampleCount;
+	*moreExtremeOccurrences = countsMoreExtreme
+								  ? tailOccurrences
+								  : (double)sampleCount - tailOccurrences;
+	return true;
+}
+
+// Counts the random statistics that are at least as extreme as the one in
+// the sphere. The table must be sorted ascending: "more extreme" is then
+// either a prefix or a suffix of it, found by binary search.
+template <class Gene>
+int countMoreExtreme(const QVector<double> &sortedTable,
+					 double statisticInSphere) {
+	if (sortedTable.isEmpty())
+		return 0;
+
+	auto moreExtreme = [&](double statisticInRandom) {
+		return Gene::randomIsMoreExtreme(statisticInRandom, statisticInSphere);
 	};
-	std::sort(workUnits.begin(), workUnits.end(), pValueCompare);
+	if (moreExtreme(sortedTable.front())) {
+		return std::partition_point(sortedTable.begin(), sortedTable.end(),
+									moreExtreme) -
+			   sortedTable.begin();
+	}
+	return sortedTable.end() -
+		   std::partition_point(
+			   sortedTable.begin(), sortedTable.end(),
+			   [&](double statisticInRandom) {
+				   return !moreExtreme(statisticInRandom);
+			   });
+}
+
+// Calculates the p-values of all work units, or of the selected ones only,
+// against prebuilt null tables. The statistics in the spheres must have been
+// calculated. If the tables have fitted tails, units in the far tails get
+// their p-value from the fit. Returns how many did.
+template <class Gene>
+int calculatePValues(WorkUnits &workUnits, const NullTables &nullTables,
+					 const QVector<int> *selection = nullptr) {
+	WorkUnit *units = workUnits.units.data();
+	const int count = selection ? selection->size() : workUnits.size();
+	int fittedCount = 0;
+
+#pragma omp parallel for schedule(dynamic, 16) reduction(+ : fittedCount)
+	for (int s = 0; s < count; s++) {
+		WorkUnit &workUnit = units[selection ? (*selection)[s] : s];
+
+		// Random samples
+		const QVector<double> &table = nullTables.table(workUnit.geneCount);
+		workUnit.chanceWinCount =
+			countMoreExtreme<Gene>(table, workUnit.statisticInSphere);
+
+		double moreExtremeOccurrences = 0.0;
+		if (nullTables.hasTails() &&
+			estimateMoreExtreme<Gene>(
+				nullTables, nullTables.slotOfGeneCount[workUnit.geneCount],
+				workUnit.statisticInSphere, workUnit.chanceWinCount,
+				&moreExtremeOccurrences)) {
+			workUnit.pValue =
+				Gene::calculatePValue(moreExtremeOccurrences, table.size());
+			fittedCount++;
+			continue;
+		}
+
+		workUnit.pValue =
+			Gene::calculatePValue(workUnit.chanceWinCount, table.size());
+
+		// Give benefit of the doubt to chance: replace zero pValues with the
+		// smallest we can safely say
+		workUnit.pValue = std::max(workUnit.pValue, 1.0 / (double)table.size());
+	}
+
+	return fittedCount;
+}
+
+// Adjusts p-values. Work units stay where they are; the returned permutation
+// lists them from smaller to larger p-value.
+inline QVector<int> benjamini(WorkUnits &workUnits) {
+	QVector<int> order(workUnits.size());
+	for (int i = 0; i < order.size(); i++) {
+		order[i] = i;
+	}
+	if (order.isEmpty())
+		return order;
+
+	// Sort p-values from smaller to larger
+	std::sort(order.begin(), order.end(), [&](int a, int b) {
+		return workUnits[a].pValue < workUnits[b].pValue;
+	});
 
 	// Apply Benjamini-Hochberg correction
-	double previousPValue = workUnits.back().pValue;
-	for (int i = workUnits.size() - 1; i >= 0; i--) {
-		WorkUnit<Gene> &workUnit = workUnits[i];
+	double previousPValue = workUnits[order.back()].pValue;
+	for (int i = order.size() - 1; i >= 0; i--) {
+		WorkUnit &workUnit = workUnits[order[i]];
 		workUnit.rank = i + 1;
 		workUnit.adjustedPValue =
 			std::min(previousPValue, workUnit.pValue * workUnits.size() /
 										 (double)workUnit.rank);
 		previousPValue = workUnit.adjustedPValue;
 	}
+
+	return order;
+}
+
+// Orders work units by p-value, like benjamini(), for p-values which are
+// family-wise already, such as those from a max-statistic null. The adjusted
+// p-value is the p-value itself.
+inline QVector<int> familyWiseOrder(WorkUnits &workUnits) {
+	QVector<int> order(workUnits.size());
+	for (int i = 0; i < order.size(); i++) {
+		order[i] = i;
+	}
+	std::stable_sort(order.begin(), order.end(), [&](int a, int b) {
+		return workUnits[a].pValue < workUnits[b].pValue;
+	});
+	for (int i = 0; i < order.size(); i++) {
+		WorkUnit &workUnit = workUnits[order[i]];
+		workUnit.rank = i + 1;
+		workUnit.adjustedPValue = workUnit.pValue;
+	}
+	return order;
+}
+
+// Keeps the work units of the ordering whose adjusted p-value passes the
+// threshold. Order is preserved.
+inline QVector<int> filterByAdjustedPValue(const WorkUnits &workUnits,
+										   const QVector<int> &order,
+										   double pAdjThreshold) {
+	QVector<int> result;
+	for (const int i : order) {
+		if (workUnits[i].adjustedPValue <= pAdjThreshold)
+			result.push_back(i);
+	}
+	return result;
+}
+
+// Mean and standard deviation of the statistic of random sets, by gene count,
+// for comparing sets of different sizes by z-score. Estimated from nested
+// random sets, like the nested null tables.
+struct GeneCountMoments {
+	QVector<double> means;
+	QVector<double> deviations;
+
+	int largestGeneCount() const { return means.size() - 1; }
+
+	double zScore(int geneCount, double statistic) const {
+		const double deviation = deviations[geneCount];
+		if (deviation <= 0.0)
+			return 0.0;
+		return (statistic - means[geneCount]) / deviation;
+	}
+};
+
+template <class Accumulator, class Gene>
+GeneCountMoments geneCountMoments(const GenePool<Gene> &pool,
+								  int largestGeneCount, int sampleCount) {
+	GeneCountSlots slots;
+	for (int k = 1; k <= largestGeneCount; k++) {
+		slots.geneCounts.push_back(k);
+	}
+
+	// Welford's running mean and sum of squared deviations per gene count,
+	// per thread, then combined
+	QVector<double> means(largestGeneCount + 1, 0.0);
+	QVector<double> squaredDeviations(largestGeneCount + 1, 0.0);
+	int setCount = 0;
+	const Gene *genes = pool.genes.constData();
+
+#pragma omp parallel
+	{
+		ThreadState state(pool.size());
+		Accumulator accumulator;
+		QVector<double> threadMeans(largestGeneCount + 1, 0.0);
+		QVector<double> threadSquaredDeviations(largestGeneCount + 1, 0.0);
+		int threadSetCount = 0;
+#pragma omp for schedule(static)
+		for (int r = 0; r < sampleCount; r++) {
+			threadSetCount++;
+			growRandomSet(genes, slots, state, accumulator,
+						  [&](int slot, double statistic) {
+							  const int k = slot + 1;
+							  const double meanDiff =
+								  statistic - threadMeans[k];
+							  threadMeans[k] += meanDiff / threadSetCount;
+							  threadSquaredDeviations[k] +=
+								  meanDiff * (statistic - threadMeans[k]);
+						  });
+		}
+#pragma omp critical
+		if (threadSetCount > 0) {
+			const int total = setCount + threadSetCount;
+			for (int k = 1; k <= largestGeneCount; k++) {
+				const double meanDiff = threadMeans[k] - means[k];
+				means[k] += meanDiff * threadSetCount / total;
+				squaredDeviations[k] += threadSquaredDeviations[k] +
+										meanDiff * meanDiff * setCount *
+											threadSetCount / total;
+			}
+			setCount = total;
+		}
+	}
+
+	GeneCountMoments result;
+	result.means = means;
+	result.deviations.fill(0.0, largestGeneCount + 1);
+	for (int k = 1; k <= largestGeneCount && setCount > 0; k++) {
+		result.deviations[k] = sqrt(squaredDeviations[k] / setCount);
+	}
+	return result;
+}
+
+// Largest gene count of the work units
+inline int largestGeneCount(const WorkUnits &workUnits) {
+	int result = 0;
+	for (const WorkUnit &workUnit : workUnits.units) {
+		result = std::max(result, workUnit.geneCount);
+	}
+	return result;
 }
 
-// Given a list of work units, it combines the overlapping spheres into clusters
+// Orders work units along a Z-order curve of their centers, so that units
+// next to each other in the order are mostly close in space and share genes.
+inline QVector<int> zOrderOfCenters(const WorkUnits &workUnits) {
+	QVector<int> result(workUnits.size());
+	if (workUnits.isEmpty())
+		return result;
+
+	Vec3D low = workUnits[0].center;
+	Vec3D high = low;
+	for (const WorkUnit &workUnit : workUnits.units) {
+		const Vec3D &c = workUnit.center;
+		low = Vec3D(std::min(low.x, c.x), std::min(low.y, c.y),
+					std::min(low.z, c.z));
+		high = Vec3D(std::max(high.x, c.x), std::max(high.y, c.y),
+					 std::max(high.z, c.z));
+	}
+
+	// 10 bits per axis, interleaved
+	const int cellsPerAxis = 1 << 10;
+	auto cell = [&](double value, double minimum, double maximum) {
+		if (maximum <= minimum)
+			return 0;
+		const int c = (int)((value - minimum) / (maximum - minimum) *
+							(double)cellsPerAxis);
+		return std::min(cellsPerAxis - 1, std::max(0, c));
+	};
+	QVector<quint64> keys(workUnits.size());
+	for (int i = 0; i < workUnits.size(); i++) {
+		const Vec3D &c = workUnits[i].center;
+		const int x = cell(c.x, low.x, high.x);
+		const int y = cell(c.y, low.y, high.y);
+		const int z = cell(c.z, low.z, high.z);
+		quint64 key = 0;
+		for (int bit = 0; bit < 10; bit++) {
+			key |= (quint64)((x >> bit) & 1) << (3 * bit);
+			key |= (quint64)((y >> bit) & 1) << (3 * bit + 1);
+			key |= (quint64)((z >> bit) & 1) << (3 * bit + 2);
+		}
+		keys[i] = key;
+		result[i] = i;
+	}
+	std::stable_sort(result.begin(), result.end(),
+					 [&](int a, int b) { return keys[a] < keys[b]; });
+	return result;
+}
+
+// Kulldorff-style scan test. Rather than a Monte Carlo p-value per sphere and
+// a Benjamini-Hochberg correction, the gene memberships of the spheres stay
+// fixed and each replicate permutes the genes' records over them. A replicate
+// keeps the most extreme z-score over all spheres; ranked against these
+// maxima, every sphere gets a family-wise p-value from one shared null.
+//
+// A permutation only renames gene IDs, so replicates map the IDs of each
+// sphere through it and the gene records stay shared and unshuffled. Since the
+// memberships are fixed, the spheres are visited in Z-order of their centers
+// and the genes that leave and enter the set from one sphere to the next are
+// worked out once, for all replicates. A replicate then only removes and adds
+// those genes in its accumulator, which must provide remove() as for
+// calculateWindowStatistics(). A sphere is built from scratch when its delta
+// is no smaller than the sphere, and every rebuildLimit spheres, which bounds
+// rounding drift. Replicates run in parallel. Returns the maxima, sorted.
+template <class Accumulator, class Gene>
+QVector<double> scanNullMaxima(const GenePool<Gene> &pool,
+							   const WorkUnits &workUnits,
+							   const GeneCountMoments &moments,
+							   int replicateCount, int rebuildLimit = 256) {
+	if (largestGeneCount(workUnits) > moments.largestGeneCount())
+		throw(QString("scanNullMaxima(): no moments for %1 genes")
+				  .arg(largestGeneCount(workUnits)));
+
+	// Step s visits unit order[s]: the genes in stepGenes from stepStarts[s]
+	// to enteringStarts[s] leave the set, those from there to
+	// stepStarts[s + 1] enter it. The set is emptied first on rebuilds.
+	const QVector<int> order = zOrderOfCenters(workUnits);
+	QVector<GeneIndex> stepGenes;
+	QVector<int> stepStarts(order.size() + 1);
+	QVector<int> enteringStarts(order.size());
+	QVector<char> rebuilds(order.size());
+	QVector<GeneIndex> previousGenes;
+	QVector<GeneIndex> currentGenes;
+	int stepsSinceRebuild = 0;
+	for (int s = 0; s < order.size(); s++) {
+		const WorkUnit &workUnit = workUnits[order[s]];
+		currentGenes.resize(0);
+		std::copy(workUnits.genesBegin(workUnit), workUnits.genesEnd(workUnit),
+				  std::back_inserter(currentGenes));
+		// Windows are in genome order; spheres are sorted already
+		std::sort(currentGenes.begin(), currentGenes.end());
+
+		stepStarts[s] = stepGenes.size();
+		bool rebuild = s == 0 || stepsSinceRebuild >= rebuildLimit;
+		if (!rebuild) {
+			std::set_difference(
+				previousGenes.constBegin(), previousGenes.constEnd(),
+				currentGenes.constBegin(), currentGenes.constEnd(),
+				std::back_inserter(stepGenes));
+			enteringStarts[s] = stepGenes.size();
+			std::set_difference(
+				currentGenes.constBegin(), currentGenes.constEnd(),
+				previousGenes.constBegin(), previousGenes.constEnd(),
+				std::back_inserter(stepGenes));
+			rebuild = stepGenes.size() - stepStarts[s] >= currentGenes.size();
+			if (rebuild)
+				stepGenes.resize(stepStarts[s]);
+		}
+		if (rebuild) {
+			enteringStarts[s] = stepStarts[s];
+			stepGenes += currentGenes;
+			stepsSinceRebuild = 0;
+		} else {
+			stepsSinceRebuild++;
+		}
+		rebuilds[s] = rebuild;
+		std::swap(previousGenes, currentGenes);
+	}
+	stepStarts[order.size()] = stepGenes.size();
+
+	QVector<double> result(replicateCount,
+						   -std::numeric_limits<double>::infinity());
+	double *maxima = result.data();
+	const Gene *genes = pool.genes.constData();
+	const bool lower = lowerIsMoreExtreme<Gene>();
+
+	// Every replicate shuffles the identity with its own seed, so its
+	// permutation does not depend on which thread ran it or on what that
+	// thread ran before.
+	const QVector<GeneIndex> identity = pool.allIds();
+
+#pragma omp parallel
+	{
+		QVector<GeneIndex> permutation(identity.size());
+		Accumulator accumulator;
+#pragma omp for schedule(dynamic, 1)
+		for (int r = 0; r < replicateCount; r++) {
+			std::copy(identity.constBegin(), identity.constEnd(),
+					  permutation.begin());
+			std::default_random_engine generator(r + 1);
+			std::shuffle(permutation.begin(), permutation.end(), generator);
+
+			double maximum = -std::numeric_limits<double>::infinity();
+			for (int s = 0; s < order.size(); s++) {
+				if (rebuilds[s])
+					accumulator.clear();
+				for (int k = stepStarts[s]; k < enteringStarts[s]; k++) {
+					accumulator.remove(genes, permutation[stepGenes[k]]);
+				}
+				for (int k = enteringStarts[s]; k < stepStarts[s + 1]; k++) {
+					accumulator.add(genes, permutation[stepGenes[k]]);
+				}
+				const double z = moments.zScore(workUnits[order[s]].geneCount,
+												accumulator.statistic());
+				maximum = std::max(maximum, lower ? -z : z);
+			}
+			maxima[r] = maximum;
+		}
+	}
+
+	std::sort(result.begin(), result.end());
+	return result;
+}
+
+// Gives every work unit its family-wise p-value against the sorted maxima of
+// scanNullMaxima(). The statistics in the spheres must have been calculated.
 template <class Gene>
-QVector<QSet<QString>>
-clusterByGeneOverlap(const QVector<WorkUnit<Gene>> &workUnits,
-					 double overlapThreshold, double *maximumOverlapRatio) {
-	using GeneList = QSet<QString>;
-	QVector<GeneList> result;
-	for (const WorkUnit<Gene> &workUnit : workUnits) {
-		GeneList genes;
-		for (const Gene *gene : workUnit.genesInSphere) {
-			genes.insert(gene->name);
+void calculateScanPValues(WorkUnits &workUnits,
+						  const GeneCountMoments &moments,
+						  const QVector<double> &sortedMaxima) {
+	const bool lower = lowerIsMoreExtreme<Gene>();
+	for (WorkUnit &workUnit : workUnits.units) {
+		const double z =
+			moments.zScore(workUnit.geneCount, workUnit.statisticInSphere);
+		workUnit.chanceWinCount =
+			sortedMaxima.constEnd() - std::lower_bound(sortedMaxima.constBegin(),
+													   sortedMaxima.constEnd(),
+													   lower ? -z : z);
+		workUnit.pValue = (double)(workUnit.chanceWinCount + 1) /
+						  (double)(sortedMaxima.size() + 1);
+	}
+}
+
+// Mean and variance of a pairwise-average statistic (average of a symmetric
+// kernel h over all pairs of a set) when the k genes of the set are drawn at
+// random with replacement, as our random samplers do. The statistic is a
+// U-statistic, so by Hoeffding's decomposition its variance only depends on:
+//	zeta1 = Var(E[h(X, Y) | X])
+//	zeta2 = Var(h(X, Y))
+// Both are global moments of the kernel matrix, computed once for all k.
+struct PairwiseNullMoments {
+	double mean = 0.0;
+	double zeta1 = 0.0;
+	double zeta2 = 0.0;
+
+	double variance(int k) const {
+		if (k < 2)
+			return 0.0;
+		return 2.0 / ((double)k * (k - 1)) * (2.0 * (k - 2) * zeta1 + zeta2);
+	}
+
+	double zScore(double statistic, int k) const {
+		const double sd = sqrt(variance(k));
+		return sd > 0.0 ? (statistic - mean) / sd : 0.0;
+	}
+};
+
+// Computes the null moments from kernel(a, b), which must be symmetric and
+// defined for all gene IDs of the pool, including a == b. This is O(n^2) in
+// the pool size.
+template <class Kernel>
+PairwiseNullMoments pairwiseNullMoments(int poolSize, Kernel kernel) {
+	PairwiseNullMoments result;
+	if (poolSize <= 0)
+		return result;
+
+	const double n = (double)poolSize;
+	double sum = 0.0;
+	double sumOfSquares = 0.0;
+	double sumOfRowMeanSquares = 0.0;
+#pragma omp parallel for schedule(dynamic, 16) reduction(+ : sum, sumOfSquares, sumOfRowMeanSquares)
+	for (int a = 0; a < poolSize; a++) {
+		double rowSum = 0.0;
+		double rowSumOfSquares = 0.0;
+		for (int b = 0; b < poolSize; b++) {
+			const double h = kernel((GeneIndex)a, (GeneIndex)b);
+			rowSum += h;
+			rowSumOfSquares += h * h;
+		}
+		sum += rowSum;
+		sumOfSquares += rowSumOfSquares;
+		sumOfRowMeanSquares += (rowSum / n) * (rowSum / n);
+	}
+
+	result.mean = sum / (n * n);
+	result.zeta1 =
+		std::max(0.0, sumOfRowMeanSquares / n - result.mean * result.mean);
+	result.zeta2 =
+		std::max(0.0, sumOfSquares / (n * n) - result.mean * result.mean);
+	return result;
+}
+
+// Screening for pairwise-average statistics. Gives every sphere a p-value from
+// the z-score of its statistic under the normal approximation, expressed as the expected chance wins out of randomSampleCount so it goes
+// through Gene::calculatePValue() like a Monte Carlo result would. The normal
+// approximation is only trusted far from the Benjamini-Hochberg boundary:
+// returns the units whose z-score lies within zScoreMargin of the boundary,
+// which still need a Monte Carlo p-value. The statistics in the spheres must
+// have been calculated, by calculateStatisticsInSpheres() or sliding
+// calculateWindowStatistics().
+template <class Gene>
+QVector<int> screenByZScore(WorkUnits &workUnits,
+							const PairwiseNullMoments &moments,
+							int randomSampleCount, double pAdjThreshold,
+							double zScoreMargin) {
+	WorkUnit *units = workUnits.units.data();
+	QVector<double> zScores(workUnits.size());
+
+	const bool lower = lowerIsMoreExtreme<Gene>();
+
+#pragma omp parallel for schedule(dynamic, 16)
+	for (int i = 0; i < workUnits.size(); i++) {
+		WorkUnit &workUnit = units[i];
+		workUnit.statisticInRandom = moments.mean;
+
+		const double z =
+			moments.zScore(workUnit.statisticInSphere, workUnit.geneCount);
+		zScores[i] = z;
+
+		// Normal CDF
+		const double below = 0.5 * std::erfc(-z / sqrt(2.0));
+		const double moreExtreme = lower ? below : 1.0 - below;
+		const double moreExtremeOccurrences = moreExtreme * randomSampleCount;
+		workUnit.chanceWinCount = (int)std::round(moreExtremeOccurrences);
+		workUnit.pValue =
+			Gene::calculatePValue(moreExtremeOccurrences, randomSampleCount);
+		workUnit.pValue =
+			std::max(workUnit.pValue, 1.0 / (double)randomSampleCount);
+	}
+
+	// Find the z-score of the least significant unit that still passes. If
+	// none passes, the most significant unit is the closest to passing.
+	QVector<int> result;
+	const QVector<int> order = benjamini(workUnits);
+	if (order.isEmpty())
+		return result;
+	int boundaryUnit = order.front();
+	for (const int i : order) {
+		if (workUnits[i].adjustedPValue > pAdjThreshold)
+			break;
+		boundaryUnit = i;
+	}
+	const double boundaryZScore = zScores[boundaryUnit];
+
+	for (int i = 0; i < workUnits.size(); i++) {
+		if (std::abs(zScores[i] - boundaryZScore) <= zScoreMargin)
+			result.push_back(i);
+	}
+	return result;
+}
+
+// Given a selection of work units, it combines the overlapping spheres into
+// clusters. Two spheres can only share genes if their centers are closer than
+// the sum of their radii, so we only ever compare such neighbours: a spatial
+// grid over the centers gives the candidate pairs, and a merged cluster
+// inherits the neighbours of both its parts. Overlaps are kept in a priority
+// queue, so each merge only recomputes the pairs of the new cluster.
+inline QVector<GeneSet> clusterByGeneOverlap(const WorkUnits &workUnits,
+											 const QVector<int> &selection,
+											 int poolSize,
+											 double overlapThreshold,
+											 double *maximumOverlapRatio) {
+	*maximumOverlapRatio = 0.0;
+
+	QVector<GeneSet> clusters;
+	QVector<int> sizes;
+	QVector<Vec3D> centers;
+	double maximumRadius = 0.0;
+	for (const int i : selection) {
+		const WorkUnit &workUnit = workUnits[i];
+		GeneSet genes(poolSize);
+		genes.insert(workUnits.genesBegin(workUnit),
+					 workUnits.genesEnd(workUnit));
+		clusters.push_back(genes);
+		sizes.push_back(genes.count());
+		centers.push_back(workUnit.center);
+		maximumRadius = std::max(maximumRadius, workUnit.radius);
+	}
+	if (clusters.size() < 2)
+		return clusters;
+
+	// Candidate pairs
+	QVector<QSet<int>> neighbours(clusters.size());
+	{
+		const SpatialGrid grid(centers, 2.0 * maximumRadius);
+		for (int i = 0; i < selection.size(); i++) {
+			const double radius = workUnits[selection[i]].radius;
+			grid.forEachWithin(
+				centers[i], radius + maximumRadius, [&](int j, double d) {
+					const double reach = radius + workUnits[selection[j]].radius;
+					if (j != i && d <= reach * reach)
+						neighbours[i].insert(j);
+				});
+		}
+	}
+
+	// Overlap of a candidate pair. Versions tell us when an entry has been
+	// made stale by a later merge of either cluster.
+	struct Overlap {
+		double ratio;
+		int first;
+		int second;
+		int firstVersion;
+		int secondVersion;
+
+		// Highest ratio first; ties go to the lower indices.
+		bool operator<(const Overlap &other) const {
+			if (ratio != other.ratio)
+				return ratio < other.ratio;
+			if (first != other.first)
+				return first > other.first;
+			return second > other.second;
+		}
+	};
+	QVector<int> versions(clusters.size(), 0);
+	std::priority_queue<Overlap> queue;
+	auto pushOverlap = [&](int i, int j) {
+		const int minSize = std::min(sizes[i], sizes[j]);
+		const int overlapCount = clusters[i].intersectionCount(clusters[j]);
+		const double overlapRatio = (double)overlapCount / (double)minSize;
+		queue.push({overlapRatio, std::min(i, j), std::max(i, j),
+					versions[std::min(i, j)], versions[std::max(i, j)]});
+	};
+	for (int i = 0; i < clusters.size(); i++) {
+		for (const int j : neighbours[i]) {
+			if (i < j)
+				pushOverlap(i, j);
 		}
-		result.push_back(genes);
 	}
 
 	// Now do hierarchical clustering.
-	while (true) {
+	while (!queue.empty()) {
 		// Find max-overlap pair of clusters
-		*maximumOverlapRatio = 0.0;
-		using GenePair = QPair<int, int>;
-		GenePair bestGenePair(0, 1);
-		GeneList mergedCluster;
-		for (int i = 0; i < result.size(); i++) {
-			for (int j = i + 1; j < result.size(); j++) {
-				const int minSize =
-					std::min(result[i].size(), result[j].size());
-				GeneList intersection = result[i];
-				intersection.intersect(result[j]);
-				const int overlapCount = intersection.size();
-				const double overlapRatio =
-					(double)overlapCount / (double)minSize;
-				if (overlapRatio > *maximumOverlapRatio) {
-					*maximumOverlapRatio = overlapRatio;
-					mergedCluster = result[i];
-					mergedCluster.unite(result[j]);
-					bestGenePair = GenePair(i, j);
-				}
-			}
-		} // end for (all pairs)
+		const Overlap best = queue.top();
+		if (versions[best.first] != best.firstVersion ||
+			versions[best.second] != best.secondVersion) {
+			queue.pop();
+			continue;
+		}
 
 		// When we reach the point where the best-overlapping clusters may be
-		// considered distinct, we are done.
-		if (*maximumOverlapRatio < overlapThreshold) {
+		// considered distinct, we are done. This is the largest overlap left
+		// unmerged; it stays 0 if every candidate pair got merged.
+		if (best.ratio < overlapThreshold) {
+			*maximumOverlapRatio = best.ratio;
 			break;
 		}
+		queue.pop();
+
+		// Not done yet: apply the merge and continue. The merged cluster takes
+		// the place of the first one and the second one is retired.
+		const int merged = best.first;
+		const int retired = best.second;
+		clusters[merged].unite(clusters[retired]);
+		sizes[merged] = clusters[merged].count();
+		clusters[retired] = GeneSet();
+		sizes[retired] = 0;
+		versions[merged]++;
+		versions[retired] = -1;
+
+		neighbours[merged].unite(neighbours[retired]);
+		neighbours[merged].remove(merged);
+		neighbours[merged].remove(retired);
+		for (const int k : neighbours[retired]) {
+			neighbours[k].remove(retired);
+			if (k != merged)
+				neighbours[k].insert(merged);
+		}
+		neighbours[retired].clear();
 
-		// Not done yet: apply the merge and continue.
-		result[bestGenePair.second] = result.back();
-		result.pop_back();
-		result[bestGenePair.first] =
-			result.back(); // we can do this always: first is less than second
-						   // by design.
-		result.pop_back();
-		result.push_back(mergedCluster);
+		for (const int k : neighbours[merged]) {
+			pushOverlap(merged, k);
+		}
 	} // end hierarchical clustering
 
+	QVector<GeneSet> result;
+	for (int i = 0; i < clusters.size(); i++) {
+		if (versions[i] >= 0)
+			result.push_back(clusters[i]);
+	}
+
 	return result;
 }
 
+// Clusters the selected work units into fields and makes the fields disjoint,
+// as the sphere programs do: ordered by size, smaller fields keep the genes
+// they share with larger ones.
+inline QVector<GeneSet> disjointFields(const WorkUnits &workUnits,
+									   const QVector<int> &selection,
+									   int poolSize, double overlapThreshold) {
+	double maximumOverlapRatio = 0.0;
+	QVector<GeneSet> fields =
+		clusterByGeneOverlap(workUnits, selection, poolSize, overlapThreshold,
+							 &maximumOverlapRatio);
+	std::sort(fields.begin(), fields.end(),
+			  [](const GeneSet &a, const GeneSet &b) {
+				  return a.count() < b.count();
+			  });
+	GeneSet genesUsed(poolSize);
+	for (GeneSet &field : fields) {
+		field.subtract(genesUsed);
+		genesUsed.unite(field);
+	}
+	return fields;
+}
+
 #endif // _SPHERE_TEST_H_
@@ -0,0 +1,195 @@
+/*
+Copyright 2021 Michael Georgoulopoulos
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files(the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and / or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions :
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+/*
+Merging t-digest (Dunning & Ertl, 2019): a compact, mergeable summary of a
+distribution of doubles. Values are kept as weighted centroids, whose size is
+limited by a scale function that allows big centroids around the median and
+only tiny ones towards both ends. This is what we want for null distributions,
+where only the tails matter for p-values: the most extreme values are kept
+exactly and the error of tail probabilities shrinks towards the ends.
+
+Memory is bounded by the compression parameter, not by the number of values:
+with the default compression of 500 a digest holds a few hundred centroids,
+a few kilobytes, whatever the sample count. Digests built by different
+threads are merged into one at the end.
+*/
+
+#ifndef _T_DIGEST_H_
+#define _T_DIGEST_H_
+
+#include <QVector>
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+class TDigest {
+  public:
+	struct Centroid {
+		double mean;
+		double weight;
+	};
+
+	explicit TDigest(double compression = 500.0) : compression(compression) {}
+
+	void add(double x, double weight = 1.0) {
+		buffer.push_back({x, weight});
+		minimum = std::min(minimum, x);
+		maximum = std::max(maximum, x);
+		if (buffer.size() >= bufferCapacity())
+			compress();
+	}
+
+	void merge(const TDigest &other) {
+		for (const Centroid &centroid : other.buffer) {
+			buffer.push_back(centroid);
+		}
+		for (const Centroid &centroid : other.centroids) {
+			buffer.push_back(centroid);
+		}
+		minimum = std::min(minimum, other.minimum);
+		maximum = std::max(maximum, other.maximum);
+		compress();
+	}
+
+	// Merges the buffered values into the centroids. Call before queries.
+	void compress() {
+		if (buffer.isEmpty())
+			return;
+
+		buffer += centroids;
+		std::sort(buffer.begin(), buffer.end(),
+				  [](const Centroid &a, const Centroid &b) {
+					  return a.mean < b.mean;
+				  });
+		totalWeight = 0.0;
+		for (const Centroid &centroid : buffer) {
+			totalWeight += centroid.weight;
+		}
+
+		centroids.clear();
+		Centroid current = buffer.front();
+		double weightSoFar = 0.0;
+		double quantileLimit = quantileOfScale(scaleOfQuantile(0.0) + 1.0);
+		for (int i = 1; i < buffer.size(); i++) {
+			const Centroid &next = buffer[i];
+			const double quantile =
+				(weightSoFar + current.weight + next.weight) / totalWeight;
+			if (quantile <= quantileLimit) {
+				// Absorb the next one
+				current.weight += next.weight;
+				current.mean += (next.mean - current.mean) * next.weight /
+								current.weight;
+			} else {
+				centroids.push_back(current);
+				weightSoFar += current.weight;
+				quantileLimit = quantileOfScale(
+					scaleOfQuantile(weightSoFar / totalWeight) + 1.0);
+				current = next;
+			}
+		}
+		centroids.push_back(current);
+		buffer.clear();
+	}
+
+	double count() const { return totalWeight; }
+	int centroidCount() const { return centroids.size(); }
+	int byteSize() const { return centroids.size() * (int)sizeof(Centroid); }
+
+	// Fraction of the values that are at most x. Interpolates between
+	// centroid means, treating each centroid as spread evenly around its
+	// mean, except for single values (including the minimum and maximum),
+	// which are exact. The digest must be compressed.
+	double cdf(double x) const {
+		if (centroids.isEmpty())
+			return 0.0;
+		if (x < minimum)
+			return 0.0;
+		if (x >= maximum)
+			return 1.0;
+
+		const Centroid &first = centroids.front();
+		const Centroid &last = centroids.back();
+		if (x < first.mean) {
+			// The minimum is one value, the rest of the first half
+			// centroid spreads up to its mean
+			double below = 1.0;
+			if (first.mean > minimum && first.weight > 2.0) {
+				below += (first.weight / 2.0 - 1.0) * (x - minimum) /
+						 (first.mean - minimum);
+			}
+			return std::min(below, first.weight / 2.0) / totalWeight;
+		}
+		if (x >= last.mean) {
+			double above = 1.0;
+			if (maximum > last.mean && last.weight > 2.0) {
+				above += (last.weight / 2.0 - 1.0) * (maximum - x) /
+						 (maximum - last.mean);
+			}
+			return 1.0 - std::min(above, last.weight / 2.0) / totalWeight;
+		}
+
+		double weightBelow = first.weight / 2.0;
+		for (int i = 0; i + 1 < centroids.size(); i++) {
+			const Centroid &left = centroids[i];
+			const Centroid &right = centroids[i + 1];
+			const double weightBetween = (left.weight + right.weight) / 2.0;
+			if (x < right.mean) {
+				// Single values sit exactly at their mean: half of a
+				// single left value is at most x, none of a right one
+				const double leftSingle = left.weight == 1.0 ? 0.5 : 0.0;
+				const double rightSingle = right.weight == 1.0 ? 0.5 : 0.0;
+				const double spread = weightBetween - leftSingle - rightSingle;
+				return (weightBelow + leftSingle +
+						spread * (x - left.mean) / (right.mean - left.mean)) /
+					   totalWeight;
+			}
+			weightBelow += weightBetween;
+		}
+		return 1.0;
+	}
+
+  private:
+	// The k1 scale function: centroids may only span one unit of k, which
+	// is a wide range of quantiles in the middle and a narrow one near 0
+	// and 1.
+	double scaleOfQuantile(double q) const {
+		return compression / (2.0 * M_PI) * asin(2.0 * q - 1.0);
+	}
+	double quantileOfScale(double k) const {
+		const double limit = compression / 4.0;
+		if (k >= limit)
+			return 1.0;
+		return (sin(k * 2.0 * M_PI / compression) + 1.0) / 2.0;
+	}
+
+	int bufferCapacity() const { return (int)(5.0 * compression); }
+
+	double compression;
+	double totalWeight = 0.0;
+	double minimum = std::numeric_limits<double>::infinity();
+	double maximum = -std::numeric_limits<double>::infinity();
+	QVector<Centroid> centroids;
+	QVector<Centroid> buffer;
+};
+
+#endif // _T_DIGEST_H_
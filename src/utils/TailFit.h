@@ -0,0 +1,229 @@
+/*
+Copyright 2021 Michael Georgoulopoulos
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files(the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and / or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions :
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+/*
+Generalized Pareto tail fits for Monte Carlo null distributions. A sphere that
+beats all but a handful of the random samples only gets a p-value as fine as
+1/sampleCount, so resolving small p-values used to take very large null
+tables. Above a high threshold the tail of almost any null distribution is
+well approximated by a generalized Pareto distribution (GPD), so we fit one to
+the largest values of the table and read small tail probabilities from the fit
+instead (Knijnenburg et al., 2009).
+
+The fit uses probability-weighted moments (Hosking & Wallis, 1987), which
+need no iteration and behave well for the few hundred exceedances we have. It
+is checked with the Anderson-Darling statistic; when the fit is poor we retry
+with fewer exceedances, closer to the extreme end, and give up below a minimum
+count, in which case the empirical count is used as before.
+*/
+
+#ifndef _TAIL_FIT_H_
+#define _TAIL_FIT_H_
+
+#include <QVector>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+
+namespace TailFit {
+
+struct Options {
+	// Exceedances we start fitting with, and the fewest we accept
+	int maximumExceedances = 250;
+	int minimumExceedances = 50;
+	int exceedanceStep = 10;
+
+	// Roughly the 5% critical value of the Anderson-Darling statistic for a
+	// GPD with estimated parameters, over the usual range of shapes.
+	double andersonDarlingLimit = 1.0;
+
+	// Below this many chance wins the empirical p-value is too coarse and
+	// the fit is used instead.
+	int minimumChanceWins = 10;
+};
+
+// GPD fitted to the exceedances over threshold of a sample, in Hosking's
+// parameterization: survival (1 - shape * y / scale)^(1 / shape).
+struct Fit {
+	bool valid = false;
+	int sampleCount = 0;
+	int exceedanceCount = 0;
+	double threshold = 0.0;
+	double shape = 0.0;
+	double scale = 0.0;
+	double andersonDarling = 0.0;
+
+	// Probability of an exceedance larger than y
+	double survival(double y) const {
+		if (y <= 0.0)
+			return 1.0;
+		if (std::abs(shape) < 1e-9)
+			return exp(-y / scale);
+		const double base = 1.0 - shape * y / scale;
+		if (base <= 0.0)
+			return 0.0; // beyond the upper end point
+		return pow(base, 1.0 / shape);
+	}
+
+	// Probability of a sample being at least x. Only valid above the
+	// threshold.
+	double tailProbability(double x) const {
+		return (double)exceedanceCount / (double)sampleCount *
+			   survival(x - threshold);
+	}
+};
+
+// Probability-weighted moment estimate of the GPD for exceedances sorted
+// ascending, with the shape limited to unbounded tails.
+inline void fitParameters(const double *exceedances, int count, Fit *fit) {
+	double a0 = 0.0;
+	double a1 = 0.0;
+	for (int i = 0; i < count; i++) {
+		a0 += exceedances[i];
+		a1 += exceedances[i] * (double)(count - 1 - i) / (double)(count - 1);
+	}
+	a0 /= (double)count;
+	a1 /= (double)count;
+
+	fit->shape = a0 / (a0 - 2.0 * a1) - 2.0;
+	fit->scale = 2.0 * a0 * a1 / (a0 - 2.0 * a1);
+
+	// A positive shape means a bounded tail, whose end point is a poor
+	// estimate from a few hundred values: spheres near or past it would get
+	// absurdly small p-values. Use the exponential tail of the same mean
+	// instead, which is heavier and so errs on the side of chance.
+	if (fit->shape > 0.0) {
+		fit->shape = 0.0;
+		fit->scale = a0;
+	}
+}
+
+// Anderson-Darling statistic of exceedances sorted ascending against the
+// fitted distribution.
+inline double andersonDarling(const double *exceedances, int count,
+							  const Fit &fit) {
+	const double epsilon = 1e-12;
+	double sum = 0.0;
+	for (int i = 0; i < count; i++) {
+		const double lower =
+			1.0 - fit.survival(exceedances[i]); // CDF of the i-th smallest
+		const double upper = fit.survival(exceedances[count - 1 - i]);
+		sum += (2.0 * i + 1.0) * (log(std::max(lower, epsilon)) +
+								  log(std::max(upper, epsilon)));
+	}
+	return -(double)count - sum / (double)count;
+}
+
+// Fits the upper tail of a sample sorted ascending. Returns an invalid fit if
+// no acceptable fit exists.
+inline Fit fitUpperTail(const double *sorted, int count,
+						const Options &options = Options()) {
+	Fit fit;
+	fit.sampleCount = count;
+
+	QVector<double> exceedances;
+	int exceedanceCount = std::min(options.maximumExceedances, count / 10);
+	for (; exceedanceCount >= options.minimumExceedances;
+		 exceedanceCount -= options.exceedanceStep) {
+		// Threshold halfway between the largest non-exceedance and the
+		// smallest exceedance
+		const int first = count - exceedanceCount;
+		fit.threshold = 0.5 * (sorted[first - 1] + sorted[first]);
+		exceedances.resize(exceedanceCount);
+		for (int i = 0; i < exceedanceCount; i++) {
+			exceedances[i] = sorted[first + i] - fit.threshold;
+		}
+		if (exceedances.back() <= 0.0)
+			continue; // all tied, nothing to fit
+
+		fitParameters(exceedances.constData(), exceedanceCount, &fit);
+		if (!(fit.scale > 0.0) || !std::isfinite(fit.shape))
+			continue;
+
+		fit.exceedanceCount = exceedanceCount;
+		fit.andersonDarling =
+			andersonDarling(exceedances.constData(), exceedanceCount, fit);
+		if (fit.andersonDarling <= options.andersonDarlingLimit) {
+			fit.valid = true;
+			return fit;
+		}
+	}
+
+	fit.valid = false;
+	return fit;
+}
+
+// Fits the lower tail of a sample sorted ascending, as the upper tail of the
+// negated sample. Use with negated values: tailProbability(-x) is the
+// probability of a sample being at most x.
+inline Fit fitLowerTail(const double *sorted, int count,
+						const Options &options = Options()) {
+	QVector<double> negated(count);
+	for (int i = 0; i < count; i++) {
+		negated[i] = -sorted[count - 1 - i];
+	}
+	return fitUpperTail(negated.constData(), count, options);
+}
+
+// Goodness-of-fit summary over many fits
+struct Report {
+	int tailCount = 0;
+	int fittedCount = 0;
+	int exceedanceSum = 0;
+	double worstAndersonDarling = 0.0;
+	double smallestShape = 0.0;
+	double largestShape = 0.0;
+
+	// P-values that came from a fit rather than from counting
+	int fittedPValueCount = 0;
+
+	void add(const Fit &fit) {
+		tailCount++;
+		if (!fit.valid)
+			return;
+		if (fittedCount == 0) {
+			smallestShape = largestShape = fit.shape;
+		}
+		fittedCount++;
+		exceedanceSum += fit.exceedanceCount;
+		worstAndersonDarling =
+			std::max(worstAndersonDarling, fit.andersonDarling);
+		smallestShape = std::min(smallestShape, fit.shape);
+		largestShape = std::max(largestShape, fit.shape);
+	}
+
+	void print() const {
+		printf("Tail fits: %d of %d tails accepted", fittedCount, tailCount);
+		if (fittedCount > 0) {
+			printf(", %.01f exceedances on average, shape %.03f to %.03f, "
+				   "worst Anderson-Darling %.03f",
+				   (double)exceedanceSum / (double)fittedCount, smallestShape,
+				   largestShape, worstAndersonDarling);
+		}
+		printf("\n");
+		printf("P-values from tail fits: %d\n", fittedPValueCount);
+	}
+};
+
+} // end namespace TailFit
+
+#endif // _TAIL_FIT_H_
@@ -73,6 +73,14 @@ class Vec3D {
 		return displacement.length();
 	}
 
+	// Squared Euclidean distance. Cheaper when only comparing distances.
+	static double distanceSquared(const Vec3D &a, const Vec3D &b) {
+		const double dx = b.x - a.x;
+		const double dy = b.y - a.y;
+		const double dz = b.z - a.z;
+		return dx * dx + dy * dy + dz * dz;
+	}
+
 	// Linear interpolation of scalars
 	static double mix(double a, double b, double t) {
 		const double omt = 1.0 - t;
@@ -0,0 +1,114 @@
+/*
+Copyright 2021 Michael Georgoulopoulos
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files(the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and / or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions :
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+/*
+This module defines class WindowGeneSampler, the linear-genome companion of
+SphereGeneSampler. Instead of genes within a radius in 3D, it takes windows of
+consecutive genes along a chromosome, the 1D baseline for the sphere tests.
+Like EntropySampler::sampleSlice(), a window is a slice of the genes in genome
+order; windows never span two chromosomes.
+*/
+
+#ifndef _WINDOW_GENE_SAMPLER_H_
+#define _WINDOW_GENE_SAMPLER_H_
+
+#include <QHash>
+#include <QSqlDatabase>
+#include <QSqlError>
+#include <QSqlQuery>
+#include <QString>
+#include <QVariant>
+#include <QVector>
+
+#include "GenePool.h"
+
+namespace Sampler {
+
+class WindowGeneSampler {
+  public:
+	// Genes of the pool in genome order, and where each chromosome starts in
+	// that order
+	WindowGeneSampler(const QVector<GeneIndex> &genomeOrder,
+					  const QVector<int> &chromosomeStarts)
+		: genomeOrder(genomeOrder), chromosomeStarts(chromosomeStarts) {}
+
+	// Reads the genome order of the pool's genes from the Loci table. Genes
+	// missing from the pool are skipped.
+	template <class Gene>
+	static WindowGeneSampler fromLoci(QSqlDatabase &db,
+									  const GenePool<Gene> &pool) {
+		QHash<QString, int> geneIds;
+		for (int i = 0; i < pool.size(); i++) {
+			geneIds.insert(pool.names[i], i);
+		}
+
+		QVector<GeneIndex> genomeOrder;
+		QVector<int> chromosomeStarts;
+		const QString sql =
+			"SELECT Gene, Chromosome FROM Loci ORDER BY Chromosome, Start";
+		QSqlQuery query(sql, db);
+		int chromosome = -1;
+		while (query.next()) {
+			const int id = geneIds.value(query.value(0).toString(), -1);
+			if (id < 0)
+				continue;
+			if (query.value(1).toInt() != chromosome) {
+				chromosome = query.value(1).toInt();
+				chromosomeStarts.push_back(genomeOrder.size());
+			}
+			genomeOrder.push_back((GeneIndex)id);
+		}
+
+		if (query.lastError().type() != QSqlError::NoError)
+			throw(QString("Failed to process query: %1\nDBTEXT: %2")
+					  .arg(sql)
+					  .arg(query.lastError().databaseText()));
+
+		return WindowGeneSampler(genomeOrder, chromosomeStarts);
+	}
+
+	// Gene IDs in genome order. Windows are slices of this.
+	const QVector<GeneIndex> &genes() const { return genomeOrder; }
+
+	// Where every window of windowSize genes starts in genes(), stride genes
+	// apart along each chromosome
+	QVector<int> windowStarts(int windowSize, int stride) const {
+		QVector<int> result;
+		for (int c = 0; c < chromosomeStarts.size(); c++) {
+			const int end = c + 1 < chromosomeStarts.size()
+								? chromosomeStarts[c + 1]
+								: genomeOrder.size();
+			for (int start = chromosomeStarts[c]; start + windowSize <= end;
+				 start += stride) {
+				result.push_back(start);
+			}
+		}
+		return result;
+	}
+
+  private:
+	QVector<GeneIndex> genomeOrder;
+	QVector<int> chromosomeStarts;
+};
+
+} // end namespace Sampler
+
+#endif // _WINDOW_GENE_SAMPLER_H_